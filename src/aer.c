@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#include <string.h>
+
+#include "aer.h"
+
+/*
+ * Follows the PCIe Advanced Error Reporting counters of a GPU, and of
+ * the ports between it and the root complex, as flaky risers and
+ * marginal links show up as correctable errors anywhere along the way.
+ *
+ * A link is degraded while correctable errors come in faster than the
+ * threshold, and only goes back to good once they're down to half of
+ * it, so that it doesn't flap. Any uncorrectable error makes it failing
+ * until the next update.
+ */
+
+typedef struct {
+	char *path;
+	AerCounters counters;
+} AerPort;
+
+struct _AerMonitor {
+	char *device_path;
+	GArray *ports; /* array of AerPort, the GPU first */
+	gint64 last_update;
+	gdouble rate; /* correctable errors per minute */
+	AerHealth health;
+};
+
+static const char * const health_names[] = {
+	[AER_HEALTH_GOOD] = "good",
+	[AER_HEALTH_DEGRADED] = "degraded",
+	[AER_HEALTH_FAILING] = "failing",
+};
+
+const char *
+aer_health_to_string (AerHealth health)
+{
+	return health_names[health];
+}
+
+static gboolean
+has_aer_counters (const char *path)
+{
+	g_autofree char *attr = NULL;
+
+	attr = g_build_filename (path, "aer_dev_correctable", NULL);
+	return g_file_test (attr, G_FILE_TEST_EXISTS);
+}
+
+/* Counters are one per line, "TOTAL_ERR_COR 12" being the sum on
+ * recent kernels */
+static gboolean
+read_counter (const char *dir,
+	      const char *name,
+	      guint64    *value)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint64 sum = 0;
+	guint i;
+
+	path = g_build_filename (dir, name, NULL);
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return FALSE;
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		const char *count;
+
+		count = strrchr (lines[i], ' ');
+		if (count == NULL)
+			continue;
+		if (g_str_has_prefix (lines[i], "TOTAL_ERR_")) {
+			*value = g_ascii_strtoull (count + 1, NULL, 10);
+			return TRUE;
+		}
+		sum += g_ascii_strtoull (count + 1, NULL, 10);
+	}
+	*value = sum;
+
+	return TRUE;
+}
+
+static void
+read_counters (AerPort *port)
+{
+	read_counter (port->path, "aer_dev_correctable", &port->counters.correctable);
+	read_counter (port->path, "aer_dev_nonfatal", &port->counters.nonfatal);
+	read_counter (port->path, "aer_dev_fatal", &port->counters.fatal);
+}
+
+static gboolean
+is_suspended (AerMonitor *monitor)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *status = NULL;
+
+	path = g_build_filename (monitor->device_path, "power", "runtime_status", NULL);
+	if (!g_file_get_contents (path, &status, NULL, NULL))
+		return FALSE;
+	return !g_str_has_prefix (status, "active");
+}
+
+/* Returns NULL if neither the GPU nor its upstream ports have counters */
+AerMonitor *
+aer_monitor_new (const char *device_path)
+{
+	AerMonitor *monitor;
+	g_autofree char *path = NULL;
+
+	monitor = g_new0 (AerMonitor, 1);
+	monitor->device_path = g_strdup (device_path);
+	monitor->ports = g_array_new (FALSE, TRUE, sizeof (AerPort));
+
+	/* The GPU itself might not report errors, but its ports might */
+	if (has_aer_counters (device_path)) {
+		AerPort port = { g_strdup (device_path), };
+
+		g_array_append_val (monitor->ports, port);
+	}
+	path = g_path_get_dirname (device_path);
+	while (has_aer_counters (path)) {
+		AerPort port = { g_strdup (path), };
+		char *parent;
+
+		g_array_append_val (monitor->ports, port);
+		parent = g_path_get_dirname (path);
+		g_free (path);
+		path = parent;
+	}
+
+	if (monitor->ports->len == 0) {
+		aer_monitor_free (monitor);
+		return NULL;
+	}
+
+	return monitor;
+}
+
+void
+aer_monitor_free (AerMonitor *monitor)
+{
+	guint i;
+
+	if (monitor == NULL)
+		return;
+
+	for (i = 0; i < monitor->ports->len; i++)
+		g_free (g_array_index (monitor->ports, AerPort, i).path);
+	g_array_free (monitor->ports, TRUE);
+	g_free (monitor->device_path);
+	g_free (monitor);
+}
+
+const char *
+aer_monitor_get_path (AerMonitor *monitor)
+{
+	return monitor->device_path;
+}
+
+/* Counters go back to 0 when the device is reset */
+static guint64
+counter_delta (guint64 old,
+	       guint64 new)
+{
+	return new >= old ? new - old : new;
+}
+
+/* Returns whether the link health changed, threshold being in
+ * correctable errors per minute */
+gboolean
+aer_monitor_update (AerMonitor *monitor,
+		    guint       threshold)
+{
+	guint64 correctable = 0, uncorrectable = 0, worst = 0;
+	const char *worst_path = NULL;
+	AerHealth health;
+	gint64 now;
+	guint i;
+
+	/* Leave it be, it had no traffic anyway */
+	if (is_suspended (monitor))
+		return FALSE;
+
+	now = g_get_monotonic_time ();
+	for (i = 0; i < monitor->ports->len; i++) {
+		AerPort *port = &g_array_index (monitor->ports, AerPort, i);
+		AerCounters old = port->counters;
+		guint64 delta;
+
+		read_counters (port);
+		delta = counter_delta (old.correctable, port->counters.correctable);
+		correctable += delta;
+		uncorrectable += counter_delta (old.nonfatal, port->counters.nonfatal) +
+				 counter_delta (old.fatal, port->counters.fatal);
+		if (delta > worst) {
+			worst = delta;
+			worst_path = port->path;
+		}
+	}
+
+	/* Errors from before we started don't say much about the rate */
+	if (monitor->last_update == 0) {
+		monitor->last_update = now;
+		return FALSE;
+	}
+
+	monitor->rate = correctable * 60.0 * G_USEC_PER_SEC / MAX (now - monitor->last_update, 1);
+	monitor->last_update = now;
+
+	if (uncorrectable > 0)
+		health = AER_HEALTH_FAILING;
+	else if (monitor->rate >= threshold)
+		health = AER_HEALTH_DEGRADED;
+	else if (monitor->health != AER_HEALTH_GOOD && monitor->rate >= threshold / 2.0)
+		health = AER_HEALTH_DEGRADED;
+	else
+		health = AER_HEALTH_GOOD;
+
+	if (health == monitor->health)
+		return FALSE;
+
+	if (health == AER_HEALTH_FAILING)
+		g_warning ("PCIe link of %s is failing: %" G_GUINT64_FORMAT " uncorrectable errors",
+			   monitor->device_path, uncorrectable);
+	else if (health == AER_HEALTH_DEGRADED)
+		g_warning ("PCIe link of %s is degraded: %.1f correctable errors per minute, mostly on %s",
+			   monitor->device_path, monitor->rate, worst_path ? worst_path : monitor->device_path);
+	else
+		g_message ("PCIe link of %s is good again", monitor->device_path);
+	monitor->health = health;
+
+	return TRUE;
+}
+
+AerHealth
+aer_monitor_get_health (AerMonitor *monitor)
+{
+	return monitor->health;
+}
+
+gdouble
+aer_monitor_get_rate (AerMonitor *monitor)
+{
+	return monitor->rate;
+}
+
+/* Summed over the GPU and its upstream ports */
+void
+aer_monitor_get_counters (AerMonitor  *monitor,
+			  AerCounters *counters)
+{
+	guint i;
+
+	memset (counters, 0, sizeof (AerCounters));
+	for (i = 0; i < monitor->ports->len; i++) {
+		AerPort *port = &g_array_index (monitor->ports, AerPort, i);
+
+		counters->correctable += port->counters.correctable;
+		counters->nonfatal += port->counters.nonfatal;
+		counters->fatal += port->counters.fatal;
+	}
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef enum {
+	AER_HEALTH_GOOD,
+	AER_HEALTH_DEGRADED,
+	AER_HEALTH_FAILING
+} AerHealth;
+
+typedef struct {
+	guint64 correctable;
+	guint64 nonfatal;
+	guint64 fatal;
+} AerCounters;
+
+typedef struct _AerMonitor AerMonitor;
+
+AerMonitor *aer_monitor_new          (const char  *device_path);
+void        aer_monitor_free         (AerMonitor  *monitor);
+const char *aer_monitor_get_path     (AerMonitor  *monitor);
+gboolean    aer_monitor_update       (AerMonitor  *monitor,
+				      guint        threshold);
+AerHealth   aer_monitor_get_health   (AerMonitor  *monitor);
+void        aer_monitor_get_counters (AerMonitor  *monitor,
+				      AerCounters *counters);
+gdouble     aer_monitor_get_rate     (AerMonitor  *monitor);
+
+const char *aer_health_to_string     (AerHealth    health);
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Container Device Interface specs, see
+ * https://github.com/cncf-tags/container-device-interface/blob/main/SPEC.md
+ *
+ * Each spec file describes one kind of device, such as "hadess.net/gpu", and
+ * is replaced atomically so that container runtimes never see a partial file.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "cdi.h"
+
+#define CDI_VERSION "0.6.0"
+
+struct _CdiSpec {
+	char *kind;
+	GString *devices;
+	guint num_devices;
+};
+
+CdiSpec *
+cdi_spec_new (const char *kind)
+{
+	CdiSpec *spec;
+
+	spec = g_new0 (CdiSpec, 1);
+	spec->kind = g_strdup (kind);
+	spec->devices = g_string_new (NULL);
+	return spec;
+}
+
+void
+cdi_spec_free (CdiSpec *spec)
+{
+	if (spec == NULL)
+		return;
+
+	g_free (spec->kind);
+	g_string_free (spec->devices, TRUE);
+	g_free (spec);
+}
+
+static void
+append_json_string (GString    *str,
+		    const char *value)
+{
+	const char *p;
+
+	g_string_append_c (str, '"');
+	for (p = value; *p != '\0'; p++) {
+		switch (*p) {
+		case '"':
+			g_string_append (str, "\\\"");
+			break;
+		case '\\':
+			g_string_append (str, "\\\\");
+			break;
+		case '\n':
+			g_string_append (str, "\\n");
+			break;
+		case '\t':
+			g_string_append (str, "\\t");
+			break;
+		default:
+			if ((guchar) *p < 0x20)
+				g_string_append_printf (str, "\\u%04x", (guchar) *p);
+			else
+				g_string_append_c (str, *p);
+		}
+	}
+	g_string_append_c (str, '"');
+}
+
+/* Device names may only use alphanumerics, '_', '.', ':' and '-' */
+static char *
+get_device_name (const char *name)
+{
+	char *ret;
+
+	ret = g_strdup (name);
+	g_strcanon (ret, G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "_.:-", '_');
+	return ret;
+}
+
+void
+cdi_spec_add_device (CdiSpec             *spec,
+		     const char          *name,
+		     const char * const  *nodes,
+		     GPtrArray           *env)
+{
+	g_autofree char *device_name = NULL;
+	GString *str = spec->devices;
+	guint i;
+
+	device_name = get_device_name (name);
+
+	if (spec->num_devices > 0)
+		g_string_append (str, ",\n");
+	g_string_append (str, "    {\n      \"name\": ");
+	append_json_string (str, device_name);
+	g_string_append (str, ",\n      \"containerEdits\": {\n        \"deviceNodes\": [");
+	for (i = 0; nodes[i] != NULL; i++) {
+		g_string_append (str, i == 0 ? "\n" : ",\n");
+		g_string_append (str, "          { \"path\": ");
+		append_json_string (str, nodes[i]);
+		g_string_append (str, " }");
+	}
+	g_string_append (str, "\n        ]");
+
+	if (env != NULL && env->len >= 2) {
+		g_string_append (str, ",\n        \"env\": [");
+		for (i = 0; i + 1 < env->len; i += 2) {
+			g_autofree char *var = NULL;
+
+			var = g_strdup_printf ("%s=%s",
+					       (const char *) env->pdata[i],
+					       (const char *) env->pdata[i + 1]);
+			g_string_append (str, i == 0 ? "\n" : ",\n");
+			g_string_append (str, "          ");
+			append_json_string (str, var);
+		}
+		g_string_append (str, "\n        ]");
+	}
+
+	g_string_append (str, "\n      }\n    }");
+	spec->num_devices++;
+}
+
+gboolean
+cdi_spec_write (CdiSpec     *spec,
+		const char  *dir,
+		GError     **error)
+{
+	g_autoptr(GString) contents = NULL;
+	g_autofree char *filename = NULL;
+	g_autofree char *path = NULL;
+
+	/* "vendor/class" is stored as "vendor-class.json" */
+	filename = g_strdup_printf ("%s.json", spec->kind);
+	g_strdelimit (filename, "/", '-');
+	path = g_build_filename (dir, filename, NULL);
+
+	/* A spec needs at least one device */
+	if (spec->num_devices == 0) {
+		if (g_unlink (path) < 0 && errno != ENOENT) {
+			int errsv = errno;
+			g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+				     "Could not remove '%s': %s", path, g_strerror (errsv));
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	if (g_mkdir_with_parents (dir, 0755) < 0) {
+		int errsv = errno;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "Could not create '%s': %s", dir, g_strerror (errsv));
+		return FALSE;
+	}
+
+	contents = g_string_new ("{\n  \"cdiVersion\": ");
+	append_json_string (contents, CDI_VERSION);
+	g_string_append (contents, ",\n  \"kind\": ");
+	append_json_string (contents, spec->kind);
+	g_string_append (contents, ",\n  \"devices\": [\n");
+	g_string_append_len (contents, spec->devices->str, spec->devices->len);
+	g_string_append (contents, "\n  ]\n}\n");
+
+	/* Written to a temporary file, and renamed over the old spec */
+	return g_file_set_contents (path, contents->str, contents->len, error);
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _CdiSpec CdiSpec;
+
+CdiSpec  *cdi_spec_new        (const char          *kind);
+void      cdi_spec_free       (CdiSpec             *spec);
+void      cdi_spec_add_device (CdiSpec             *spec,
+			       const char          *name,
+			       const char * const  *nodes,
+			       GPtrArray           *env);
+gboolean  cdi_spec_write      (CdiSpec             *spec,
+			       const char          *dir,
+			       GError             **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (CdiSpec, cdi_spec_free)
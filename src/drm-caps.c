@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <drm/drm.h>
+
+#include "drm-caps.h"
+
+void
+drm_caps_free (DrmCaps *caps)
+{
+	if (caps == NULL)
+		return;
+
+	g_free (caps->driver);
+	g_free (caps->version);
+	g_strfreev (caps->capabilities);
+	g_free (caps);
+}
+
+static int
+drm_ioctl (int            fd,
+	   unsigned long  request,
+	   void          *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl (fd, request, arg);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	return ret;
+}
+
+static gboolean
+get_drm_cap (int      fd,
+	     guint64  capability,
+	     guint64 *value)
+{
+	struct drm_get_cap cap = { 0, };
+
+	cap.capability = capability;
+	if (drm_ioctl (fd, DRM_IOCTL_GET_CAP, &cap) < 0)
+		return FALSE;
+	*value = cap.value;
+	return TRUE;
+}
+
+DrmCaps *
+drm_caps_probe (const char  *path,
+		GError     **error)
+{
+	struct drm_version version = { 0, };
+	char name[64] = { 0, };
+	GPtrArray *capabilities;
+	DrmCaps *caps;
+	guint64 value;
+	int fd;
+
+	fd = open (path, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		int errsv = errno;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "Could not open '%s': %s", path, g_strerror (errsv));
+		return NULL;
+	}
+
+	version.name = name;
+	version.name_len = sizeof (name) - 1;
+	if (drm_ioctl (fd, DRM_IOCTL_VERSION, &version) < 0) {
+		int errsv = errno;
+		g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errsv),
+			     "Could not get DRM version for '%s': %s", path, g_strerror (errsv));
+		close (fd);
+		return NULL;
+	}
+	name[MIN (version.name_len, sizeof (name) - 1)] = '\0';
+
+	/* GEM and VM features are only exposed through driver-specific
+	 * ioctls, so stick to what every DRM driver answers to */
+	capabilities = g_ptr_array_new ();
+	if (get_drm_cap (fd, DRM_CAP_PRIME, &value)) {
+		if (value & DRM_PRIME_CAP_IMPORT)
+			g_ptr_array_add (capabilities, g_strdup ("prime-import"));
+		if (value & DRM_PRIME_CAP_EXPORT)
+			g_ptr_array_add (capabilities, g_strdup ("prime-export"));
+	}
+	if (get_drm_cap (fd, DRM_CAP_SYNCOBJ, &value) && value)
+		g_ptr_array_add (capabilities, g_strdup ("syncobj"));
+	if (get_drm_cap (fd, DRM_CAP_SYNCOBJ_TIMELINE, &value) && value)
+		g_ptr_array_add (capabilities, g_strdup ("syncobj-timeline"));
+	g_ptr_array_add (capabilities, NULL);
+	close (fd);
+
+	caps = g_new0 (DrmCaps, 1);
+	caps->driver = g_strdup (name);
+	caps->version = g_strdup_printf ("%d.%d.%d",
+					 version.version_major,
+					 version.version_minor,
+					 version.version_patchlevel);
+	caps->capabilities = (char **) g_ptr_array_free (capabilities, FALSE);
+
+	return caps;
+}
+
+DrmCaps *
+drm_caps_load (GKeyFile   *keyfile,
+	       const char *group)
+{
+	DrmCaps *caps;
+
+	if (!g_key_file_has_group (keyfile, group))
+		return NULL;
+
+	caps = g_new0 (DrmCaps, 1);
+	caps->driver = g_key_file_get_string (keyfile, group, "Driver", NULL);
+	caps->version = g_key_file_get_string (keyfile, group, "Version", NULL);
+	caps->capabilities = g_key_file_get_string_list (keyfile, group, "Capabilities", NULL, NULL);
+	if (caps->driver == NULL || caps->version == NULL) {
+		drm_caps_free (caps);
+		return NULL;
+	}
+	if (caps->capabilities == NULL)
+		caps->capabilities = g_new0 (char *, 1);
+
+	return caps;
+}
+
+void
+drm_caps_save (DrmCaps    *caps,
+	       GKeyFile   *keyfile,
+	       const char *group)
+{
+	g_key_file_set_string (keyfile, group, "Driver", caps->driver);
+	g_key_file_set_string (keyfile, group, "Version", caps->version);
+	g_key_file_set_string_list (keyfile, group, "Capabilities",
+				    (const char * const *) caps->capabilities,
+				    g_strv_length (caps->capabilities));
+}
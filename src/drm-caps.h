@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct {
+	char *driver;
+	char *version;
+	char **capabilities;
+} DrmCaps;
+
+DrmCaps *drm_caps_probe (const char   *path,
+			 GError      **error);
+DrmCaps *drm_caps_load  (GKeyFile     *keyfile,
+			 const char   *group);
+void     drm_caps_save  (DrmCaps      *caps,
+			 GKeyFile     *keyfile,
+			 const char   *group);
+void     drm_caps_free  (DrmCaps      *caps);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DrmCaps, drm_caps_free)
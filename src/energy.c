@@ -0,0 +1,837 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "energy.h"
+#include "telemetry.h"
+
+/*
+ * Splits the energy used by each GPU between the applications using it,
+ * in proportion to the engine time of their DRM clients, as reported in
+ * /proc/PID/fdinfo, and sums up the clients' engine time and memory per
+ * cgroup, which is looked up once per process.
+ *
+ * Clients that were already found only have their fdinfo read again.
+ * Looking for new clients means going through every process' file
+ * descriptors, so that only happens every few updates, and nothing at
+ * all is read while the GPUs are runtime suspended. New clients only
+ * count from the update that found them. Energy spent while no client
+ * used the GPU is attributed to an empty app id. Once there are too many
+ * cgroups, the ones that have been without clients for a while are
+ * forgotten to make way for new ones.
+ */
+
+/* Updates between searches for new DRM clients */
+#define ENERGY_DISCOVERY_UPDATES 5
+/* Usage entries, further applications or cgroups are counted as "other" */
+#define ENERGY_MAX_USAGE         256
+/* Updates without clients after which a cgroup can make way for another */
+#define ENERGY_CGROUP_IDLE_UPDATES 60
+
+typedef struct {
+	char *id;
+	char *device_path;
+	char *energy_path;        /* energy1_input, NULL if only power is known */
+	char *power_path;
+	gboolean active;
+	gboolean has_reading;
+	guint64 last_energy;
+	gint64 last_time;
+	guint64 delta_uj;         /* since the last update */
+	guint64 delta_ns;
+} EnergyGpu;
+
+typedef struct {
+	int pid;
+	char *cgroup;
+	char *app_id;
+} EnergyProcess;
+
+typedef struct {
+	EnergyProcess *process;   /* the first one found to have it open */
+	char *fd;
+	char *pdev;
+	char *client_id;
+	guint64 last_ns;
+	guint64 delta_ns;
+	guint64 memory;           /* bytes */
+} EnergyClient;
+
+struct _EnergyTracker {
+	char *proc_dir;
+	GHashTable *gpus;         /* PCI slot -> EnergyGpu */
+	GHashTable *processes;    /* PID -> EnergyProcess, of the clients */
+	GHashTable *clients;      /* "PCI slot/client id" -> EnergyClient */
+	GHashTable *usage;        /* "app id/GPU Id" -> EnergyUsage */
+	GHashTable *cgroups;      /* "cgroup\nGPU Id" -> CgroupUsage */
+	guint updates_to_discovery;
+	guint num_updates;
+};
+
+static void
+energy_gpu_free (EnergyGpu *gpu)
+{
+	g_free (gpu->id);
+	g_free (gpu->device_path);
+	g_free (gpu->energy_path);
+	g_free (gpu->power_path);
+	g_free (gpu);
+}
+
+static void
+energy_process_free (EnergyProcess *process)
+{
+	g_free (process->cgroup);
+	g_free (process->app_id);
+	g_free (process);
+}
+
+static void
+energy_client_free (EnergyClient *client)
+{
+	g_free (client->fd);
+	g_free (client->pdev);
+	g_free (client->client_id);
+	g_free (client);
+}
+
+static void
+energy_usage_free (EnergyUsage *usage)
+{
+	g_free (usage->app_id);
+	g_free (usage->gpu_id);
+	g_free (usage);
+}
+
+static void
+cgroup_usage_free (CgroupUsage *usage)
+{
+	g_free (usage->cgroup);
+	g_free (usage->gpu_id);
+	g_free (usage);
+}
+
+/* procfs is only elsewhere than in /proc in tests */
+EnergyTracker *
+energy_tracker_new (const char *proc_dir)
+{
+	EnergyTracker *tracker;
+
+	tracker = g_new0 (EnergyTracker, 1);
+	tracker->proc_dir = g_strdup (proc_dir ? proc_dir : "/proc");
+	tracker->gpus = g_hash_table_new_full (g_str_hash, g_str_equal,
+					       g_free, (GDestroyNotify) energy_gpu_free);
+	tracker->processes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						    NULL, (GDestroyNotify) energy_process_free);
+	tracker->clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, (GDestroyNotify) energy_client_free);
+	tracker->usage = g_hash_table_new_full (g_str_hash, g_str_equal,
+						g_free, (GDestroyNotify) energy_usage_free);
+	tracker->cgroups = g_hash_table_new_full (g_str_hash, g_str_equal,
+						  g_free, (GDestroyNotify) cgroup_usage_free);
+	return tracker;
+}
+
+void
+energy_tracker_free (EnergyTracker *tracker)
+{
+	if (tracker == NULL)
+		return;
+
+	g_hash_table_unref (tracker->gpus);
+	g_hash_table_unref (tracker->clients);
+	g_hash_table_unref (tracker->processes);
+	g_hash_table_unref (tracker->usage);
+	g_hash_table_unref (tracker->cgroups);
+	g_free (tracker->proc_dir);
+	g_free (tracker);
+}
+
+static char *
+find_hwmon_attr (const char *hwmon_path,
+		 const char *name)
+{
+	char *path;
+
+	path = g_build_filename (hwmon_path, name, NULL);
+	if (g_file_test (path, G_FILE_TEST_EXISTS))
+		return path;
+	g_free (path);
+	return NULL;
+}
+
+static EnergyGpu *
+energy_gpu_new (const char *id,
+		const char *device_path)
+{
+	EnergyGpu *gpu;
+	g_autofree char *hwmon_path = NULL;
+
+	gpu = g_new0 (EnergyGpu, 1);
+	gpu->id = g_strdup (id);
+	gpu->device_path = g_strdup (device_path);
+	hwmon_path = find_hwmon_path (device_path);
+	if (hwmon_path != NULL) {
+		gpu->energy_path = find_hwmon_attr (hwmon_path, "energy1_input");
+		gpu->power_path = find_hwmon_attr (hwmon_path, "power1_average");
+		if (gpu->power_path == NULL)
+			gpu->power_path = find_hwmon_attr (hwmon_path, "power1_input");
+	}
+	return gpu;
+}
+
+/* Keyed by GPU Id, the device paths ending with the GPUs' PCI slots,
+ * as found in the clients' fdinfo */
+void
+energy_tracker_set_gpus (EnergyTracker *tracker,
+			 GHashTable    *device_paths)
+{
+	g_autoptr(GHashTable) pdevs = NULL;
+	GHashTableIter iter;
+	const char *id, *path;
+	EnergyGpu *gpu;
+
+	pdevs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_hash_table_iter_init (&iter, device_paths);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &path)) {
+		char *pdev;
+
+		pdev = g_path_get_basename (path);
+		g_hash_table_insert (pdevs, pdev, (gpointer) id);
+		gpu = g_hash_table_lookup (tracker->gpus, pdev);
+		if (gpu != NULL && g_str_equal (gpu->id, id) &&
+		    g_str_equal (gpu->device_path, path))
+			continue;
+		g_hash_table_insert (tracker->gpus, g_strdup (pdev), energy_gpu_new (id, path));
+	}
+
+	/* The GPUs' clients get dropped on the next update */
+	g_hash_table_iter_init (&iter, tracker->gpus);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL)) {
+		if (!g_hash_table_contains (pdevs, path))
+			g_hash_table_iter_remove (&iter);
+	}
+}
+
+guint
+energy_tracker_get_num_gpus (EnergyTracker *tracker)
+{
+	return g_hash_table_size (tracker->gpus);
+}
+
+/* Clients found on the GPU, as of the last update */
+guint
+energy_tracker_get_num_clients (EnergyTracker *tracker,
+				const char    *gpu_id)
+{
+	GHashTableIter iter;
+	EnergyClient *client;
+	guint num_clients = 0;
+
+	g_hash_table_iter_init (&iter, tracker->clients);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client)) {
+		EnergyGpu *gpu;
+
+		gpu = g_hash_table_lookup (tracker->gpus, client->pdev);
+		if (gpu != NULL && g_str_equal (gpu->id, gpu_id))
+			num_clients++;
+	}
+	return num_clients;
+}
+
+static gboolean
+read_u64 (const char *path,
+	  guint64    *value)
+{
+	g_autofree char *contents = NULL;
+	char *end;
+
+	if (path == NULL || !g_file_get_contents (path, &contents, NULL, NULL))
+		return FALSE;
+	*value = g_ascii_strtoull (contents, &end, 10);
+	return end != contents;
+}
+
+/* Reading the energy counters of a runtime suspended GPU would wake it up,
+ * and it doesn't use much anyway */
+static void
+update_gpu_energy (EnergyGpu *gpu,
+		   gint64     now)
+{
+	g_autofree char *status_path = NULL;
+	g_autofree char *status = NULL;
+	guint64 value;
+
+	gpu->delta_uj = 0;
+	gpu->delta_ns = 0;
+
+	status_path = g_build_filename (gpu->device_path, "power", "runtime_status", NULL);
+	if (g_file_get_contents (status_path, &status, NULL, NULL) &&
+	    !g_str_has_prefix (status, "active")) {
+		gpu->active = FALSE;
+		gpu->has_reading = FALSE;
+		return;
+	}
+	gpu->active = TRUE;
+
+	if (read_u64 (gpu->energy_path, &value)) {
+		/* The counter goes back to 0 when the GPU is reset */
+		if (gpu->has_reading && value >= gpu->last_energy)
+			gpu->delta_uj = value - gpu->last_energy;
+		gpu->last_energy = value;
+		gpu->has_reading = TRUE;
+	} else if (read_u64 (gpu->power_path, &value)) {
+		if (gpu->has_reading)
+			gpu->delta_uj = value * (now - gpu->last_time) / G_USEC_PER_SEC;
+		gpu->has_reading = TRUE;
+	}
+	gpu->last_time = now;
+}
+
+/* "123 KiB", or bytes without a unit */
+static guint64
+parse_memory (const char *value)
+{
+	guint64 size;
+	char *unit;
+
+	size = g_ascii_strtoull (value, &unit, 10);
+	while (*unit == ' ')
+		unit++;
+	if (g_str_equal (unit, "KiB"))
+		return size * 1024;
+	if (g_str_equal (unit, "MiB"))
+		return size * 1024 * 1024;
+	if (g_str_equal (unit, "GiB"))
+		return size * 1024 * 1024 * 1024;
+	return size;
+}
+
+/* Engine time in ns, or cycles for drivers that don't report time,
+ * and the memory resident in all of the GPU's regions */
+static gboolean
+read_client (const char  *proc_dir,
+	     int          pid,
+	     const char  *fd,
+	     char       **pdev,
+	     char       **client_id,
+	     guint64     *busy,
+	     guint64     *memory)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint64 ns = 0, cycles = 0, resident = 0, legacy = 0;
+	guint i;
+
+	path = g_strdup_printf ("%s/%d/fdinfo/%s", proc_dir, pid, fd);
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return FALSE;
+
+	*pdev = NULL;
+	*client_id = NULL;
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		char *value;
+
+		value = strchr (lines[i], ':');
+		if (value == NULL)
+			continue;
+		*value++ = '\0';
+		value = g_strstrip (value);
+
+		if (g_str_equal (lines[i], "drm-pdev")) {
+			g_free (*pdev);
+			*pdev = g_strdup (value);
+		} else if (g_str_equal (lines[i], "drm-client-id")) {
+			g_free (*client_id);
+			*client_id = g_strdup (value);
+		} else if (g_str_has_prefix (lines[i], "drm-engine-") &&
+			   !g_str_has_prefix (lines[i], "drm-engine-capacity-")) {
+			ns += g_ascii_strtoull (value, NULL, 10);
+		} else if (g_str_has_prefix (lines[i], "drm-cycles-")) {
+			cycles += g_ascii_strtoull (value, NULL, 10);
+		} else if (g_str_has_prefix (lines[i], "drm-resident-")) {
+			resident += parse_memory (value);
+		} else if (g_str_has_prefix (lines[i], "drm-memory-")) {
+			/* Older kernels only have drm-memory-* */
+			legacy += parse_memory (value);
+		}
+	}
+
+	if (*pdev == NULL || *client_id == NULL) {
+		g_clear_pointer (pdev, g_free);
+		g_clear_pointer (client_id, g_free);
+		return FALSE;
+	}
+	*busy = ns ? ns : cycles;
+	*memory = resident ? resident : legacy;
+	return TRUE;
+}
+
+/* Application IDs of the cgroups set up by desktops, following
+ * "app[-<launcher>]-<app id>[@<random>].service" and
+ * "app[-<launcher>]-<app id>-<random>.scope", and system services */
+char *
+app_id_from_cgroup (const char *cgroup)
+{
+	g_autofree char *unit = NULL;
+	g_auto(GStrv) parts = NULL;
+	char *name, *p;
+
+	unit = g_path_get_basename (cgroup);
+	if (!g_str_has_prefix (unit, "app-")) {
+		if (g_str_has_suffix (unit, ".service"))
+			return g_strndup (unit, strlen (unit) - strlen (".service"));
+		return NULL;
+	}
+
+	name = unit + strlen ("app-");
+	if (g_str_has_suffix (name, ".service")) {
+		name[strlen (name) - strlen (".service")] = '\0';
+		p = strchr (name, '@');
+		if (p != NULL)
+			*p = '\0';
+	} else if (g_str_has_suffix (name, ".scope")) {
+		name[strlen (name) - strlen (".scope")] = '\0';
+		p = strrchr (name, '-');
+		if (p != NULL)
+			*p = '\0';
+	}
+
+	/* Launchers don't have dots, reverse-DNS app IDs do */
+	p = strchr (name, '-');
+	if (p != NULL && strchr (p, '.') != NULL && memchr (name, '.', p - name) == NULL)
+		name = p + 1;
+	if (*name == '\0')
+		return NULL;
+
+	/* Dashes in app IDs are escaped */
+	parts = g_strsplit (name, "\\x2d", -1);
+	return g_strjoinv ("-", parts);
+}
+
+/* The unified hierarchy's cgroup, "" on legacy hierarchies */
+static char *
+get_cgroup (const char *proc_dir,
+	    int         pid)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint i;
+
+	path = g_strdup_printf ("%s/%d/cgroup", proc_dir, pid);
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return g_strdup ("");
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		if (g_str_has_prefix (lines[i], "0::"))
+			return g_strdup (lines[i] + strlen ("0::"));
+	}
+	return g_strdup ("");
+}
+
+static char *
+get_app_id (const char *proc_dir,
+	    int         pid,
+	    const char *cgroup)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *contents = NULL;
+	char *app_id;
+
+	app_id = app_id_from_cgroup (cgroup);
+	if (app_id != NULL)
+		return app_id;
+
+	path = g_strdup_printf ("%s/%d/comm", proc_dir, pid);
+	if (g_file_get_contents (path, &contents, NULL, NULL))
+		return g_strdup (g_strstrip (contents));
+	return g_strdup_printf ("pid-%d", pid);
+}
+
+/* Processes seldom move to other cgroups, so they're only looked up
+ * when the first of their clients is found */
+static EnergyProcess *
+get_process (EnergyTracker *tracker,
+	     int            pid)
+{
+	EnergyProcess *process;
+
+	process = g_hash_table_lookup (tracker->processes, GINT_TO_POINTER (pid));
+	if (process != NULL)
+		return process;
+
+	process = g_new0 (EnergyProcess, 1);
+	process->pid = pid;
+	process->cgroup = get_cgroup (tracker->proc_dir, pid);
+	process->app_id = get_app_id (tracker->proc_dir, pid, process->cgroup);
+	g_hash_table_insert (tracker->processes, GINT_TO_POINTER (pid), process);
+	return process;
+}
+
+static void
+prune_processes (EnergyTracker *tracker)
+{
+	g_autoptr(GHashTable) pids = NULL;
+	GHashTableIter iter;
+	EnergyClient *client;
+	gpointer pid;
+
+	pids = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_iter_init (&iter, tracker->clients);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client))
+		g_hash_table_add (pids, GINT_TO_POINTER (client->process->pid));
+
+	g_hash_table_iter_init (&iter, tracker->processes);
+	while (g_hash_table_iter_next (&iter, &pid, NULL)) {
+		if (!g_hash_table_contains (pids, pid))
+			g_hash_table_iter_remove (&iter);
+	}
+}
+
+static void
+discover_process_clients (EnergyTracker *tracker,
+			  int            pid)
+{
+	g_autofree char *fd_dir = NULL;
+	g_autoptr(GDir) dir = NULL;
+	const char *fd;
+
+	fd_dir = g_strdup_printf ("%s/%d/fd", tracker->proc_dir, pid);
+	dir = g_dir_open (fd_dir, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	while ((fd = g_dir_read_name (dir)) != NULL) {
+		g_autofree char *link_path = NULL;
+		g_autofree char *target = NULL;
+		g_autofree char *pdev = NULL;
+		g_autofree char *client_id = NULL;
+		g_autofree char *key = NULL;
+		EnergyClient *client;
+		EnergyGpu *gpu;
+		guint64 busy, memory;
+
+		link_path = g_build_filename (fd_dir, fd, NULL);
+		target = g_file_read_link (link_path, NULL);
+		if (target == NULL || !g_str_has_prefix (target, "/dev/dri/"))
+			continue;
+		if (!read_client (tracker->proc_dir, pid, fd, &pdev, &client_id, &busy, &memory))
+			continue;
+		gpu = g_hash_table_lookup (tracker->gpus, pdev);
+		if (gpu == NULL || !gpu->active)
+			continue;
+
+		/* Forked or duplicated file descriptors share the client */
+		key = g_strdup_printf ("%s/%s", pdev, client_id);
+		if (g_hash_table_contains (tracker->clients, key))
+			continue;
+
+		client = g_new0 (EnergyClient, 1);
+		client->process = get_process (tracker, pid);
+		client->fd = g_strdup (fd);
+		client->pdev = g_steal_pointer (&pdev);
+		client->client_id = g_steal_pointer (&client_id);
+		client->last_ns = busy;
+		client->memory = memory;
+		g_debug ("Attributing GPU usage of client %s of %s to '%s' in %s",
+			 client->client_id, gpu->id, client->process->app_id,
+			 client->process->cgroup);
+		g_hash_table_insert (tracker->clients, g_steal_pointer (&key), client);
+	}
+}
+
+static void
+discover_clients (EnergyTracker *tracker)
+{
+	g_autoptr(GDir) dir = NULL;
+	const char *name;
+
+	dir = g_dir_open (tracker->proc_dir, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (!g_ascii_isdigit (name[0]))
+			continue;
+		discover_process_clients (tracker, atoi (name));
+	}
+}
+
+static void
+add_usage (EnergyTracker *tracker,
+	   const char    *app_id,
+	   const char    *gpu_id,
+	   guint64        energy_uj,
+	   guint64        busy_ns)
+{
+	g_autofree char *key = NULL;
+	EnergyUsage *usage;
+
+	key = g_strdup_printf ("%s/%s", app_id, gpu_id);
+	usage = g_hash_table_lookup (tracker->usage, key);
+	if (usage == NULL && g_hash_table_size (tracker->usage) >= ENERGY_MAX_USAGE) {
+		g_free (key);
+		key = g_strdup_printf ("other/%s", gpu_id);
+		app_id = "other";
+		usage = g_hash_table_lookup (tracker->usage, key);
+	}
+	if (usage == NULL) {
+		usage = g_new0 (EnergyUsage, 1);
+		usage->app_id = g_strdup (app_id);
+		usage->gpu_id = g_strdup (gpu_id);
+		g_hash_table_insert (tracker->usage, g_steal_pointer (&key), usage);
+	}
+	usage->energy_uj += energy_uj;
+	usage->busy_ns += busy_ns;
+}
+
+/* Cgroups come and go with every application launched, so forget the
+ * one that has been without clients for the longest, if long enough */
+static gboolean
+evict_idle_cgroup (EnergyTracker *tracker)
+{
+	GHashTableIter iter;
+	CgroupUsage *usage;
+	const char *key, *idlest_key = NULL;
+	guint idlest = G_MAXUINT;
+
+	g_hash_table_iter_init (&iter, tracker->cgroups);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &key, (gpointer *) &usage)) {
+		if (g_str_equal (usage->cgroup, "other") ||
+		    tracker->num_updates - usage->last_active < ENERGY_CGROUP_IDLE_UPDATES)
+			continue;
+		if (usage->last_active < idlest) {
+			idlest = usage->last_active;
+			idlest_key = key;
+		}
+	}
+	if (idlest_key == NULL)
+		return FALSE;
+
+	g_debug ("Forgetting usage of idle cgroup %s", idlest_key);
+	g_hash_table_remove (tracker->cgroups, idlest_key);
+	return TRUE;
+}
+
+static CgroupUsage *
+get_cgroup_usage (EnergyTracker *tracker,
+		  const char    *cgroup,
+		  const char    *gpu_id)
+{
+	g_autofree char *key = NULL;
+	CgroupUsage *usage;
+
+	key = g_strdup_printf ("%s\n%s", cgroup, gpu_id);
+	usage = g_hash_table_lookup (tracker->cgroups, key);
+	if (usage == NULL && g_hash_table_size (tracker->cgroups) >= ENERGY_MAX_USAGE &&
+	    !evict_idle_cgroup (tracker)) {
+		g_free (key);
+		key = g_strdup_printf ("other\n%s", gpu_id);
+		cgroup = "other";
+		usage = g_hash_table_lookup (tracker->cgroups, key);
+	}
+	if (usage == NULL) {
+		usage = g_new0 (CgroupUsage, 1);
+		usage->cgroup = g_strdup (cgroup);
+		usage->gpu_id = g_strdup (gpu_id);
+		g_hash_table_insert (tracker->cgroups, g_steal_pointer (&key), usage);
+	}
+	usage->last_active = tracker->num_updates;
+	return usage;
+}
+
+/* Cgroups with clients aren't idle, even if the clients are */
+static void
+touch_cgroup_usage (EnergyTracker *tracker,
+		    const char    *cgroup,
+		    const char    *gpu_id)
+{
+	g_autofree char *key = NULL;
+	CgroupUsage *usage;
+
+	key = g_strdup_printf ("%s\n%s", cgroup, gpu_id);
+	usage = g_hash_table_lookup (tracker->cgroups, key);
+	if (usage != NULL)
+		usage->last_active = tracker->num_updates;
+}
+
+/* Memory is what the clients hold right now, clients of suspended GPUs
+ * keeping what they had */
+static void
+update_cgroup_memory (EnergyTracker *tracker)
+{
+	GHashTableIter iter;
+	CgroupUsage *usage;
+	EnergyClient *client;
+
+	g_hash_table_iter_init (&iter, tracker->cgroups);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &usage))
+		usage->memory = 0;
+
+	g_hash_table_iter_init (&iter, tracker->clients);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client)) {
+		EnergyGpu *gpu;
+
+		gpu = g_hash_table_lookup (tracker->gpus, client->pdev);
+		if (client->memory == 0) {
+			touch_cgroup_usage (tracker, client->process->cgroup, gpu->id);
+			continue;
+		}
+		usage = get_cgroup_usage (tracker, client->process->cgroup, gpu->id);
+		usage->memory += client->memory;
+	}
+}
+
+void
+energy_tracker_update (EnergyTracker *tracker)
+{
+	GHashTableIter iter;
+	EnergyGpu *gpu;
+	EnergyClient *client;
+	gboolean any_active = FALSE;
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+	g_hash_table_iter_init (&iter, tracker->gpus);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &gpu)) {
+		gboolean was_active = gpu->active;
+
+		update_gpu_energy (gpu, now);
+		if (gpu->active && !was_active)
+			tracker->updates_to_discovery = 0;
+		any_active |= gpu->active;
+	}
+	if (!any_active)
+		return;
+	tracker->num_updates++;
+
+	if (tracker->updates_to_discovery == 0) {
+		discover_clients (tracker);
+		tracker->updates_to_discovery = ENERGY_DISCOVERY_UPDATES;
+	}
+	tracker->updates_to_discovery--;
+
+	g_hash_table_iter_init (&iter, tracker->clients);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client)) {
+		g_autofree char *pdev = NULL;
+		g_autofree char *client_id = NULL;
+		guint64 busy, memory;
+
+		client->delta_ns = 0;
+		gpu = g_hash_table_lookup (tracker->gpus, client->pdev);
+		if (gpu == NULL) {
+			g_hash_table_iter_remove (&iter);
+			continue;
+		}
+		if (!gpu->active)
+			continue;
+
+		/* Closed, or the fd number got reused */
+		if (!read_client (tracker->proc_dir, client->process->pid, client->fd,
+				  &pdev, &client_id, &busy, &memory) ||
+		    !g_str_equal (pdev, client->pdev) ||
+		    !g_str_equal (client_id, client->client_id)) {
+			g_hash_table_iter_remove (&iter);
+			continue;
+		}
+		if (busy > client->last_ns)
+			client->delta_ns = busy - client->last_ns;
+		client->last_ns = busy;
+		client->memory = memory;
+		gpu->delta_ns += client->delta_ns;
+	}
+
+	g_hash_table_iter_init (&iter, tracker->clients);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &client)) {
+		CgroupUsage *usage;
+		guint64 energy_uj;
+
+		if (client->delta_ns == 0)
+			continue;
+		gpu = g_hash_table_lookup (tracker->gpus, client->pdev);
+		energy_uj = (gdouble) gpu->delta_uj * client->delta_ns / gpu->delta_ns;
+		add_usage (tracker, client->process->app_id, gpu->id,
+			   energy_uj, client->delta_ns);
+		usage = get_cgroup_usage (tracker, client->process->cgroup, gpu->id);
+		usage->busy_ns += client->delta_ns;
+		usage->energy_uj += energy_uj;
+	}
+	update_cgroup_memory (tracker);
+	prune_processes (tracker);
+
+	g_hash_table_iter_init (&iter, tracker->gpus);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &gpu)) {
+		if (gpu->delta_ns == 0 && gpu->delta_uj > 0)
+			add_usage (tracker, "", gpu->id, gpu->delta_uj, 0);
+	}
+}
+
+static gint
+compare_usage (gconstpointer a,
+	       gconstpointer b)
+{
+	const EnergyUsage *usage_a = *(const EnergyUsage **) a;
+	const EnergyUsage *usage_b = *(const EnergyUsage **) b;
+
+	if (usage_a->energy_uj != usage_b->energy_uj)
+		return usage_a->energy_uj < usage_b->energy_uj ? 1 : -1;
+	return g_strcmp0 (usage_a->app_id, usage_b->app_id);
+}
+
+/* Array of EnergyUsage, owned by the tracker, most energy first */
+GPtrArray *
+energy_tracker_get_usage (EnergyTracker *tracker)
+{
+	GPtrArray *array;
+	GHashTableIter iter;
+	EnergyUsage *usage;
+
+	array = g_ptr_array_new ();
+	g_hash_table_iter_init (&iter, tracker->usage);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &usage))
+		g_ptr_array_add (array, usage);
+	g_ptr_array_sort (array, compare_usage);
+
+	return array;
+}
+
+static gint
+compare_cgroup_usage (gconstpointer a,
+		      gconstpointer b)
+{
+	const CgroupUsage *usage_a = *(const CgroupUsage **) a;
+	const CgroupUsage *usage_b = *(const CgroupUsage **) b;
+
+	if (usage_a->busy_ns != usage_b->busy_ns)
+		return usage_a->busy_ns < usage_b->busy_ns ? 1 : -1;
+	return g_strcmp0 (usage_a->cgroup, usage_b->cgroup);
+}
+
+/* Array of CgroupUsage, owned by the tracker, busiest first */
+GPtrArray *
+energy_tracker_get_cgroup_usage (EnergyTracker *tracker)
+{
+	GPtrArray *array;
+	GHashTableIter iter;
+	CgroupUsage *usage;
+
+	array = g_ptr_array_new ();
+	g_hash_table_iter_init (&iter, tracker->cgroups);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &usage))
+		g_ptr_array_add (array, usage);
+	g_ptr_array_sort (array, compare_cgroup_usage);
+
+	return array;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct {
+	char *app_id;             /* "" for energy spent without any client */
+	char *gpu_id;
+	guint64 energy_uj;
+	guint64 busy_ns;          /* engine time, or cycles for some drivers */
+} EnergyUsage;
+
+typedef struct {
+	char *cgroup;             /* in the unified hierarchy */
+	char *gpu_id;
+	guint64 busy_ns;          /* engine time, or cycles for some drivers */
+	guint64 memory;           /* bytes resident, as of the last update */
+	guint64 energy_uj;
+	guint last_active;        /* update it last had clients in */
+} CgroupUsage;
+
+typedef struct _EnergyTracker EnergyTracker;
+
+EnergyTracker *energy_tracker_new              (const char    *proc_dir);
+void           energy_tracker_free             (EnergyTracker *tracker);
+void           energy_tracker_set_gpus         (EnergyTracker *tracker,
+						GHashTable    *device_paths);
+guint          energy_tracker_get_num_gpus     (EnergyTracker *tracker);
+guint          energy_tracker_get_num_clients  (EnergyTracker *tracker,
+						const char    *gpu_id);
+void           energy_tracker_update           (EnergyTracker *tracker);
+GPtrArray     *energy_tracker_get_usage        (EnergyTracker *tracker);
+GPtrArray     *energy_tracker_get_cgroup_usage (EnergyTracker *tracker);
+
+char          *app_id_from_cgroup              (const char    *cgroup);
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+
+#include "history.h"
+
+G_STATIC_ASSERT (sizeof (HistoryHeader) == 48);
+G_STATIC_ASSERT (sizeof (HistoryRecord) == 64);
+
+/* 1 second for 10 minutes, 1 minute for 24 hours, 15 minutes for 30 days */
+static const HistoryTier tiers[HISTORY_NUM_TIERS] = {
+	{ 1, 600 },
+	{ 60, 1440 },
+	{ 900, 2880 },
+};
+
+struct _History {
+	int fd;
+	gsize size;
+	HistoryHeader *header;
+	HistoryRecord *slots[HISTORY_NUM_TIERS];
+};
+
+static gsize
+get_file_size (void)
+{
+	gsize size = sizeof (HistoryHeader);
+	guint i;
+
+	for (i = 0; i < HISTORY_NUM_TIERS; i++)
+		size += tiers[i].num_slots * sizeof (HistoryRecord);
+	return size;
+}
+
+static gboolean
+header_is_valid (HistoryHeader *header)
+{
+	return header->magic == HISTORY_MAGIC &&
+		header->version == HISTORY_VERSION &&
+		header->header_size == sizeof (HistoryHeader) &&
+		header->record_size == sizeof (HistoryRecord) &&
+		header->num_tiers == HISTORY_NUM_TIERS &&
+		memcmp (header->tiers, tiers, sizeof (tiers)) == 0;
+}
+
+History *
+history_open (const char  *path,
+	      GError     **error)
+{
+	History *history;
+	struct stat st;
+	HistoryRecord *slots;
+	guint i;
+
+	history = g_new0 (History, 1);
+	history->size = get_file_size ();
+	history->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (history->fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not open '%s': %s", path, g_strerror (errno));
+		history_free (history);
+		return NULL;
+	}
+
+	/* Start afresh if the layout changed */
+	if (fstat (history->fd, &st) < 0 || (gsize) st.st_size != history->size) {
+		if (ftruncate (history->fd, 0) < 0 ||
+		    ftruncate (history->fd, history->size) < 0) {
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "Could not size '%s': %s", path, g_strerror (errno));
+			history_free (history);
+			return NULL;
+		}
+	}
+
+	history->header = mmap (NULL, history->size, PROT_READ | PROT_WRITE, MAP_SHARED, history->fd, 0);
+	if (history->header == MAP_FAILED) {
+		history->header = NULL;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not map '%s': %s", path, g_strerror (errno));
+		history_free (history);
+		return NULL;
+	}
+
+	if (!header_is_valid (history->header)) {
+		g_debug ("Starting a new history in '%s'", path);
+		memset (history->header, 0, history->size);
+		history->header->magic = HISTORY_MAGIC;
+		history->header->version = HISTORY_VERSION;
+		history->header->header_size = sizeof (HistoryHeader);
+		history->header->record_size = sizeof (HistoryRecord);
+		history->header->num_tiers = HISTORY_NUM_TIERS;
+		memcpy (history->header->tiers, tiers, sizeof (tiers));
+	}
+
+	slots = (HistoryRecord *) (history->header + 1);
+	for (i = 0; i < HISTORY_NUM_TIERS; i++) {
+		history->slots[i] = slots;
+		slots += tiers[i].num_slots;
+	}
+
+	return history;
+}
+
+void
+history_free (History *history)
+{
+	if (history == NULL)
+		return;
+
+	if (history->header != NULL)
+		munmap (history->header, history->size);
+	if (history->fd >= 0)
+		close (history->fd);
+	g_free (history);
+}
+
+/* Constant time: one slot per tier */
+void
+history_add_sample (History               *history,
+		    gint64                 timestamp,
+		    const TelemetrySample *sample)
+{
+	gboolean active = !(sample->flags & TELEMETRY_SUSPENDED);
+	guint i;
+
+	for (i = 0; i < HISTORY_NUM_TIERS; i++) {
+		guint64 bucket = timestamp / tiers[i].resolution;
+		HistoryRecord *record = &history->slots[i][bucket % tiers[i].num_slots];
+
+		if (record->bucket != bucket) {
+			memset (record, 0, sizeof (HistoryRecord));
+			record->bucket = bucket;
+		}
+
+		record->num_samples++;
+		record->flags |= sample->flags;
+		/* Suspended GPUs are idle, their other attributes aren't read */
+		if (!active)
+			continue;
+		record->num_active++;
+		record->busy_sum += sample->busy_percent;
+		record->busy_max = MAX (record->busy_max, sample->busy_percent);
+		record->vram_sum += sample->vram_used;
+		record->vram_max = MAX (record->vram_max, sample->vram_used);
+		record->power_sum += sample->power_uw;
+		record->power_max = MAX (record->power_max, sample->power_uw);
+	}
+}
+
+/* Uses the finest tier that still goes back to "from", all times
+ * being in seconds since the epoch */
+GVariant *
+history_query (History *history,
+	       gint64   from,
+	       gint64   to,
+	       gint64   now,
+	       guint   *resolution)
+{
+	GVariantBuilder builder;
+	const HistoryTier *tier = NULL;
+	HistoryRecord *slots = NULL;
+	guint64 bucket, first, last;
+	guint i;
+
+	for (i = 0; i < HISTORY_NUM_TIERS; i++) {
+		tier = &tiers[i];
+		slots = history->slots[i];
+		if (now - (gint64) (tier->resolution * tier->num_slots) <= from)
+			break;
+	}
+	*resolution = tier->resolution;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(xudutttt)"));
+	if (to < from || to < 0)
+		return g_variant_builder_end (&builder);
+
+	/* Only the buckets the tier can still hold */
+	last = MIN (to, now) / tier->resolution;
+	first = MAX (from, 0) / tier->resolution;
+	if (last >= tier->num_slots)
+		first = MAX (first, last - tier->num_slots + 1);
+
+	for (bucket = first; bucket <= last; bucket++) {
+		HistoryRecord *record = &slots[bucket % tier->num_slots];
+
+		if (record->bucket != bucket || record->num_samples == 0)
+			continue;
+		g_variant_builder_add (&builder, "(xudutttt)",
+				       (gint64) (bucket * tier->resolution),
+				       record->flags,
+				       (gdouble) record->busy_sum / record->num_samples,
+				       record->busy_max,
+				       record->num_active ? record->vram_sum / record->num_active : 0,
+				       record->vram_max,
+				       record->num_active ? record->power_sum / record->num_active : 0,
+				       record->power_max);
+	}
+
+	return g_variant_builder_end (&builder);
+}
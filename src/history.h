@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#include "telemetry.h"
+
+/*
+ * Layout of the history file of a GPU. The file has a fixed size, and
+ * is made of a header, followed by the slots of each tier, finest
+ * first. Each slot accumulates the samples of one bucket of the tier's
+ * resolution, and gets reused once the tier has wrapped around.
+ */
+
+#define HISTORY_MAGIC     0x49485753 /* "SWHI" */
+#define HISTORY_VERSION   1
+#define HISTORY_NUM_TIERS 3
+
+typedef struct {
+	guint32 resolution;       /* seconds */
+	guint32 num_slots;
+} HistoryTier;
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 header_size;
+	guint32 record_size;
+	guint32 num_tiers;
+	guint32 padding;
+	HistoryTier tiers[HISTORY_NUM_TIERS];
+} HistoryHeader;
+
+typedef struct {
+	guint64 bucket;           /* seconds since the epoch / resolution, 0 if empty */
+	guint32 num_samples;
+	guint32 num_active;       /* samples taken while the GPU wasn't suspended */
+	guint32 flags;            /* TelemetryFlags seen in the bucket */
+	guint32 busy_max;
+	guint64 busy_sum;
+	guint64 vram_sum;         /* bytes */
+	guint64 vram_max;
+	guint64 power_sum;        /* microwatts */
+	guint64 power_max;
+} HistoryRecord;
+
+typedef struct _History History;
+
+History  *history_open       (const char             *path,
+			      GError                **error);
+void      history_free       (History                *history);
+void      history_add_sample (History                *history,
+			      gint64                  timestamp,
+			      const TelemetrySample  *sample);
+GVariant *history_query      (History                *history,
+			      gint64                  from,
+			      gint64                  to,
+			      gint64                  now,
+			      guint                  *resolution);
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+
+#include "performance.h"
+#include "telemetry.h"
+
+/*
+ * Concurrent requests for the same GPU are merged: the highest
+ * performance level and frequency floor win, as does the lowest power
+ * cap. A setting goes back to the value it had before the first request
+ * once no requests for it are left.
+ *
+ * The original values are also kept in the state key file, keyed by
+ * sysfs path, so that they can be restored by perf_state_restore() if
+ * the daemon didn't get to do it itself. The key file is saved before
+ * a setting is first changed, so that a crash right after can't lose
+ * the original value.
+ */
+
+#define STATE_GROUP  "Saved"
+#define BOOT_GROUP   "Boot"
+
+typedef enum {
+	KNOB_LEVEL,
+	KNOB_MIN_FREQ,
+	KNOB_POWER_CAP,
+	NUM_KNOBS
+} PerfKnob;
+
+static const char * const level_names[] = {
+	[PERF_LEVEL_LOW] = "low",
+	[PERF_LEVEL_HIGH] = "high",
+	[PERF_LEVEL_PEAK] = "peak",
+};
+
+/* As understood by amdgpu */
+static const char * const level_values[] = {
+	[PERF_LEVEL_LOW] = "low",
+	[PERF_LEVEL_HIGH] = "high",
+	[PERF_LEVEL_PEAK] = "profile_peak",
+};
+
+struct _PerfControl {
+	char *device_path;
+	GKeyFile *state;
+	PerfStateChangedFunc state_changed_func;
+	gpointer state_changed_data;
+	char *paths[NUM_KNOBS];
+	guint64 applied[NUM_KNOBS]; /* 0 if not overridden */
+
+	/* Limits, 0 if unknown */
+	guint max_freq_mhz;
+	guint64 min_power_cap_uw;
+	guint64 max_power_cap_uw;
+
+	GHashTable *requests; /* ID -> PerfRequest */
+	guint next_id;
+};
+
+static char *
+read_attr (const char *path)
+{
+	g_autofree char *contents = NULL;
+
+	if (path == NULL ||
+	    !g_file_get_contents (path, &contents, NULL, NULL))
+		return NULL;
+	return g_strstrip (g_steal_pointer (&contents));
+}
+
+static guint64
+read_attr_u64 (const char *path)
+{
+	g_autofree char *value = NULL;
+
+	value = read_attr (path);
+	if (value == NULL)
+		return 0;
+	return g_ascii_strtoull (value, NULL, 10);
+}
+
+/* sysfs attributes can't be replaced, so write in-place */
+static gboolean
+write_attr (const char *path,
+	    const char *value)
+{
+	ssize_t len;
+	int fd;
+
+	fd = open (path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0) {
+		g_warning ("Could not open '%s': %s", path, g_strerror (errno));
+		return FALSE;
+	}
+	len = write (fd, value, strlen (value));
+	if (len < 0)
+		g_warning ("Could not write '%s' to '%s': %s", value, path, g_strerror (errno));
+	close (fd);
+
+	return len >= 0;
+}
+
+static char *
+find_attr (const char *dir,
+	   ...)
+{
+	va_list args;
+	const char *name;
+
+	if (dir == NULL)
+		return NULL;
+
+	va_start (args, dir);
+	while ((name = va_arg (args, const char *)) != NULL) {
+		g_autofree char *path = NULL;
+
+		path = g_build_filename (dir, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_EXISTS)) {
+			va_end (args);
+			return g_steal_pointer (&path);
+		}
+	}
+	va_end (args);
+
+	return NULL;
+}
+
+PerfControl *
+perf_control_new (const char           *card_path,
+		  const char           *device_path,
+		  GKeyFile             *state,
+		  PerfStateChangedFunc  func,
+		  gpointer              user_data)
+{
+	PerfControl *control;
+	g_autofree char *hwmon_path = NULL;
+	g_autofree char *max_path = NULL;
+	g_autofree char *xe_path = NULL;
+
+	control = g_new0 (PerfControl, 1);
+	control->device_path = g_strdup (device_path);
+	control->state = g_key_file_ref (state);
+	control->state_changed_func = func;
+	control->state_changed_data = user_data;
+	control->requests = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+	control->next_id = 1;
+
+	/* amdgpu */
+	control->paths[KNOB_LEVEL] = find_attr (device_path, "power_dpm_force_performance_level", NULL);
+
+	/* i915 on the DRM card, xe on the first GT of the device */
+	control->paths[KNOB_MIN_FREQ] = find_attr (card_path, "gt_min_freq_mhz", NULL);
+	if (control->paths[KNOB_MIN_FREQ] != NULL) {
+		max_path = find_attr (card_path, "gt_RP0_freq_mhz", NULL);
+	} else {
+		xe_path = g_build_filename (device_path, "tile0", "gt0", "freq0", NULL);
+		control->paths[KNOB_MIN_FREQ] = find_attr (xe_path, "min_freq", NULL);
+		max_path = find_attr (xe_path, "rp0_freq", NULL);
+	}
+	control->max_freq_mhz = read_attr_u64 (max_path);
+
+	/* amdgpu caps, i915 and xe limits, in microwatts */
+	hwmon_path = find_hwmon_path (device_path);
+	control->paths[KNOB_POWER_CAP] = find_attr (hwmon_path, "power1_cap", "power1_max", NULL);
+	if (control->paths[KNOB_POWER_CAP] != NULL) {
+		g_autofree char *min_cap_path = NULL;
+		g_autofree char *max_cap_path = NULL;
+
+		min_cap_path = find_attr (hwmon_path, "power1_cap_min", NULL);
+		max_cap_path = find_attr (hwmon_path, "power1_cap_max", "power1_rated_max", NULL);
+		control->min_power_cap_uw = read_attr_u64 (min_cap_path);
+		control->max_power_cap_uw = read_attr_u64 (max_cap_path);
+	}
+
+	return control;
+}
+
+static void
+set_knob (PerfControl *control,
+	  PerfKnob     knob,
+	  guint64      value)
+{
+	const char *path = control->paths[knob];
+	g_autofree char *str = NULL;
+	g_autofree char *original = NULL;
+
+	if (control->applied[knob] == value)
+		return;
+
+	if (value == 0) {
+		/* Back to what it was before the first request */
+		original = g_key_file_get_string (control->state, STATE_GROUP, path, NULL);
+		if (original != NULL) {
+			g_debug ("Restoring '%s' to %s", path, original);
+			write_attr (path, original);
+		}
+		g_key_file_remove_key (control->state, STATE_GROUP, path, NULL);
+		control->applied[knob] = 0;
+		return;
+	}
+
+	if (!g_key_file_has_key (control->state, STATE_GROUP, path, NULL)) {
+		g_autofree char *boot_id = NULL;
+
+		original = read_attr (path);
+		if (original == NULL) {
+			g_warning ("Could not read '%s', not changing it", path);
+			return;
+		}
+		g_key_file_set_string (control->state, STATE_GROUP, path, original);
+		if (g_file_get_contents ("/proc/sys/kernel/random/boot_id", &boot_id, NULL, NULL))
+			g_key_file_set_string (control->state, BOOT_GROUP, "Id", g_strstrip (boot_id));
+		control->state_changed_func (control->state_changed_data);
+	}
+
+	if (knob == KNOB_LEVEL)
+		str = g_strdup (level_values[value]);
+	else
+		str = g_strdup_printf ("%" G_GUINT64_FORMAT, value);
+	g_debug ("Setting '%s' to %s", path, str);
+	if (write_attr (path, str))
+		control->applied[knob] = value;
+}
+
+static void
+apply_requests (PerfControl *control)
+{
+	GHashTableIter iter;
+	PerfRequest *request;
+	guint64 level = 0, min_freq = 0, power_cap = 0;
+
+	g_hash_table_iter_init (&iter, control->requests);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request)) {
+		level = MAX (level, request->level);
+		min_freq = MAX (min_freq, request->min_freq_mhz);
+		if (request->power_cap_uw > 0)
+			power_cap = power_cap > 0 ? MIN (power_cap, request->power_cap_uw) : request->power_cap_uw;
+	}
+
+	if (control->paths[KNOB_LEVEL] != NULL)
+		set_knob (control, KNOB_LEVEL, level);
+	if (control->paths[KNOB_MIN_FREQ] != NULL)
+		set_knob (control, KNOB_MIN_FREQ, min_freq);
+	if (control->paths[KNOB_POWER_CAP] != NULL)
+		set_knob (control, KNOB_POWER_CAP, power_cap);
+}
+
+void
+perf_control_free (PerfControl *control)
+{
+	if (control == NULL)
+		return;
+
+	g_hash_table_remove_all (control->requests);
+	apply_requests (control);
+
+	g_hash_table_unref (control->requests);
+	g_key_file_unref (control->state);
+	g_free (control->paths[KNOB_LEVEL]);
+	g_free (control->paths[KNOB_MIN_FREQ]);
+	g_free (control->paths[KNOB_POWER_CAP]);
+	g_free (control->device_path);
+	g_free (control);
+}
+
+const char *
+perf_control_get_path (PerfControl *control)
+{
+	return control->device_path;
+}
+
+/* Clamps the request to what the GPU supports */
+gboolean
+perf_control_check_request (PerfControl  *control,
+			    PerfRequest  *request,
+			    GError      **error)
+{
+	if (request->level == PERF_LEVEL_NONE &&
+	    request->min_freq_mhz == 0 &&
+	    request->power_cap_uw == 0) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "No performance level, frequency or power cap requested");
+		return FALSE;
+	}
+	if (request->level != PERF_LEVEL_NONE && control->paths[KNOB_LEVEL] == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "GPU does not support performance levels");
+		return FALSE;
+	}
+	if (request->min_freq_mhz > 0 && control->paths[KNOB_MIN_FREQ] == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "GPU does not support frequency floors");
+		return FALSE;
+	}
+	if (request->power_cap_uw > 0 && control->paths[KNOB_POWER_CAP] == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "GPU does not support power caps");
+		return FALSE;
+	}
+
+	if (control->max_freq_mhz > 0)
+		request->min_freq_mhz = MIN (request->min_freq_mhz, control->max_freq_mhz);
+	if (request->power_cap_uw > 0) {
+		if (control->max_power_cap_uw > 0)
+			request->power_cap_uw = MIN (request->power_cap_uw, control->max_power_cap_uw);
+		request->power_cap_uw = MAX (request->power_cap_uw, control->min_power_cap_uw);
+	}
+
+	return TRUE;
+}
+
+guint
+perf_control_add_request (PerfControl       *control,
+			  const PerfRequest *request)
+{
+	PerfRequest *copy;
+	guint id = control->next_id++;
+
+	copy = g_new (PerfRequest, 1);
+	*copy = *request;
+	g_hash_table_insert (control->requests, GUINT_TO_POINTER (id), copy);
+	apply_requests (control);
+
+	return id;
+}
+
+/* Returns the number of requests left */
+guint
+perf_control_remove_request (PerfControl *control,
+			     guint        request_id)
+{
+	if (g_hash_table_remove (control->requests, GUINT_TO_POINTER (request_id)))
+		apply_requests (control);
+
+	return g_hash_table_size (control->requests);
+}
+
+PerfLevel
+perf_level_from_string (const char *str)
+{
+	guint i;
+
+	for (i = PERF_LEVEL_LOW; i < G_N_ELEMENTS (level_names); i++) {
+		if (g_strcmp0 (str, level_names[i]) == 0)
+			return i;
+	}
+	return PERF_LEVEL_NONE;
+}
+
+/* Restores settings left over by a previous run that didn't get to
+ * restore them, returns whether the state changed */
+gboolean
+perf_state_restore (GKeyFile *state)
+{
+	g_auto(GStrv) paths = NULL;
+	g_autofree char *saved_boot_id = NULL;
+	g_autofree char *boot_id = NULL;
+	guint i;
+
+	paths = g_key_file_get_keys (state, STATE_GROUP, NULL, NULL);
+	if (paths == NULL)
+		return FALSE;
+
+	/* The settings were reset by rebooting */
+	saved_boot_id = g_key_file_get_string (state, BOOT_GROUP, "Id", NULL);
+	if (g_file_get_contents ("/proc/sys/kernel/random/boot_id", &boot_id, NULL, NULL) &&
+	    g_strcmp0 (saved_boot_id, g_strstrip (boot_id)) == 0) {
+		for (i = 0; paths[i] != NULL; i++) {
+			g_autofree char *original = NULL;
+
+			original = g_key_file_get_string (state, STATE_GROUP, paths[i], NULL);
+			g_debug ("Restoring left over '%s' to %s", paths[i], original);
+			write_attr (paths[i], original);
+		}
+	}
+
+	g_key_file_remove_group (state, STATE_GROUP, NULL);
+	g_key_file_remove_group (state, BOOT_GROUP, NULL);
+	return TRUE;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef enum {
+	PERF_LEVEL_NONE = 0,
+	PERF_LEVEL_LOW,
+	PERF_LEVEL_HIGH,
+	PERF_LEVEL_PEAK
+} PerfLevel;
+
+typedef struct {
+	PerfLevel level;
+	guint min_freq_mhz;   /* 0 if not requested */
+	guint power_cap_uw;   /* 0 if not requested */
+} PerfRequest;
+
+typedef struct _PerfControl PerfControl;
+
+/* Called when the state key file needs saving, before a setting is changed */
+typedef void (*PerfStateChangedFunc) (gpointer user_data);
+
+PerfControl *perf_control_new            (const char   *card_path,
+					  const char   *device_path,
+					  GKeyFile     *state,
+					  PerfStateChangedFunc func,
+					  gpointer      user_data);
+void         perf_control_free           (PerfControl  *control);
+const char  *perf_control_get_path       (PerfControl  *control);
+gboolean     perf_control_check_request  (PerfControl  *control,
+					  PerfRequest  *request,
+					  GError      **error);
+guint        perf_control_add_request    (PerfControl  *control,
+					  const PerfRequest *request);
+guint        perf_control_remove_request (PerfControl  *control,
+					  guint         request_id);
+
+PerfLevel    perf_level_from_string      (const char   *str);
+gboolean     perf_state_restore          (GKeyFile     *state);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PerfControl, perf_control_free)
@@ -0,0 +1,449 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Simulated GPUs, described in a key file such as:
+ *
+ * [Simulation]
+ * IncludeHardware=false
+ *
+ * [GPU intel]
+ * Name=Intel® UHD Graphics 620
+ * Environment=DRI_PRIME;pci-0000_00_02_0;
+ * Default=true
+ *
+ * [GPU nvidia]
+ * Name=NVIDIA GeForce RTX 2060
+ * Environment=__NV_PRIME_RENDER_OFFLOAD;1;
+ * Discrete=true
+ * Count=4
+ * Present=false
+ * AfterHardware=true
+ *
+ * [Event hotplug]
+ * GPU=nvidia
+ * Action=toggle
+ * Time=2.5
+ * Interval=0.1
+ * Repeat=100
+ *
+ * GPUs with a Count are replicated, and events apply to all the replicas.
+ * GPUs are listed before the real hardware, unless AfterHardware is set.
+ * Times are in seconds from the start of the simulation. Actions are one of
+ * "add", "remove", "toggle" or "change", the latter taking new Name,
+ * Environment, Default or Discrete keys.
+ */
+
+#include <string.h>
+
+#include "simulation.h"
+
+#define SIMULATION_GROUP "Simulation"
+#define GPU_GROUP_PREFIX "GPU "
+#define EVENT_GROUP_PREFIX "Event "
+
+typedef enum {
+	SIMULATION_ACTION_ADD,
+	SIMULATION_ACTION_REMOVE,
+	SIMULATION_ACTION_TOGGLE,
+	SIMULATION_ACTION_CHANGE
+} SimulationAction;
+
+typedef struct {
+	Simulation *sim;
+	char *gpu;
+	SimulationAction action;
+	guint time_ms;
+	guint interval_ms;
+	guint repeat;
+	guint fired;
+	guint timeout_id;
+
+	/* for SIMULATION_ACTION_CHANGE */
+	char *name;
+	char **env;
+	gboolean set_default;
+	gboolean is_default;
+	gboolean set_discrete;
+	gboolean is_discrete;
+} SimulationEvent;
+
+struct _Simulation {
+	gboolean include_hardware;
+	GPtrArray *gpus; /* array of SimulatedGpu */
+	GPtrArray *events; /* array of SimulationEvent */
+
+	SimulationChangedFunc func;
+	gpointer user_data;
+};
+
+static void
+free_simulated_gpu (SimulatedGpu *gpu)
+{
+	if (gpu == NULL)
+		return;
+
+	g_free (gpu->id);
+	g_free (gpu->base_id);
+	g_free (gpu->name);
+	g_strfreev (gpu->env);
+	g_free (gpu);
+}
+
+static void
+free_simulation_event (SimulationEvent *event)
+{
+	if (event == NULL)
+		return;
+
+	g_clear_handle_id (&event->timeout_id, g_source_remove);
+	g_free (event->gpu);
+	g_free (event->name);
+	g_strfreev (event->env);
+	g_free (event);
+}
+
+void
+simulation_free (Simulation *sim)
+{
+	if (sim == NULL)
+		return;
+
+	g_ptr_array_free (sim->events, TRUE);
+	g_ptr_array_free (sim->gpus, TRUE);
+	g_free (sim);
+}
+
+static gboolean
+get_boolean_with_default (GKeyFile    *keyfile,
+			  const char  *group,
+			  const char  *key,
+			  gboolean     default_value,
+			  GError     **error)
+{
+	if (!g_key_file_has_key (keyfile, group, key, NULL))
+		return default_value;
+	return g_key_file_get_boolean (keyfile, group, key, error);
+}
+
+static guint
+get_time_ms (GKeyFile    *keyfile,
+	     const char  *group,
+	     const char  *key,
+	     GError     **error)
+{
+	gdouble secs;
+
+	if (!g_key_file_has_key (keyfile, group, key, NULL))
+		return 0;
+	secs = g_key_file_get_double (keyfile, group, key, error);
+	if (secs < 0.0) {
+		g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+			     "Negative %s in group '%s'", key, group);
+		return 0;
+	}
+	return (guint) (secs * 1000.0);
+}
+
+/* Counts need to be positive, rather than wrapping around */
+static guint
+get_count (GKeyFile    *keyfile,
+	   const char  *group,
+	   const char  *key,
+	   GError     **error)
+{
+	GError *local_error = NULL;
+	gint count;
+
+	if (!g_key_file_has_key (keyfile, group, key, NULL))
+		return 1;
+	count = g_key_file_get_integer (keyfile, group, key, &local_error);
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		return 0;
+	}
+	if (count < 1) {
+		g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+			     "Invalid %s in group '%s'", key, group);
+		return 0;
+	}
+	return count;
+}
+
+static gboolean
+check_env (char        **env,
+	   const char   *group,
+	   GError      **error)
+{
+	if (env != NULL && g_strv_length (env) % 2 != 0) {
+		g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+			     "Environment in group '%s' should have an even number of items", group);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean
+load_gpu (Simulation  *sim,
+	  GKeyFile    *keyfile,
+	  const char  *group,
+	  GError     **error)
+{
+	const char *base_id = group + strlen (GPU_GROUP_PREFIX);
+	g_autofree char *name = NULL;
+	g_auto(GStrv) env = NULL;
+	gboolean is_default = FALSE;
+	gboolean is_discrete = FALSE;
+	gboolean present = TRUE;
+	gboolean after_hardware = FALSE;
+	GError *local_error = NULL;
+	guint count = 1;
+	guint i;
+
+	name = g_key_file_get_string (keyfile, group, "Name", NULL);
+	if (name == NULL)
+		name = g_strdup (base_id);
+	env = g_key_file_get_string_list (keyfile, group, "Environment", NULL, NULL);
+	if (!check_env (env, group, error))
+		return FALSE;
+	is_default = get_boolean_with_default (keyfile, group, "Default", FALSE, &local_error);
+	if (local_error == NULL)
+		is_discrete = get_boolean_with_default (keyfile, group, "Discrete", FALSE, &local_error);
+	if (local_error == NULL)
+		present = get_boolean_with_default (keyfile, group, "Present", TRUE, &local_error);
+	if (local_error == NULL)
+		after_hardware = get_boolean_with_default (keyfile, group, "AfterHardware", FALSE, &local_error);
+	if (local_error == NULL)
+		count = get_count (keyfile, group, "Count", &local_error);
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		return FALSE;
+	}
+
+	for (i = 0; i < count; i++) {
+		SimulatedGpu *gpu;
+
+		gpu = g_new0 (SimulatedGpu, 1);
+		gpu->base_id = g_strdup (base_id);
+		if (count > 1) {
+			gpu->id = g_strdup_printf ("%s-%u", base_id, i);
+			gpu->name = g_strdup_printf ("%s #%u", name, i);
+		} else {
+			gpu->id = g_strdup (base_id);
+			gpu->name = g_strdup (name);
+		}
+		gpu->env = env ? g_strdupv (env) : g_new0 (char *, 1);
+		gpu->is_default = is_default;
+		gpu->is_discrete = is_discrete;
+		gpu->present = present;
+		gpu->after_hardware = after_hardware;
+		g_ptr_array_add (sim->gpus, gpu);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+load_event (Simulation  *sim,
+	    GKeyFile    *keyfile,
+	    const char  *group,
+	    GError     **error)
+{
+	SimulationEvent *event;
+	g_autofree char *action = NULL;
+	GError *local_error = NULL;
+
+	event = g_new0 (SimulationEvent, 1);
+	event->sim = sim;
+	event->repeat = 1;
+	g_ptr_array_add (sim->events, event);
+
+	event->gpu = g_key_file_get_string (keyfile, group, "GPU", error);
+	if (event->gpu == NULL)
+		return FALSE;
+	action = g_key_file_get_string (keyfile, group, "Action", error);
+	if (action == NULL)
+		return FALSE;
+	if (g_strcmp0 (action, "add") == 0) {
+		event->action = SIMULATION_ACTION_ADD;
+	} else if (g_strcmp0 (action, "remove") == 0) {
+		event->action = SIMULATION_ACTION_REMOVE;
+	} else if (g_strcmp0 (action, "toggle") == 0) {
+		event->action = SIMULATION_ACTION_TOGGLE;
+	} else if (g_strcmp0 (action, "change") == 0) {
+		event->action = SIMULATION_ACTION_CHANGE;
+	} else {
+		g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_INVALID_VALUE,
+			     "Invalid Action '%s' in group '%s'", action, group);
+		return FALSE;
+	}
+
+	event->time_ms = get_time_ms (keyfile, group, "Time", &local_error);
+	if (local_error == NULL)
+		event->interval_ms = get_time_ms (keyfile, group, "Interval", &local_error);
+	if (local_error == NULL)
+		event->repeat = get_count (keyfile, group, "Repeat", &local_error);
+	if (local_error == NULL && g_key_file_has_key (keyfile, group, "Default", NULL)) {
+		event->set_default = TRUE;
+		event->is_default = g_key_file_get_boolean (keyfile, group, "Default", &local_error);
+	}
+	if (local_error == NULL && g_key_file_has_key (keyfile, group, "Discrete", NULL)) {
+		event->set_discrete = TRUE;
+		event->is_discrete = g_key_file_get_boolean (keyfile, group, "Discrete", &local_error);
+	}
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		return FALSE;
+	}
+
+	event->name = g_key_file_get_string (keyfile, group, "Name", NULL);
+	event->env = g_key_file_get_string_list (keyfile, group, "Environment", NULL, NULL);
+	return check_env (event->env, group, error);
+}
+
+Simulation *
+simulation_new_for_data (const char  *contents,
+			 GError     **error)
+{
+	g_autoptr(GKeyFile) keyfile = NULL;
+	g_auto(GStrv) groups = NULL;
+	Simulation *sim;
+	guint i;
+
+	keyfile = g_key_file_new ();
+	if (!g_key_file_load_from_data (keyfile, contents, -1, G_KEY_FILE_NONE, error))
+		return NULL;
+
+	sim = g_new0 (Simulation, 1);
+	sim->gpus = g_ptr_array_new_with_free_func ((GDestroyNotify) free_simulated_gpu);
+	sim->events = g_ptr_array_new_with_free_func ((GDestroyNotify) free_simulation_event);
+	sim->include_hardware = get_boolean_with_default (keyfile, SIMULATION_GROUP,
+							  "IncludeHardware", FALSE, NULL);
+
+	groups = g_key_file_get_groups (keyfile, NULL);
+	for (i = 0; groups[i] != NULL; i++) {
+		gboolean ret = TRUE;
+
+		if (g_str_has_prefix (groups[i], GPU_GROUP_PREFIX))
+			ret = load_gpu (sim, keyfile, groups[i], error);
+		else if (g_str_has_prefix (groups[i], EVENT_GROUP_PREFIX))
+			ret = load_event (sim, keyfile, groups[i], error);
+		else if (g_strcmp0 (groups[i], SIMULATION_GROUP) != 0)
+			g_debug ("Ignoring unknown simulation group '%s'", groups[i]);
+
+		if (!ret) {
+			simulation_free (sim);
+			return NULL;
+		}
+	}
+
+	return sim;
+}
+
+Simulation *
+simulation_new_for_file (const char  *path,
+			 GError     **error)
+{
+	g_autofree char *contents = NULL;
+
+	if (!g_file_get_contents (path, &contents, NULL, error))
+		return NULL;
+	return simulation_new_for_data (contents, error);
+}
+
+static void
+apply_event (SimulationEvent *event,
+	     SimulatedGpu    *gpu)
+{
+	switch (event->action) {
+	case SIMULATION_ACTION_ADD:
+		gpu->present = TRUE;
+		break;
+	case SIMULATION_ACTION_REMOVE:
+		gpu->present = FALSE;
+		break;
+	case SIMULATION_ACTION_TOGGLE:
+		gpu->present = !gpu->present;
+		break;
+	case SIMULATION_ACTION_CHANGE:
+		if (event->name != NULL) {
+			g_free (gpu->name);
+			gpu->name = g_strdup (event->name);
+		}
+		if (event->env != NULL) {
+			g_strfreev (gpu->env);
+			gpu->env = g_strdupv (event->env);
+		}
+		if (event->set_default)
+			gpu->is_default = event->is_default;
+		if (event->set_discrete)
+			gpu->is_discrete = event->is_discrete;
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+static gboolean
+event_timeout_cb (gpointer user_data)
+{
+	SimulationEvent *event = user_data;
+	Simulation *sim = event->sim;
+	guint i;
+
+	event->timeout_id = 0;
+	event->fired++;
+
+	for (i = 0; i < sim->gpus->len; i++) {
+		SimulatedGpu *gpu = sim->gpus->pdata[i];
+
+		if (g_strcmp0 (gpu->id, event->gpu) == 0 ||
+		    g_strcmp0 (gpu->base_id, event->gpu) == 0)
+			apply_event (event, gpu);
+	}
+
+	g_debug ("Simulated event on '%s' (%u/%u)", event->gpu, event->fired, event->repeat);
+	sim->func (sim->user_data);
+
+	if (event->fired < event->repeat)
+		event->timeout_id = g_timeout_add (event->interval_ms, event_timeout_cb, event);
+
+	return G_SOURCE_REMOVE;
+}
+
+void
+simulation_start (Simulation            *sim,
+		  SimulationChangedFunc  func,
+		  gpointer               user_data)
+{
+	guint i;
+
+	sim->func = func;
+	sim->user_data = user_data;
+
+	for (i = 0; i < sim->events->len; i++) {
+		SimulationEvent *event = sim->events->pdata[i];
+
+		if (event->repeat == 0)
+			continue;
+		event->timeout_id = g_timeout_add (event->time_ms, event_timeout_cb, event);
+	}
+}
+
+gboolean
+simulation_get_include_hardware (Simulation *sim)
+{
+	return sim->include_hardware;
+}
+
+GPtrArray *
+simulation_get_gpus (Simulation *sim)
+{
+	return sim->gpus;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct {
+	char *id;
+	char *base_id;
+	char *name;
+	char **env;
+	gboolean is_default;
+	gboolean is_discrete;
+	gboolean present;
+	gboolean after_hardware;
+} SimulatedGpu;
+
+typedef struct _Simulation Simulation;
+
+typedef void (*SimulationChangedFunc) (gpointer user_data);
+
+Simulation *simulation_new_for_file         (const char             *path,
+					     GError                **error);
+Simulation *simulation_new_for_data         (const char             *contents,
+					     GError                **error);
+void        simulation_free                 (Simulation             *sim);
+void        simulation_start                (Simulation             *sim,
+					     SimulationChangedFunc   func,
+					     gpointer                user_data);
+gboolean    simulation_get_include_hardware (Simulation             *sim);
+GPtrArray  *simulation_get_gpus             (Simulation             *sim);
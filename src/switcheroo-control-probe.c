@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+/*
+ * Spawned by switcheroo-control to create a headless EGL and Vulkan context
+ * on a single GPU, and print what it supports as a key file on stdout.
+ *
+ * Loading a GPU driver runs a lot of code, so this drops privileges and
+ * limits its own resources before doing anything else.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef HAVE_VULKAN
+#include <vulkan/vulkan.h>
+#endif
+
+#define PROBE_GROUP "Graphics"
+#define PROBE_TIMEOUT_SECS 10
+#define PROBE_MAX_MEMORY (4ULL * 1024 * 1024 * 1024)
+
+/* Extensions that make a difference when picking a GPU */
+static const char *interesting_extensions[] = {
+	"EGL_EXT_image_dma_buf_import_modifiers",
+	"EGL_MESA_image_dma_buf_export",
+	"EGL_ANDROID_native_fence_sync",
+	"GL_ARB_gl_spirv",
+	"GL_ARB_bindless_texture",
+	"GL_EXT_memory_object_fd",
+	"GL_EXT_semaphore_fd",
+	"GL_KHR_parallel_shader_compile",
+	"VK_KHR_ray_tracing_pipeline",
+	"VK_KHR_ray_query",
+	"VK_EXT_mesh_shader",
+	"VK_KHR_cooperative_matrix",
+	"VK_KHR_video_decode_queue",
+	"VK_KHR_video_encode_queue",
+	"VK_EXT_external_memory_dma_buf",
+	"VK_EXT_image_drm_format_modifier",
+};
+
+static void
+add_extension (GPtrArray  *extensions,
+	       const char *name)
+{
+	guint i;
+
+	/* GL and GLES share most extensions */
+	if (name == NULL ||
+	    g_ptr_array_find_with_equal_func (extensions, name, g_str_equal, NULL))
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (interesting_extensions); i++) {
+		if (g_strcmp0 (name, interesting_extensions[i]) == 0) {
+			g_ptr_array_add (extensions, g_strdup (name));
+			return;
+		}
+	}
+}
+
+static void
+add_extensions (GPtrArray  *extensions,
+		const char *list)
+{
+	g_auto(GStrv) names = NULL;
+	guint i;
+
+	if (list == NULL)
+		return;
+	names = g_strsplit (list, " ", -1);
+	for (i = 0; names[i] != NULL; i++)
+		add_extension (extensions, names[i]);
+}
+
+#ifdef HAVE_EGL
+#define GL_RENDERER 0x1F01
+#define GL_VERSION 0x1F02
+#define GL_EXTENSIONS 0x1F03
+#define GL_NUM_EXTENSIONS 0x821D
+
+typedef const unsigned char *(*GetStringFunc) (unsigned int name);
+typedef const unsigned char *(*GetStringiFunc) (unsigned int name, unsigned int index);
+typedef void (*GetIntegervFunc) (unsigned int pname, int *data);
+
+static EGLDisplay
+get_egl_display (const char *render_node)
+{
+	PFNEGLQUERYDEVICESEXTPROC query_devices;
+	PFNEGLQUERYDEVICESTRINGEXTPROC query_device_string;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+	EGLDeviceEXT devices[32];
+	EGLint num_devices, i;
+
+	query_devices = (PFNEGLQUERYDEVICESEXTPROC) eglGetProcAddress ("eglQueryDevicesEXT");
+	query_device_string = (PFNEGLQUERYDEVICESTRINGEXTPROC) eglGetProcAddress ("eglQueryDeviceStringEXT");
+	get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress ("eglGetPlatformDisplayEXT");
+	if (query_devices == NULL || query_device_string == NULL || get_platform_display == NULL)
+		return EGL_NO_DISPLAY;
+
+	if (!query_devices (G_N_ELEMENTS (devices), devices, &num_devices))
+		return EGL_NO_DISPLAY;
+
+	for (i = 0; i < num_devices; i++) {
+		const char *exts, *node;
+
+		exts = query_device_string (devices[i], EGL_EXTENSIONS);
+		node = query_device_string (devices[i], EGL_DRM_RENDER_NODE_FILE_EXT);
+		if (render_node != NULL ?
+		    g_strcmp0 (node, render_node) == 0 :
+		    (exts != NULL && strstr (exts, "EGL_MESA_device_software") != NULL))
+			return get_platform_display (EGL_PLATFORM_DEVICE_EXT, devices[i], NULL);
+	}
+
+	/* Without a render node, the environment picks the GPU */
+	if (render_node == NULL)
+		return get_platform_display (EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+
+	return EGL_NO_DISPLAY;
+}
+
+static char *
+get_gl_version (EGLDisplay  dpy,
+		EGLenum     api,
+		char      **renderer,
+		GPtrArray  *extensions)
+{
+	const EGLint gl_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 2,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	const EGLint gles_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 2,
+		EGL_NONE
+	};
+	GetStringFunc get_string;
+	GetStringiFunc get_stringi;
+	GetIntegervFunc get_integerv;
+	EGLContext ctx;
+	char *version;
+
+	if (!eglBindAPI (api))
+		return NULL;
+	ctx = eglCreateContext (dpy, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+				api == EGL_OPENGL_API ? gl_attribs : gles_attribs);
+	if (ctx == EGL_NO_CONTEXT)
+		return NULL;
+	if (!eglMakeCurrent (dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx)) {
+		eglDestroyContext (dpy, ctx);
+		return NULL;
+	}
+
+	get_string = (GetStringFunc) eglGetProcAddress ("glGetString");
+	get_stringi = (GetStringiFunc) eglGetProcAddress ("glGetStringi");
+	get_integerv = (GetIntegervFunc) eglGetProcAddress ("glGetIntegerv");
+
+	version = g_strdup ((const char *) get_string (GL_VERSION));
+	if (renderer != NULL && *renderer == NULL)
+		*renderer = g_strdup ((const char *) get_string (GL_RENDERER));
+	if (get_stringi != NULL && get_integerv != NULL) {
+		int num = 0, i;
+
+		get_integerv (GL_NUM_EXTENSIONS, &num);
+		for (i = 0; i < num; i++)
+			add_extension (extensions, (const char *) get_stringi (GL_EXTENSIONS, i));
+	}
+
+	eglMakeCurrent (dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext (dpy, ctx);
+
+	return version;
+}
+
+static void
+probe_egl (GKeyFile   *keyfile,
+	   const char *render_node,
+	   GPtrArray  *extensions)
+{
+	g_autofree char *renderer = NULL;
+	g_autofree char *gl_version = NULL;
+	g_autofree char *gles_version = NULL;
+	EGLDisplay dpy;
+	const char *mesa;
+
+	dpy = get_egl_display (render_node);
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize (dpy, NULL, NULL)) {
+		g_printerr ("Could not initialise EGL\n");
+		return;
+	}
+	add_extensions (extensions, eglQueryString (dpy, EGL_EXTENSIONS));
+
+	gl_version = get_gl_version (dpy, EGL_OPENGL_API, &renderer, extensions);
+	gles_version = get_gl_version (dpy, EGL_OPENGL_ES_API, &renderer, extensions);
+	eglTerminate (dpy);
+
+	if (renderer != NULL)
+		g_key_file_set_string (keyfile, PROBE_GROUP, "Renderer", renderer);
+	if (gl_version != NULL)
+		g_key_file_set_string (keyfile, PROBE_GROUP, "GLVersion", gl_version);
+	if (gles_version != NULL)
+		g_key_file_set_string (keyfile, PROBE_GROUP, "GLESVersion", gles_version);
+
+	mesa = gl_version ? strstr (gl_version, "Mesa ") : NULL;
+	if (mesa != NULL)
+		g_key_file_set_string (keyfile, PROBE_GROUP, "MesaVersion", mesa + strlen ("Mesa "));
+}
+#endif /* HAVE_EGL */
+
+#ifdef HAVE_VULKAN
+static gboolean
+vulkan_device_has_extension (VkPhysicalDevice  device,
+			     const char       *name,
+			     GPtrArray        *extensions)
+{
+	g_autofree VkExtensionProperties *props = NULL;
+	gboolean ret = FALSE;
+	uint32_t num = 0, i;
+
+	vkEnumerateDeviceExtensionProperties (device, NULL, &num, NULL);
+	props = g_new0 (VkExtensionProperties, num);
+	vkEnumerateDeviceExtensionProperties (device, NULL, &num, props);
+	for (i = 0; i < num; i++) {
+		if (g_strcmp0 (props[i].extensionName, name) == 0)
+			ret = TRUE;
+		if (extensions != NULL)
+			add_extension (extensions, props[i].extensionName);
+	}
+
+	return ret;
+}
+
+static gboolean
+vulkan_device_matches (VkPhysicalDevice  device,
+		       const char       *pci_slot)
+{
+	VkPhysicalDevicePCIBusInfoPropertiesEXT pci_info = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PCI_BUS_INFO_PROPERTIES_EXT,
+	};
+	VkPhysicalDeviceProperties2 props = {
+		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+		.pNext = &pci_info,
+	};
+	g_autofree char *slot = NULL;
+
+	if (pci_slot == NULL) {
+		vkGetPhysicalDeviceProperties2 (device, &props);
+		return props.properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU;
+	}
+
+	if (!vulkan_device_has_extension (device, VK_EXT_PCI_BUS_INFO_EXTENSION_NAME, NULL))
+		return FALSE;
+	vkGetPhysicalDeviceProperties2 (device, &props);
+	slot = g_strdup_printf ("%04x:%02x:%02x.%x",
+				pci_info.pciDomain, pci_info.pciBus,
+				pci_info.pciDevice, pci_info.pciFunction);
+	return g_ascii_strcasecmp (slot, pci_slot) == 0;
+}
+
+static void
+probe_vulkan (GKeyFile   *keyfile,
+	      const char *pci_slot,
+	      GPtrArray  *extensions)
+{
+	VkApplicationInfo app_info = {
+		.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+		.pApplicationName = "switcheroo-control-probe",
+		.apiVersion = VK_API_VERSION_1_1,
+	};
+	VkInstanceCreateInfo create_info = {
+		.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+		.pApplicationInfo = &app_info,
+	};
+	g_autofree VkPhysicalDevice *devices = NULL;
+	VkInstance instance;
+	uint32_t num = 0, i;
+
+	if (vkCreateInstance (&create_info, NULL, &instance) != VK_SUCCESS) {
+		g_printerr ("Could not create Vulkan instance\n");
+		return;
+	}
+
+	vkEnumeratePhysicalDevices (instance, &num, NULL);
+	devices = g_new0 (VkPhysicalDevice, num);
+	vkEnumeratePhysicalDevices (instance, &num, devices);
+	for (i = 0; i < num; i++) {
+		VkPhysicalDeviceProperties props;
+		g_autofree char *version = NULL;
+
+		if (!vulkan_device_matches (devices[i], pci_slot))
+			continue;
+
+		vkGetPhysicalDeviceProperties (devices[i], &props);
+		version = g_strdup_printf ("%u.%u.%u",
+					   VK_API_VERSION_MAJOR (props.apiVersion),
+					   VK_API_VERSION_MINOR (props.apiVersion),
+					   VK_API_VERSION_PATCH (props.apiVersion));
+		g_key_file_set_string (keyfile, PROBE_GROUP, "VulkanVersion", version);
+		g_key_file_set_string (keyfile, PROBE_GROUP, "VulkanDevice", props.deviceName);
+		vulkan_device_has_extension (devices[i], NULL, extensions);
+		break;
+	}
+
+	vkDestroyInstance (instance, NULL);
+}
+#endif /* HAVE_VULKAN */
+
+static gboolean
+drop_privileges (void)
+{
+	const char *groups[] = { "render", "video" };
+	gid_t gids[G_N_ELEMENTS (groups)];
+	struct passwd *pw;
+	guint num_gids = 0, i;
+
+	if (getuid () != 0)
+		return TRUE;
+
+	/* Keep access to the device nodes */
+	for (i = 0; i < G_N_ELEMENTS (groups); i++) {
+		struct group *gr = getgrnam (groups[i]);
+		if (gr != NULL)
+			gids[num_gids++] = gr->gr_gid;
+	}
+
+	pw = getpwnam ("nobody");
+	if (pw == NULL)
+		return FALSE;
+	if (setgroups (num_gids, gids) < 0 ||
+	    setgid (pw->pw_gid) < 0 ||
+	    setuid (pw->pw_uid) < 0)
+		return FALSE;
+
+	return TRUE;
+}
+
+static void
+set_limit (int      resource,
+	   rlim_t   value)
+{
+	struct rlimit rl = { value, value };
+
+	if (setrlimit (resource, &rl) < 0)
+		g_printerr ("Could not set resource limit %d: %s\n", resource, g_strerror (errno));
+}
+
+int main (int argc, char **argv)
+{
+	g_autoptr(GOptionContext) option_context = NULL;
+	g_autoptr(GKeyFile) keyfile = NULL;
+	g_autoptr(GPtrArray) extensions = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree char *render_node = NULL;
+	g_autofree char *pci_slot = NULL;
+	g_autofree char *output = NULL;
+	const GOptionEntry options[] = {
+		{ "render-node", 0, 0, G_OPTION_ARG_FILENAME, &render_node, "Render node of the GPU to probe", "PATH" },
+		{ "pci-slot", 0, 0, G_OPTION_ARG_STRING, &pci_slot, "PCI slot of the GPU to probe", "SLOT" },
+		{ NULL}
+	};
+
+	if (!drop_privileges ()) {
+		g_printerr ("Could not drop privileges: %s\n", g_strerror (errno));
+		return EXIT_FAILURE;
+	}
+	prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0);
+	set_limit (RLIMIT_CORE, 0);
+	set_limit (RLIMIT_CPU, PROBE_TIMEOUT_SECS);
+	set_limit (RLIMIT_AS, PROBE_MAX_MEMORY);
+	set_limit (RLIMIT_NOFILE, 256);
+	alarm (PROBE_TIMEOUT_SECS);
+
+	option_context = g_option_context_new ("");
+	g_option_context_add_main_entries (option_context, options, NULL);
+	if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+		g_printerr ("Failed to parse arguments: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	keyfile = g_key_file_new ();
+	extensions = g_ptr_array_new_with_free_func (g_free);
+#ifdef HAVE_EGL
+	probe_egl (keyfile, render_node, extensions);
+#endif
+#ifdef HAVE_VULKAN
+	probe_vulkan (keyfile, pci_slot, extensions);
+#endif
+	if (!g_key_file_has_group (keyfile, PROBE_GROUP))
+		return EXIT_FAILURE;
+
+	g_key_file_set_string_list (keyfile, PROBE_GROUP, "Extensions",
+				    (const char * const *) extensions->pdata, extensions->len);
+	output = g_key_file_to_data (keyfile, NULL, NULL);
+	fputs (output, stdout);
+
+	return EXIT_SUCCESS;
+}
@@ -10,54 +10,361 @@
 #define _GNU_SOURCE
 
 #include <locale.h>
+#include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/utsname.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <gudev/gudev.h>
+#include <polkit/polkit.h>
 
+#include "aer.h"
+#include "cdi.h"
+#include "drm-caps.h"
+#include "energy.h"
+#include "history.h"
 #include "info-cleanup.h"
+#include "performance.h"
+#include "simulation.h"
+#include "telemetry.h"
+#include "watchdog.h"
 #include "switcheroo-control-resources.h"
 
 #define CONTROL_PROXY_DBUS_NAME          "net.hadess.SwitcherooControl"
 #define CONTROL_PROXY_DBUS_PATH          "/net/hadess/SwitcherooControl"
 #define CONTROL_PROXY_IFACE_NAME         CONTROL_PROXY_DBUS_NAME
 
+#define VGA_SWITCHEROO_PATH              "/sys/kernel/debug/vgaswitcheroo/switch"
+
+#define SOFTWARE_GPU_ID                  "software"
+#define PROBE_TIMEOUT_SECS               15
+
+#define MAX_SENDERS                      256
+#define MAX_TOP_TALKERS                  10
+
+#define MAX_PERF_LEASES                  64
+#define MAX_PERF_LEASES_PER_SENDER       4
+
+#define MAX_TELEMETRY_READERS            32
+#define MAX_TELEMETRY_OPENS_PER_READER   16
+
+#define HANDOVER_VERSION                 1
+#define HANDOVER_TIMEOUT_MS              5000
+
+/* Discrete GPUs are imbalanced when one is busier than the high mark,
+ * and another idler than the low mark, for long enough */
+#define IMBALANCE_MAX_CHECK_SECS         5
+#define IMBALANCE_MIN_CHECKS             6
+#define IMBALANCE_BUSY_HIGH              90
+#define IMBALANCE_BUSY_LOW               20
+
+typedef enum {
+	MUX_MODE_NONE,
+	MUX_MODE_HYBRID,
+	MUX_MODE_DISCRETE
+} MuxMode;
+
+typedef struct {
+	const char *subsystem;
+	const char *name; /* NULL for any device of the subsystem */
+	const char *attribute;
+	const char *discrete_value;
+} MuxAttribute;
+
+/* Firmware MUX switches, and the value for which the discrete GPU
+ * drives the internal panel directly */
+static const MuxAttribute mux_attributes[] = {
+	{ "platform", "asus-nb-wmi", "gpu_mux_mode", "0" },
+	{ "firmware-attributes", "asus-armoury", "attributes/gpu_mux_mode/current_value", "0" },
+	{ "firmware-attributes", NULL, "attributes/dgpu_only/current_value", "1" },
+};
+
+/* Methods that change the system's state, and the polkit action
+ * callers need to be authorised for */
+typedef struct {
+	const char *method_name;
+	const char *action_id;
+} MethodAction;
+
+static const MethodAction method_actions[] = {
+	{ "VgaSwitcherooPowerOff", CONTROL_PROXY_DBUS_NAME ".vga-switcheroo" },
+	{ "VgaSwitcherooScheduleSwitch", CONTROL_PROXY_DBUS_NAME ".vga-switcheroo" },
+	{ "Handover", CONTROL_PROXY_DBUS_NAME ".handover" },
+	{ "RequestPerformance", CONTROL_PROXY_DBUS_NAME ".request-performance" },
+};
+
+typedef enum {
+	CARD_FUNCTION_PHYSICAL,
+	CARD_FUNCTION_VIRTUAL,
+	CARD_FUNCTION_PARTITION
+} CardFunction;
+
+/* amdgpu compute partition modes */
+typedef struct {
+	const char *mode;
+	guint num_partitions;
+} ComputePartitionMode;
+
+static const ComputePartitionMode compute_partition_modes[] = {
+	{ "SPX", 1 },
+	{ "DPX", 2 },
+	{ "TPX", 3 },
+	{ "QPX", 4 },
+	{ "CPX", 0 },
+};
+
+typedef struct {
+	const char *driver;
+	const char *type;
+	/* set to the accelerator's index, for runtimes that can
+	 * select a device through the environment */
+	const char *index_env;
+} AccelDriver;
+
+static const AccelDriver accel_drivers[] = {
+	{ "intel_vpu", "npu", NULL },
+	{ "amdxdna", "npu", NULL },
+	{ "habanalabs", "compute", "HABANA_VISIBLE_DEVICES" },
+	{ "qaic", "compute", NULL },
+};
+
 typedef struct {
 	GUdevDevice *dev;
+	char *id;
 	char *name;
 	GPtrArray *env;
 	gboolean is_default;
+	gboolean is_discrete;
+	char *pci_slot;
+
+	/* SR-IOV virtual functions and compute partitions */
+	CardFunction function;
+	guint function_index;
+	char *group;
+	gdouble capacity;
+
+	/* Accelerators only */
+	const AccelDriver *accel_driver;
+
+	/* Set once the name and graphics API support were worked
+	 * out, see ensure_card_details() */
+	gboolean details_done;
+
+	/* Probed from the render node, or from the cache */
+	DrmCaps *drm_caps;
+	char *graphics_key;
+	GVariant *graphics;
+
+	/* vga_switcheroo client state, if it's a client */
+	gboolean vga_switcheroo_client;
+	gboolean vga_switcheroo_active;
+	const char *vga_switcheroo_power;
+
+	/* Set if the GPU is known but can't currently be used */
+	const char *unavailable;
+
+	/* Set if the PCIe link is monitored */
+	const char *link_health;
+
+	/* Set while launchers should favour this discrete GPU */
+	gboolean preferred;
 } CardData;
 
+/* GPUs we've seen, kept across driver unbinds */
+typedef struct {
+	char *id;
+	char *name;
+	char *parent_path;
+	gboolean is_discrete;
+} KnownCard;
+
+/* D-Bus request accounting, per unique bus name */
+typedef struct {
+	char *sender;
+	char *process;
+	gboolean process_looked_up;
+	guint64 num_requests;
+	guint64 num_bytes;
+	guint64 num_throttled;
+	/* Token bucket */
+	gdouble tokens;
+	gint64 last_refill;
+} SenderStats;
+
 typedef struct {
 	GMainLoop *loop;
 	GDBusNodeInfo *introspection_data;
 	GDBusConnection *connection;
+	PolkitAuthority *authority;
 	guint name_id;
 	gboolean init_done;
+	gboolean ready;
+	Watchdog *watchdog;
+
+	/* Replacing a running instance */
+	GVariant *handover; /* state the previous instance handed over */
+	gboolean handed_over;
+	GVariant *published; /* properties clients already know about */
 
 	/* Detection */
 	GUdevClient *client;
-	gboolean add_fake_cards;
+	Simulation *simulation;
+	char *cdi_spec_dir;
+	gboolean vga_switcheroo;
+	gboolean software_gpu;
+	MuxMode mux_mode;
 	guint num_gpus;
 	GPtrArray *cards; /* array of CardData */
+	gboolean details_wanted;
+	GPtrArray *accels; /* array of CardData */
+	GHashTable *known_cards; /* PCI slot -> KnownCard */
+	GKeyFile *drm_caps_cache;
+	char *drm_caps_cache_path;
+	GHashTable *drm_caps_failed; /* set of cache keys */
+
+	/* Graphics API probes */
+	gboolean probe_graphics;
+	char *graphics_stamp;
+	GKeyFile *graphics_cache;
+	char *graphics_cache_path;
+	GHashTable *graphics_failed; /* set of cache keys */
+	GSubprocess *probe;
+	char *probe_key;
+	guint probe_timeout_id;
+	GCancellable *probe_cancellable;
+
+	/* OpenMetrics export */
+	char *metrics_file;
+	char *metrics_contents;
+	guint metrics_timeout_id;
+	guint64 num_uevents;
+	guint64 num_rescans;
+	guint64 num_changes;
+	guint64 num_dbus_requests;
+
+	/* Per-sender accounting and rate limiting */
+	guint rate_limit; /* requests per second, 0 if disabled */
+	guint rate_burst;
+	GHashTable *senders; /* unique bus name -> SenderStats */
+	GHashTable *deferred_calls; /* GDBusMethodInvocation -> timeout ID */
+
+	/* Shared-memory telemetry */
+	guint telemetry_interval;
+	GHashTable *telemetry_rings; /* GPU Id -> TelemetryRing */
+	GHashTable *telemetry_readers; /* bus name -> TelemetryReader */
+	guint telemetry_timeout_id;
+
+	/* Performance level leases */
+	guint max_boost_duration; /* seconds, 0 if disabled */
+	GHashTable *perf_controls; /* GPU Id -> PerfControl */
+	GPtrArray *perf_leases; /* array of PerfLease */
+	GKeyFile *perf_state;
+	char *perf_state_path;
+
+	/* PCIe AER monitoring */
+	guint aer_interval; /* seconds, 0 if disabled */
+	guint aer_threshold; /* correctable errors per minute */
+	GHashTable *aer_monitors; /* GPU device path -> AerMonitor */
+	guint aer_timeout_id;
+
+	/* Long-term usage history */
+	char *history_dir; /* NULL if disabled */
+	GHashTable *histories; /* GPU Id -> History */
+	guint history_timeout_id;
+
+	/* Per-application energy attribution */
+	guint energy_interval; /* seconds, 0 if disabled */
+	EnergyTracker *energy_tracker;
+	guint energy_timeout_id;
+
+	/* Imbalance between discrete GPUs */
+	guint rebalance_period; /* seconds, 0 if disabled */
+	guint imbalance_duration; /* seconds */
+	guint imbalance_interval;
+	guint imbalance_timeout_id;
+	char *imbalance_busy; /* GPU Ids of the current imbalance */
+	char *imbalance_idle;
+	guint imbalance_checks;
+	char *preferred_gpu;
+	guint preferred_timeout_id;
 } ControlData;
 
+/* Held for as long as the client keeps the other end of the pipe open */
+typedef struct {
+	ControlData *data;
+	char *id;
+	char *sender;
+	guint request_id;
+	int fd;
+	guint fd_watch_id;
+	guint timeout_id;
+} PerfLease;
+
 static void
 free_card_data (CardData *data)
 {
 	if (data == NULL)
 		return;
 
-	g_object_unref (data->dev);
+	g_clear_object (&data->dev);
+	g_free (data->id);
 	g_free (data->name);
 	g_ptr_array_free (data->env, TRUE);
+	g_free (data->pci_slot);
+	g_free (data->group);
+	drm_caps_free (data->drm_caps);
+	g_free (data->graphics_key);
+	g_clear_pointer (&data->graphics, g_variant_unref);
+	g_free (data);
+}
+
+static void
+free_sender_stats (SenderStats *stats)
+{
+	if (stats == NULL)
+		return;
+
+	g_free (stats->sender);
+	g_free (stats->process);
+	g_free (stats);
+}
+
+static void
+free_known_card (KnownCard *known)
+{
+	if (known == NULL)
+		return;
+
+	g_free (known->id);
+	g_free (known->name);
+	g_free (known->parent_path);
+	g_free (known);
 }
 
+static void
+free_perf_lease (PerfLease *lease)
+{
+	if (lease == NULL)
+		return;
+
+	g_clear_handle_id (&lease->fd_watch_id, g_source_remove);
+	g_clear_handle_id (&lease->timeout_id, g_source_remove);
+	close (lease->fd);
+	g_free (lease->id);
+	g_free (lease->sender);
+	g_free (lease);
+}
+
+static void release_all_perf_leases (ControlData *data);
+static void reject_deferred_calls (ControlData *data);
+
 static void
 free_control_data (ControlData *data)
 {
@@ -69,31 +376,187 @@ free_control_data (ControlData *data)
 		data->name_id = 0;
 	}
 
+	g_clear_pointer (&data->watchdog, watchdog_free);
+	g_clear_pointer (&data->handover, g_variant_unref);
+	g_clear_pointer (&data->published, g_variant_unref);
 	g_clear_object (&data->client);
+	g_clear_pointer (&data->simulation, simulation_free);
+	g_clear_pointer (&data->cdi_spec_dir, g_free);
+	g_clear_pointer (&data->known_cards, g_hash_table_unref);
+	g_clear_pointer (&data->drm_caps_cache, g_key_file_unref);
+	g_clear_pointer (&data->drm_caps_cache_path, g_free);
+	g_clear_pointer (&data->drm_caps_failed, g_hash_table_unref);
+	if (data->probe_cancellable)
+		g_cancellable_cancel (data->probe_cancellable);
+	if (data->probe)
+		g_subprocess_force_exit (data->probe);
+	g_clear_object (&data->probe);
+	g_clear_object (&data->probe_cancellable);
+	g_clear_handle_id (&data->probe_timeout_id, g_source_remove);
+	g_clear_pointer (&data->probe_key, g_free);
+	g_clear_pointer (&data->graphics_stamp, g_free);
+	g_clear_pointer (&data->graphics_cache, g_key_file_unref);
+	g_clear_pointer (&data->graphics_cache_path, g_free);
+	g_clear_pointer (&data->graphics_failed, g_hash_table_unref);
+	g_clear_handle_id (&data->metrics_timeout_id, g_source_remove);
+	g_clear_pointer (&data->metrics_file, g_free);
+	g_clear_pointer (&data->metrics_contents, g_free);
+	g_clear_pointer (&data->senders, g_hash_table_unref);
+	reject_deferred_calls (data);
+	g_clear_handle_id (&data->telemetry_timeout_id, g_source_remove);
+	g_clear_pointer (&data->telemetry_readers, g_hash_table_unref);
+	g_clear_pointer (&data->telemetry_rings, g_hash_table_unref);
+	g_clear_handle_id (&data->aer_timeout_id, g_source_remove);
+	g_clear_pointer (&data->aer_monitors, g_hash_table_unref);
+	g_clear_handle_id (&data->history_timeout_id, g_source_remove);
+	g_clear_pointer (&data->histories, g_hash_table_unref);
+	g_clear_pointer (&data->history_dir, g_free);
+	g_clear_handle_id (&data->energy_timeout_id, g_source_remove);
+	g_clear_pointer (&data->energy_tracker, energy_tracker_free);
+	g_clear_handle_id (&data->imbalance_timeout_id, g_source_remove);
+	g_clear_handle_id (&data->preferred_timeout_id, g_source_remove);
+	g_clear_pointer (&data->imbalance_busy, g_free);
+	g_clear_pointer (&data->imbalance_idle, g_free);
+	g_clear_pointer (&data->preferred_gpu, g_free);
+	release_all_perf_leases (data);
+	g_clear_pointer (&data->perf_leases, g_ptr_array_unref);
+	g_clear_pointer (&data->perf_controls, g_hash_table_unref);
+	g_clear_pointer (&data->perf_state, g_key_file_unref);
+	g_clear_pointer (&data->perf_state_path, g_free);
 	g_clear_pointer (&data->introspection_data, g_dbus_node_info_unref);
 	g_clear_object (&data->connection);
+	g_clear_object (&data->authority);
 	g_clear_pointer (&data->loop, g_main_loop_unref);
 	g_free (data);
 }
 
+static const char *
+mux_mode_to_str (MuxMode mode)
+{
+	switch (mode) {
+	case MUX_MODE_HYBRID:
+		return "hybrid";
+	case MUX_MODE_DISCRETE:
+		return "discrete";
+	case MUX_MODE_NONE:
+	default:
+		return "none";
+	}
+}
+
+static const char *
+card_function_to_str (CardFunction function)
+{
+	switch (function) {
+	case CARD_FUNCTION_VIRTUAL:
+		return "virtual";
+	case CARD_FUNCTION_PARTITION:
+		return "partition";
+	case CARD_FUNCTION_PHYSICAL:
+	default:
+		return "physical";
+	}
+}
+
 static GVariant *
-build_gpus_variant (ControlData *data)
+build_gpus_variant (GPtrArray *cards)
 {
 	GVariantBuilder builder;
 	guint i;
 
 	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
 
-	for (i = 0; i < data->cards->len; i++) {
-		CardData *card = data->cards->pdata[i];
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
 		GVariantBuilder asv_builder;
 
 		g_variant_builder_init (&asv_builder, G_VARIANT_TYPE ("a{sv}"));
-		g_variant_builder_add (&asv_builder, "{sv}", "Name", g_variant_new_string (card->name));
+		/* Not worked out yet when comparing GPUs nobody asked about */
+		if (card->name != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Name", g_variant_new_string (card->name));
 		g_variant_builder_add (&asv_builder, "{sv}", "Environment",
 				       g_variant_new_strv ((const gchar * const *) card->env->pdata, card->env->len));
 		g_variant_builder_add (&asv_builder, "{sv}", "Default",
 				       g_variant_new_boolean (card->is_default));
+		g_variant_builder_add (&asv_builder, "{sv}", "Discrete",
+				       g_variant_new_boolean (card->is_discrete));
+		if (card->id != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Id",
+					       g_variant_new_string (card->id));
+		if (card->dev != NULL && card->unavailable == NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Device",
+					       g_variant_new_string (g_udev_device_get_device_file (card->dev)));
+		g_variant_builder_add (&asv_builder, "{sv}", "Function",
+				       g_variant_new_string (card_function_to_str (card->function)));
+		if (card->group != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Group",
+					       g_variant_new_string (card->group));
+		g_variant_builder_add (&asv_builder, "{sv}", "Capacity",
+				       g_variant_new_double (card->capacity));
+		if (card->unavailable != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Unavailable",
+					       g_variant_new_string (card->unavailable));
+		if (card->drm_caps != NULL) {
+			g_variant_builder_add (&asv_builder, "{sv}", "Driver",
+					       g_variant_new_string (card->drm_caps->driver));
+			g_variant_builder_add (&asv_builder, "{sv}", "DriverVersion",
+					       g_variant_new_string (card->drm_caps->version));
+			g_variant_builder_add (&asv_builder, "{sv}", "Capabilities",
+					       g_variant_new_strv ((const gchar * const *) card->drm_caps->capabilities, -1));
+		}
+		if (card->graphics != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Graphics", card->graphics);
+		if (card->link_health != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "LinkHealth",
+					       g_variant_new_string (card->link_health));
+		if (card->preferred)
+			g_variant_builder_add (&asv_builder, "{sv}", "Preferred",
+					       g_variant_new_boolean (TRUE));
+		if (card->vga_switcheroo_client) {
+			g_variant_builder_add (&asv_builder, "{sv}", "VgaSwitcherooActive",
+					       g_variant_new_boolean (card->vga_switcheroo_active));
+			g_variant_builder_add (&asv_builder, "{sv}", "VgaSwitcherooPower",
+					       g_variant_new_string (card->vga_switcheroo_power));
+		}
+
+		g_variant_builder_add (&builder, "a{sv}", &asv_builder);
+	}
+
+	return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+build_accels_variant (GPtrArray *accels)
+{
+	GVariantBuilder builder;
+	guint i;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+
+	for (i = 0; i < accels->len; i++) {
+		CardData *accel = accels->pdata[i];
+		g_autoptr(GUdevDevice) parent = NULL;
+		GVariantBuilder asv_builder;
+		const char *pci_id;
+
+		g_variant_builder_init (&asv_builder, G_VARIANT_TYPE ("a{sv}"));
+		g_variant_builder_add (&asv_builder, "{sv}", "Name", g_variant_new_string (accel->name));
+		g_variant_builder_add (&asv_builder, "{sv}", "Type",
+				       g_variant_new_string (accel->accel_driver ? accel->accel_driver->type : "unknown"));
+		g_variant_builder_add (&asv_builder, "{sv}", "Device",
+				       g_variant_new_string (g_udev_device_get_device_file (accel->dev)));
+		g_variant_builder_add (&asv_builder, "{sv}", "Environment",
+				       g_variant_new_strv ((const gchar * const *) accel->env->pdata, accel->env->len));
+
+		parent = g_udev_device_get_parent (accel->dev);
+		if (g_udev_device_get_driver (parent) != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "Driver",
+					       g_variant_new_string (g_udev_device_get_driver (parent)));
+		pci_id = g_udev_device_get_property (parent, "PCI_ID");
+		if (pci_id != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "PciId", g_variant_new_string (pci_id));
+		if (accel->pci_slot != NULL)
+			g_variant_builder_add (&asv_builder, "{sv}", "PciSlot", g_variant_new_string (accel->pci_slot));
 
 		g_variant_builder_add (&builder, "a{sv}", &asv_builder);
 	}
@@ -101,314 +564,3889 @@ build_gpus_variant (ControlData *data)
 	return g_variant_builder_end (&builder);
 }
 
+static void ensure_card_details (ControlData *data, GPtrArray *cards);
+static void want_card_details (ControlData *data);
+static char *get_card_device_path (CardData *card);
+
+static AerMonitor *
+find_aer_monitor (ControlData *data,
+		  CardData    *card)
+{
+	g_autofree char *path = NULL;
+
+	if (data->aer_monitors == NULL)
+		return NULL;
+	path = get_card_device_path (card);
+	if (path == NULL)
+		return NULL;
+	return g_hash_table_lookup (data->aer_monitors, path);
+}
+
 static void
-send_dbus_event (ControlData *data)
+append_metric_label (GString    *str,
+		     const char *name,
+		     const char *value)
 {
-	GVariantBuilder props_builder;
-	GVariant *props_changed = NULL;
+	const char *p;
 
-	if (data->connection == NULL) {
-		g_debug ("Not sending D-Bus event, D-Bus not ready");
+	if (str->str[str->len - 1] != '{')
+		g_string_append_c (str, ',');
+	g_string_append_printf (str, "%s=\"", name);
+	for (p = value ? value : ""; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"')
+			g_string_append_c (str, '\\');
+		if (*p == '\n')
+			g_string_append (str, "\\n");
+		else
+			g_string_append_c (str, *p);
+	}
+	g_string_append_c (str, '"');
+}
+
+static const char *
+get_card_driver (CardData *card)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	if (card->drm_caps != NULL)
+		return card->drm_caps->driver;
+	if (card->dev == NULL)
+		return NULL;
+	parent = g_udev_device_get_parent (card->dev);
+	if (parent == NULL)
+		return NULL;
+	/* Interned, so that it outlives the parent */
+	return g_intern_string (g_udev_device_get_driver (parent));
+}
+
+static const char *
+get_card_class (CardData *card)
+{
+	if (g_strcmp0 (card->id, SOFTWARE_GPU_ID) == 0)
+		return "software";
+	return card->is_discrete ? "discrete" : "integrated";
+}
+
+static int
+compare_sender_requests (gconstpointer a,
+			 gconstpointer b)
+{
+	const SenderStats *stats_a = *(SenderStats **) a;
+	const SenderStats *stats_b = *(SenderStats **) b;
+
+	if (stats_a->num_requests == stats_b->num_requests)
+		return 0;
+	return stats_a->num_requests < stats_b->num_requests ? 1 : -1;
+}
+
+static void lookup_sender_process (ControlData *data, SenderStats *stats);
+
+static void
+append_sender_metrics (ControlData *data,
+		       GString     *str)
+{
+	const struct {
+		const char *name;
+		const char *help;
+		gsize offset;
+	} counters[] = {
+		{ "switcheroo_client_requests", "D-Bus requests from the busiest clients", G_STRUCT_OFFSET (SenderStats, num_requests) },
+		{ "switcheroo_client_bytes", "D-Bus payload bytes exchanged with the busiest clients", G_STRUCT_OFFSET (SenderStats, num_bytes) },
+		{ "switcheroo_client_throttled", "D-Bus requests from the busiest clients over their budget", G_STRUCT_OFFSET (SenderStats, num_throttled) },
+	};
+	g_autoptr(GPtrArray) senders = NULL;
+	GHashTableIter iter;
+	SenderStats *stats;
+	guint i, j;
+
+	if (data->senders == NULL)
 		return;
+
+	senders = g_ptr_array_new ();
+	g_hash_table_iter_init (&iter, data->senders);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &stats))
+		g_ptr_array_add (senders, stats);
+	g_ptr_array_sort (senders, compare_sender_requests);
+
+	/* Only the top talkers are named, on the next write */
+	for (j = 0; j < MIN (senders->len, MAX_TOP_TALKERS); j++)
+		lookup_sender_process (data, senders->pdata[j]);
+
+	for (i = 0; i < G_N_ELEMENTS (counters); i++) {
+		g_string_append_printf (str, "# TYPE %s counter\n"
+					"# HELP %s %s\n",
+					counters[i].name, counters[i].name, counters[i].help);
+		for (j = 0; j < MIN (senders->len, MAX_TOP_TALKERS); j++) {
+			stats = senders->pdata[j];
+
+			g_string_append_printf (str, "%s_total{", counters[i].name);
+			append_metric_label (str, "sender", stats->sender);
+			append_metric_label (str, "process", stats->process);
+			g_string_append_printf (str, "} %" G_GUINT64_FORMAT "\n",
+						G_STRUCT_MEMBER (guint64, stats, counters[i].offset));
+		}
 	}
+}
 
-	g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
+static void
+append_aer_metrics (ControlData *data,
+		    GString     *str)
+{
+	guint i;
 
-	g_variant_builder_add (&props_builder, "{sv}", "HasDualGpu",
-			       g_variant_new_boolean (data->num_gpus >= 2));
-	g_variant_builder_add (&props_builder, "{sv}", "NumGPUs",
-			       g_variant_new_uint32 (data->num_gpus));
-	g_variant_builder_add (&props_builder, "{sv}", "GPUs",
-			       build_gpus_variant (data));
+	if (data->aer_monitors == NULL ||
+	    g_hash_table_size (data->aer_monitors) == 0)
+		return;
 
-	props_changed = g_variant_new ("(s@a{sv}@as)", CONTROL_PROXY_IFACE_NAME,
-				       g_variant_builder_end (&props_builder),
-				       g_variant_new_strv (NULL, 0));
+	g_string_append (str, "# TYPE switcheroo_gpu_pcie_errors counter\n"
+			      "# HELP switcheroo_gpu_pcie_errors PCIe errors reported by the GPU and its upstream ports\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		AerMonitor *monitor;
+		AerCounters counters;
 
-	g_dbus_connection_emit_signal (data->connection,
-				       NULL,
-				       CONTROL_PROXY_DBUS_PATH,
-				       "org.freedesktop.DBus.Properties",
-				       "PropertiesChanged",
-				       props_changed, NULL);
+		monitor = find_aer_monitor (data, card);
+		if (monitor == NULL)
+			continue;
+		aer_monitor_get_counters (monitor, &counters);
+		g_string_append (str, "switcheroo_gpu_pcie_errors_total{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, ",severity=\"correctable\"} %" G_GUINT64_FORMAT "\n", counters.correctable);
+		g_string_append (str, "switcheroo_gpu_pcie_errors_total{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, ",severity=\"nonfatal\"} %" G_GUINT64_FORMAT "\n", counters.nonfatal);
+		g_string_append (str, "switcheroo_gpu_pcie_errors_total{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, ",severity=\"fatal\"} %" G_GUINT64_FORMAT "\n", counters.fatal);
+	}
+
+	g_string_append (str, "# TYPE switcheroo_gpu_pcie_correctable_rate gauge\n"
+			      "# HELP switcheroo_gpu_pcie_correctable_rate Correctable PCIe errors per minute\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		AerMonitor *monitor;
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+		monitor = find_aer_monitor (data, card);
+		if (monitor == NULL)
+			continue;
+		g_string_append (str, "switcheroo_gpu_pcie_correctable_rate{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, "} %s\n",
+					g_ascii_dtostr (buf, sizeof (buf), aer_monitor_get_rate (monitor)));
+	}
+
+	g_string_append (str, "# TYPE switcheroo_gpu_pcie_link_health gauge\n"
+			      "# HELP switcheroo_gpu_pcie_link_health 0 if the link is good, 1 if degraded, 2 if failing\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		AerMonitor *monitor;
+
+		monitor = find_aer_monitor (data, card);
+		if (monitor == NULL)
+			continue;
+		g_string_append (str, "switcheroo_gpu_pcie_link_health{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, "} %d\n", aer_monitor_get_health (monitor));
+	}
 }
 
-static GVariant *
-handle_get_property (GDBusConnection *connection,
-		     const gchar     *sender,
-		     const gchar     *object_path,
-		     const gchar     *interface_name,
-		     const gchar     *property_name,
-		     GError         **error,
-		     gpointer         user_data)
+static void
+append_cgroup_metrics (ControlData *data,
+		       GString     *str)
 {
-	ControlData *data = user_data;
+	g_autoptr(GPtrArray) usage = NULL;
+	guint i;
 
-	g_assert (data->connection);
+	usage = energy_tracker_get_cgroup_usage (data->energy_tracker);
+	if (usage->len == 0)
+		return;
 
-	if (g_strcmp0 (property_name, "HasDualGpu") == 0)
-		return g_variant_new_boolean (data->num_gpus >= 2);
-	if (g_strcmp0 (property_name, "NumGPUs") == 0)
-		return g_variant_new_uint32 (data->num_gpus);
-	if (g_strcmp0 (property_name, "GPUs") == 0)
-		return build_gpus_variant (data);
+	g_string_append (str, "# TYPE switcheroo_cgroup_gpu_busy_seconds counter\n"
+			      "# HELP switcheroo_cgroup_gpu_busy_seconds Engine time of the cgroup's DRM clients\n");
+	for (i = 0; i < usage->len; i++) {
+		CgroupUsage *u = usage->pdata[i];
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
 
-	return NULL;
+		g_string_append (str, "switcheroo_cgroup_gpu_busy_seconds_total{");
+		append_metric_label (str, "cgroup", u->cgroup);
+		append_metric_label (str, "id", u->gpu_id);
+		g_string_append_printf (str, "} %s\n",
+					g_ascii_dtostr (buf, sizeof (buf), u->busy_ns / 1e9));
+	}
+
+	g_string_append (str, "# TYPE switcheroo_cgroup_gpu_memory_bytes gauge\n"
+			      "# HELP switcheroo_cgroup_gpu_memory_bytes GPU memory held by the cgroup's DRM clients\n");
+	for (i = 0; i < usage->len; i++) {
+		CgroupUsage *u = usage->pdata[i];
+
+		g_string_append (str, "switcheroo_cgroup_gpu_memory_bytes{");
+		append_metric_label (str, "cgroup", u->cgroup);
+		append_metric_label (str, "id", u->gpu_id);
+		g_string_append_printf (str, "} %" G_GUINT64_FORMAT "\n", u->memory);
+	}
 }
 
-static const GDBusInterfaceVTable interface_vtable =
+static void
+append_energy_metrics (ControlData *data,
+		       GString     *str)
 {
-	NULL,
-	handle_get_property,
-	NULL
-};
+	g_autoptr(GPtrArray) usage = NULL;
+	guint i;
+
+	if (data->energy_tracker == NULL)
+		return;
+	append_cgroup_metrics (data, str);
+	usage = energy_tracker_get_usage (data->energy_tracker);
+	if (usage->len == 0)
+		return;
+
+	g_string_append (str, "# TYPE switcheroo_app_gpu_energy_joules counter\n"
+			      "# HELP switcheroo_app_gpu_energy_joules GPU energy attributed to applications, \"\" being the GPU without clients\n");
+	for (i = 0; i < usage->len; i++) {
+		EnergyUsage *u = usage->pdata[i];
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+		g_string_append (str, "switcheroo_app_gpu_energy_joules_total{");
+		append_metric_label (str, "app", u->app_id);
+		append_metric_label (str, "id", u->gpu_id);
+		g_string_append_printf (str, "} %s\n",
+					g_ascii_dtostr (buf, sizeof (buf), u->energy_uj / 1e6));
+	}
+}
 
 static void
-name_lost_handler (GDBusConnection *connection,
-		   const gchar     *name,
-		   gpointer         user_data)
+append_watchdog_metrics (ControlData *data,
+			 GString     *str)
 {
-	g_debug ("switcheroo-control is already running, or it cannot own its D-Bus name. Verify installation.");
-	exit (0);
+	guint64 num_stalls;
+	gint64 max_dispatch, max_latency;
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (data->watchdog == NULL)
+		return;
+
+	watchdog_get_stats (data->watchdog, &num_stalls, &max_dispatch, &max_latency);
+	g_string_append_printf (str,
+				"# TYPE switcheroo_main_loop_stalls counter\n"
+				"# HELP switcheroo_main_loop_stalls Main loop handlers that ran for longer than the stall threshold\n"
+				"switcheroo_main_loop_stalls_total %" G_GUINT64_FORMAT "\n",
+				num_stalls);
+	g_string_append_printf (str,
+				"# TYPE switcheroo_main_loop_dispatch_max_seconds gauge\n"
+				"# HELP switcheroo_main_loop_dispatch_max_seconds Longest main loop handler run\n"
+				"switcheroo_main_loop_dispatch_max_seconds %s\n",
+				g_ascii_dtostr (buf, sizeof (buf), (gdouble) max_dispatch / G_USEC_PER_SEC));
+	g_string_append_printf (str,
+				"# TYPE switcheroo_main_loop_latency_max_seconds gauge\n"
+				"# HELP switcheroo_main_loop_latency_max_seconds Longest wait for a watchdog ping to be dispatched\n"
+				"switcheroo_main_loop_latency_max_seconds %s\n",
+				g_ascii_dtostr (buf, sizeof (buf), (gdouble) max_latency / G_USEC_PER_SEC));
+}
+
+static char *
+build_metrics (ControlData *data)
+{
+	GString *str;
+	guint i;
+
+	want_card_details (data);
+	str = g_string_new (NULL);
+
+	g_string_append (str, "# TYPE switcheroo_gpu_info gauge\n"
+			      "# HELP switcheroo_gpu_info GPUs known to switcheroo-control\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+
+		g_string_append (str, "switcheroo_gpu_info{");
+		append_metric_label (str, "id", card->id);
+		append_metric_label (str, "name", card->name);
+		append_metric_label (str, "driver", get_card_driver (card));
+		append_metric_label (str, "default", card->is_default ? "true" : "false");
+		append_metric_label (str, "class", get_card_class (card));
+		append_metric_label (str, "function", card_function_to_str (card->function));
+		g_string_append (str, "} 1\n");
+	}
+
+	g_string_append (str, "# TYPE switcheroo_gpu_available gauge\n"
+			      "# HELP switcheroo_gpu_available Whether the GPU can be used\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+
+		g_string_append (str, "switcheroo_gpu_available{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, "} %d\n", card->unavailable == NULL);
+	}
+
+	g_string_append (str, "# TYPE switcheroo_gpu_capacity gauge\n"
+			      "# HELP switcheroo_gpu_capacity Share of the physical GPU\n");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+		g_string_append (str, "switcheroo_gpu_capacity{");
+		append_metric_label (str, "id", card->id);
+		g_string_append_printf (str, "} %s\n", g_ascii_dtostr (buf, sizeof (buf), card->capacity));
+	}
+
+	if (data->vga_switcheroo) {
+		g_string_append (str, "# TYPE switcheroo_gpu_vga_switcheroo_active gauge\n"
+				      "# HELP switcheroo_gpu_vga_switcheroo_active Whether the GPU drives the outputs\n");
+		for (i = 0; i < data->cards->len; i++) {
+			CardData *card = data->cards->pdata[i];
+
+			if (!card->vga_switcheroo_client)
+				continue;
+			g_string_append (str, "switcheroo_gpu_vga_switcheroo_active{");
+			append_metric_label (str, "id", card->id);
+			append_metric_label (str, "power", card->vga_switcheroo_power);
+			g_string_append_printf (str, "} %d\n", card->vga_switcheroo_active);
+		}
+	}
+
+	g_string_append (str, "# TYPE switcheroo_accelerator_info gauge\n"
+			      "# HELP switcheroo_accelerator_info Accelerators known to switcheroo-control\n");
+	for (i = 0; i < data->accels->len; i++) {
+		CardData *accel = data->accels->pdata[i];
+
+		g_string_append (str, "switcheroo_accelerator_info{");
+		append_metric_label (str, "device", g_udev_device_get_device_file (accel->dev));
+		append_metric_label (str, "name", accel->name);
+		append_metric_label (str, "driver", get_card_driver (accel));
+		append_metric_label (str, "type", accel->accel_driver ? accel->accel_driver->type : "unknown");
+		g_string_append (str, "} 1\n");
+	}
+
+	g_string_append_printf (str,
+				"# TYPE switcheroo_gpus gauge\n"
+				"# HELP switcheroo_gpus Number of available GPUs\n"
+				"switcheroo_gpus %u\n"
+				"# TYPE switcheroo_uevents counter\n"
+				"# HELP switcheroo_uevents udev events received\n"
+				"switcheroo_uevents_total %" G_GUINT64_FORMAT "\n"
+				"# TYPE switcheroo_rescans counter\n"
+				"# HELP switcheroo_rescans GPU rescans\n"
+				"switcheroo_rescans_total %" G_GUINT64_FORMAT "\n"
+				"# TYPE switcheroo_changes counter\n"
+				"# HELP switcheroo_changes Property changes sent to clients\n"
+				"switcheroo_changes_total %" G_GUINT64_FORMAT "\n"
+				"# TYPE switcheroo_dbus_requests counter\n"
+				"# HELP switcheroo_dbus_requests D-Bus method calls and property reads\n"
+				"switcheroo_dbus_requests_total %" G_GUINT64_FORMAT "\n",
+				data->num_gpus,
+				data->num_uevents,
+				data->num_rescans,
+				data->num_changes,
+				data->num_dbus_requests);
+	append_sender_metrics (data, str);
+	append_aer_metrics (data, str);
+	append_energy_metrics (data, str);
+	append_watchdog_metrics (data, str);
+	g_string_append (str, "# EOF\n");
+
+	return g_string_free (str, FALSE);
+}
+
+/* Only touches the disk if something changed */
+static void
+write_metrics (ControlData *data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree char *contents = NULL;
+
+	if (data->metrics_file == NULL)
+		return;
+
+	contents = build_metrics (data);
+	if (g_strcmp0 (contents, data->metrics_contents) == 0)
+		return;
+
+	if (!g_file_set_contents (data->metrics_file, contents, -1, &error)) {
+		g_warning ("Could not write metrics to '%s': %s", data->metrics_file, error->message);
+		return;
+	}
+	g_free (data->metrics_contents);
+	data->metrics_contents = g_steal_pointer (&contents);
+}
+
+static gboolean
+metrics_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	watchdog_begin (data->watchdog, "metrics export");
+	write_metrics (data);
+	watchdog_end (data->watchdog);
+	return G_SOURCE_CONTINUE;
+}
+
+/* The GPUs are only included if clients asked for them */
+static GVariant *
+build_properties (ControlData *data)
+{
+	GVariantBuilder props_builder;
+
+	g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
+
+	g_variant_builder_add (&props_builder, "{sv}", "HasDualGpu",
+			       g_variant_new_boolean (data->num_gpus >= 2));
+	g_variant_builder_add (&props_builder, "{sv}", "NumGPUs",
+			       g_variant_new_uint32 (data->num_gpus));
+	if (data->details_wanted) {
+		ensure_card_details (data, data->cards);
+		g_variant_builder_add (&props_builder, "{sv}", "GPUs",
+				       build_gpus_variant (data->cards));
+	}
+	g_variant_builder_add (&props_builder, "{sv}", "MuxMode",
+			       g_variant_new_string (mux_mode_to_str (data->mux_mode)));
+	g_variant_builder_add (&props_builder, "{sv}", "Accelerators",
+			       build_accels_variant (data->accels));
+
+	return g_variant_builder_end (&props_builder);
+}
+
+static void
+send_dbus_event (ControlData *data)
+{
+	GVariantBuilder changed_builder;
+	g_autoptr(GVariant) props = NULL;
+	GVariant *props_changed = NULL;
+	GVariantIter iter;
+	const char *name;
+	GVariant *value;
+	guint num_changed = 0;
+	const char *invalidated[] = { NULL, NULL };
+
+	if (data->connection == NULL) {
+		g_debug ("Not sending D-Bus event, D-Bus not ready");
+		return;
+	}
+
+	props = g_variant_ref_sink (build_properties (data));
+	/* The GPUs aren't included until someone reads them, so we can't
+	 * tell whether they changed. Clients can read them again if they
+	 * need them, and have us work out their details then */
+	if (!data->details_wanted)
+		invalidated[0] = "GPUs";
+
+	/* Only signal what clients don't already know, whether they
+	 * learnt it from us, or from the instance we replaced */
+	g_variant_builder_init (&changed_builder, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_iter_init (&iter, props);
+	while (g_variant_iter_next (&iter, "{&sv}", &name, &value)) {
+		g_autoptr(GVariant) old = NULL;
+
+		if (data->published != NULL)
+			old = g_variant_lookup_value (data->published, name, NULL);
+		if (old == NULL || !g_variant_equal (old, value)) {
+			g_variant_builder_add (&changed_builder, "{sv}", name, value);
+			num_changed++;
+		}
+		g_variant_unref (value);
+	}
+	g_clear_pointer (&data->published, g_variant_unref);
+	data->published = g_steal_pointer (&props);
+
+	if (num_changed == 0 && invalidated[0] == NULL) {
+		g_variant_builder_clear (&changed_builder);
+		g_debug ("Not sending D-Bus event, no properties changed");
+		return;
+	}
+
+	props_changed = g_variant_new ("(s@a{sv}@as)", CONTROL_PROXY_IFACE_NAME,
+				       g_variant_builder_end (&changed_builder),
+				       g_variant_new_strv (invalidated, -1));
+
+	g_dbus_connection_emit_signal (data->connection,
+				       NULL,
+				       CONTROL_PROXY_DBUS_PATH,
+				       "org.freedesktop.DBus.Properties",
+				       "PropertiesChanged",
+				       props_changed, NULL);
+
+	data->num_changes++;
+	write_metrics (data);
+}
+
+typedef struct {
+	ControlData *data;
+	char *sender;
+} ProcessLookup;
+
+static void
+sender_pid_cb (GObject      *source_object,
+	       GAsyncResult *res,
+	       gpointer      user_data)
+{
+	ProcessLookup *lookup = user_data;
+	g_autoptr(GVariant) ret = NULL;
+	g_autofree char *comm_path = NULL;
+	g_autofree char *comm = NULL;
+	SenderStats *stats;
+	guint32 pid;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source_object), res, NULL);
+	/* The sender might have been evicted in the meantime */
+	stats = g_hash_table_lookup (lookup->data->senders, lookup->sender);
+	g_free (lookup->sender);
+	g_free (lookup);
+	if (ret == NULL || stats == NULL)
+		return;
+
+	g_variant_get (ret, "(u)", &pid);
+	comm_path = g_strdup_printf ("/proc/%u/comm", pid);
+	if (g_file_get_contents (comm_path, &comm, NULL, NULL))
+		stats->process = g_strdup (g_strstrip (comm));
+}
+
+static void
+lookup_sender_process (ControlData *data,
+		       SenderStats *stats)
+{
+	ProcessLookup *lookup;
+
+	if (stats->process_looked_up)
+		return;
+	stats->process_looked_up = TRUE;
+
+	lookup = g_new0 (ProcessLookup, 1);
+	lookup->data = data;
+	lookup->sender = g_strdup (stats->sender);
+	g_dbus_connection_call (data->connection,
+				"org.freedesktop.DBus",
+				"/org/freedesktop/DBus",
+				"org.freedesktop.DBus",
+				"GetConnectionUnixProcessID",
+				g_variant_new ("(s)", stats->sender),
+				G_VARIANT_TYPE ("(u)"),
+				G_DBUS_CALL_FLAGS_NONE,
+				-1, NULL, sender_pid_cb, lookup);
+}
+
+static void
+evict_quietest_sender (ControlData *data)
+{
+	GHashTableIter iter;
+	SenderStats *stats, *quietest = NULL;
+
+	g_hash_table_iter_init (&iter, data->senders);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &stats)) {
+		if (quietest == NULL || stats->num_requests < quietest->num_requests)
+			quietest = stats;
+	}
+	g_hash_table_remove (data->senders, quietest->sender);
+}
+
+static SenderStats *
+get_sender_stats (ControlData *data,
+		  const char  *sender)
+{
+	SenderStats *stats;
+
+	if (data->senders == NULL)
+		data->senders = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       NULL, (GDestroyNotify) free_sender_stats);
+
+	stats = g_hash_table_lookup (data->senders, sender);
+	if (stats != NULL)
+		return stats;
+
+	/* Unique names are never reused, so keep the table bounded */
+	if (g_hash_table_size (data->senders) >= MAX_SENDERS)
+		evict_quietest_sender (data);
+
+	stats = g_new0 (SenderStats, 1);
+	stats->sender = g_strdup (sender);
+	stats->tokens = data->rate_burst;
+	stats->last_refill = g_get_monotonic_time ();
+	g_hash_table_insert (data->senders, stats->sender, stats);
+
+	return stats;
+}
+
+static void
+refill_tokens (ControlData *data,
+	       SenderStats *stats)
+{
+	gint64 now;
+
+	now = g_get_monotonic_time ();
+	stats->tokens += (gdouble) (now - stats->last_refill) * data->rate_limit / G_USEC_PER_SEC;
+	stats->tokens = MIN (stats->tokens, data->rate_burst);
+	stats->last_refill = now;
+}
+
+/* Property reads can't be delayed, so over-budget reads are rejected */
+static gboolean
+take_property_token (ControlData *data,
+		     SenderStats *stats)
+{
+	if (data->rate_limit == 0)
+		return TRUE;
+
+	refill_tokens (data, stats);
+	if (stats->tokens < 1.0)
+		return FALSE;
+	stats->tokens -= 1.0;
+	return TRUE;
+}
+
+/* Over-budget method calls are delayed until the bucket has refilled
+ * enough, and rejected once a whole burst's worth is already waiting */
+static gboolean
+take_method_token (ControlData *data,
+		   SenderStats *stats,
+		   guint       *delay_ms)
+{
+	*delay_ms = 0;
+	if (data->rate_limit == 0)
+		return TRUE;
+
+	refill_tokens (data, stats);
+	if (stats->tokens - 1.0 < - (gdouble) data->rate_burst)
+		return FALSE;
+	stats->tokens -= 1.0;
+	if (stats->tokens < 0.0)
+		*delay_ms = (guint) (-stats->tokens * 1000 / data->rate_limit) + 1;
+	return TRUE;
+}
+
+static GVariant *
+handle_get_property (GDBusConnection *connection,
+		     const gchar     *sender,
+		     const gchar     *object_path,
+		     const gchar     *interface_name,
+		     const gchar     *property_name,
+		     GError         **error,
+		     gpointer         user_data)
+{
+	ControlData *data = user_data;
+	SenderStats *stats;
+	GVariant *value = NULL;
+
+	g_assert (data->connection);
+
+	data->num_dbus_requests++;
+	stats = get_sender_stats (data, sender);
+	stats->num_requests++;
+
+	/* Only the lists of devices are expensive to build, so reading
+	 * all the properties at once costs as much as reading those */
+	if ((g_strcmp0 (property_name, "GPUs") == 0 ||
+	     g_strcmp0 (property_name, "Accelerators") == 0) &&
+	    !take_property_token (data, stats)) {
+		stats->num_throttled++;
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			     "Too many requests from %s", sender);
+		return NULL;
+	}
+
+	watchdog_begin (data->watchdog, "D-Bus property read");
+	if (g_strcmp0 (property_name, "HasDualGpu") == 0)
+		value = g_variant_new_boolean (data->num_gpus >= 2);
+	else if (g_strcmp0 (property_name, "NumGPUs") == 0)
+		value = g_variant_new_uint32 (data->num_gpus);
+	else if (g_strcmp0 (property_name, "GPUs") == 0) {
+		want_card_details (data);
+		value = build_gpus_variant (data->cards);
+	}
+	else if (g_strcmp0 (property_name, "MuxMode") == 0)
+		value = g_variant_new_string (mux_mode_to_str (data->mux_mode));
+	else if (g_strcmp0 (property_name, "Accelerators") == 0)
+		value = build_accels_variant (data->accels);
+
+	if (value != NULL)
+		stats->num_bytes += g_variant_get_size (value);
+	watchdog_end (data->watchdog);
+	return value;
+}
+
+static void update_vga_switcheroo_state (ControlData *data, GPtrArray *cards);
+
+static gboolean
+write_vga_switcheroo (ControlData  *data,
+		      const char   *command,
+		      GError      **error)
+{
+	int fd;
+	ssize_t len;
+
+	/* debugfs files can't be replaced, so write in-place */
+	fd = open (VGA_SWITCHEROO_PATH, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int errsv = errno;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "Could not open %s: %s", VGA_SWITCHEROO_PATH, g_strerror (errsv));
+		return FALSE;
+	}
+
+	len = write (fd, command, strlen (command));
+	if (len < 0) {
+		int errsv = errno;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+			     "Could not write '%s' to %s: %s", command,
+			     VGA_SWITCHEROO_PATH, g_strerror (errsv));
+		close (fd);
+		return FALSE;
+	}
+	close (fd);
+
+	g_debug ("Wrote '%s' to vga_switcheroo", command);
+	update_vga_switcheroo_state (data, data->cards);
+	send_dbus_event (data);
+
+	return TRUE;
+}
+
+static gboolean
+handle_vga_switcheroo_power_off (ControlData  *data,
+				 GError      **error)
+{
+	guint i;
+
+	/* The active client might have changed since we last looked */
+	update_vga_switcheroo_state (data, data->cards);
+
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+
+		if (card->vga_switcheroo_client &&
+		    !card->is_default &&
+		    card->vga_switcheroo_active) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_BUSY,
+				     "Discrete GPU '%s' is in use and cannot be powered off",
+				     card->name ? card->name : card->id);
+			return FALSE;
+		}
+	}
+
+	return write_vga_switcheroo (data, "OFF", error);
+}
+
+static gboolean
+handle_vga_switcheroo_schedule_switch (ControlData  *data,
+				       const char   *target,
+				       GError      **error)
+{
+	if (g_strcmp0 (target, "integrated") == 0)
+		return write_vga_switcheroo (data, "DIGD", error);
+	if (g_strcmp0 (target, "discrete") == 0)
+		return write_vga_switcheroo (data, "DDIS", error);
+
+	g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+		     "Invalid switch target '%s'", target);
+	return FALSE;
+}
+
+static CardData *
+find_card_by_id (GPtrArray  *cards,
+		 const char *id)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		if (g_strcmp0 (card->id, id) == 0)
+			return card;
+	}
+	return NULL;
+}
+
+static char *
+get_card_device_path (CardData *card)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	if (card->dev == NULL || card->unavailable != NULL)
+		return NULL;
+	parent = g_udev_device_get_parent (card->dev);
+	if (parent == NULL)
+		return NULL;
+	return g_strdup (g_udev_device_get_sysfs_path (parent));
+}
+
+static gboolean
+telemetry_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+	GHashTableIter iter;
+	TelemetryRing *ring;
+
+	watchdog_begin (data->watchdog, "telemetry sampling");
+	g_hash_table_iter_init (&iter, data->telemetry_rings);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &ring))
+		telemetry_ring_sample (ring);
+	watchdog_end (data->watchdog);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+set_telemetry_state (ControlData    *data,
+		     TelemetryState  state)
+{
+	GHashTableIter iter;
+	TelemetryRing *ring;
+
+	g_hash_table_iter_init (&iter, data->telemetry_rings);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &ring))
+		telemetry_ring_set_state (ring, state);
+}
+
+/* We can't know when readers unmap the ring, so sample for as long as
+ * any of the processes that asked for a ring is still on the bus */
+static void
+telemetry_reader_vanished_cb (GDBusConnection *connection,
+			      const char      *name,
+			      gpointer         user_data)
+{
+	ControlData *data = user_data;
+
+	g_hash_table_remove (data->telemetry_readers, name);
+	if (g_hash_table_size (data->telemetry_readers) > 0)
+		return;
+
+	g_debug ("No telemetry readers left, pausing sampling");
+	g_clear_handle_id (&data->telemetry_timeout_id, g_source_remove);
+	set_telemetry_state (data, TELEMETRY_STATE_PAUSED);
+}
+
+typedef struct {
+	guint watch_id;
+	guint num_opened;
+} TelemetryReader;
+
+static void
+telemetry_reader_free (TelemetryReader *reader)
+{
+	g_bus_unwatch_name (reader->watch_id);
+	g_free (reader);
+}
+
+/* Creates the ring the first time it's needed, without sampling it */
+static TelemetryRing *
+get_telemetry_ring (ControlData  *data,
+		    const char   *id,
+		    GError      **error)
+{
+	TelemetryRing *ring;
+	CardData *card;
+	g_autofree char *path = NULL;
+
+	card = find_card_by_id (data->cards, id);
+	if (card == NULL) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			     "No GPU with Id '%s'", id);
+		return NULL;
+	}
+	path = get_card_device_path (card);
+	if (path == NULL) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+			     "GPU '%s' has no telemetry", id);
+		return NULL;
+	}
+
+	if (data->telemetry_rings == NULL) {
+		data->telemetry_rings = g_hash_table_new_full (g_str_hash, g_str_equal,
+							       g_free, (GDestroyNotify) telemetry_ring_free);
+		data->telemetry_readers = g_hash_table_new_full (g_str_hash, g_str_equal,
+								 g_free, (GDestroyNotify) telemetry_reader_free);
+	}
+
+	ring = g_hash_table_lookup (data->telemetry_rings, id);
+	if (ring == NULL) {
+		ring = telemetry_ring_new (path, data->telemetry_interval, error);
+		if (ring == NULL)
+			return NULL;
+		g_debug ("Created telemetry ring for %s", path);
+		g_hash_table_insert (data->telemetry_rings, g_strdup (id), ring);
+	}
+
+	return ring;
+}
+
+static int
+handle_open_telemetry (ControlData  *data,
+		       const char   *sender,
+		       const char   *id,
+		       GError      **error)
+{
+	TelemetryReader *reader;
+	TelemetryRing *ring;
+	int fd;
+
+	ring = get_telemetry_ring (data, id, error);
+	if (ring == NULL)
+		return -1;
+
+	/* Every reader keeps sampling going for as long as it's connected,
+	 * and gets a new file descriptor for each call */
+	reader = g_hash_table_lookup (data->telemetry_readers, sender);
+	if (reader == NULL &&
+	    g_hash_table_size (data->telemetry_readers) >= MAX_TELEMETRY_READERS) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			     "Too many telemetry readers");
+		return -1;
+	}
+	if (reader != NULL && reader->num_opened >= MAX_TELEMETRY_OPENS_PER_READER) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			     "Telemetry opened too many times");
+		return -1;
+	}
+
+	fd = telemetry_ring_dup_fd (ring, error);
+	if (fd < 0)
+		return -1;
+
+	if (reader == NULL) {
+		reader = g_new0 (TelemetryReader, 1);
+		reader->watch_id = g_bus_watch_name_on_connection (data->connection, sender,
+								   G_BUS_NAME_WATCHER_FLAGS_NONE,
+								   NULL, telemetry_reader_vanished_cb,
+								   data, NULL);
+		g_hash_table_insert (data->telemetry_readers, g_strdup (sender), reader);
+	}
+	reader->num_opened++;
+
+	/* Make sure there's a sample to read straight away */
+	telemetry_ring_sample (ring);
+	if (data->telemetry_timeout_id == 0) {
+		g_debug ("Starting telemetry sampling every %u ms", data->telemetry_interval);
+		set_telemetry_state (data, TELEMETRY_STATE_RUNNING);
+		data->telemetry_timeout_id = g_timeout_add (data->telemetry_interval,
+							    telemetry_timeout_cb, data);
+	} else {
+		telemetry_ring_set_state (ring, TELEMETRY_STATE_RUNNING);
+	}
+
+	return fd;
+}
+
+/* Close the rings of GPUs that went away, or moved to another device */
+static void
+prune_telemetry_rings (ControlData *data)
+{
+	GHashTableIter iter;
+	const char *id;
+	TelemetryRing *ring;
+
+	if (data->telemetry_rings == NULL)
+		return;
+
+	g_hash_table_iter_init (&iter, data->telemetry_rings);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &ring)) {
+		CardData *card;
+		g_autofree char *path = NULL;
+
+		card = find_card_by_id (data->cards, id);
+		if (card != NULL)
+			path = get_card_device_path (card);
+		if (g_strcmp0 (path, telemetry_ring_get_path (ring)) != 0) {
+			g_debug ("Closing telemetry ring for %s", telemetry_ring_get_path (ring));
+			g_hash_table_iter_remove (&iter);
+		}
+	}
+}
+
+static gboolean
+get_latest_sample (ControlData      *data,
+		   const char       *id,
+		   TelemetrySample  *sample)
+{
+	g_autoptr(GError) error = NULL;
+	TelemetryRing *ring;
+
+	ring = get_telemetry_ring (data, id, &error);
+	if (ring == NULL) {
+		g_debug ("Could not sample usage of GPU '%s': %s", id, error->message);
+		return FALSE;
+	}
+	/* Reuse the telemetry readers' latest sample if there are any */
+	if (data->telemetry_timeout_id == 0)
+		telemetry_ring_sample (ring);
+	return telemetry_ring_get_latest (ring, sample);
+}
+
+static gboolean
+history_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+	GHashTableIter iter;
+	const char *id;
+	History *history;
+	gint64 now;
+
+	watchdog_begin (data->watchdog, "usage history");
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	g_hash_table_iter_init (&iter, data->histories);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &history)) {
+		TelemetrySample sample;
+
+		if (get_latest_sample (data, id, &sample))
+			history_add_sample (history, now, &sample);
+	}
+	watchdog_end (data->watchdog);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* Histories are kept on disk for GPUs that went away, in case they
+ * come back */
+static void
+update_histories (ControlData *data)
+{
+	GHashTableIter iter;
+	const char *id;
+	guint i;
+
+	if (data->history_dir == NULL)
+		return;
+	if (data->histories == NULL)
+		data->histories = g_hash_table_new_full (g_str_hash, g_str_equal,
+							 g_free, (GDestroyNotify) history_free);
+
+	g_hash_table_iter_init (&iter, data->histories);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &id, NULL)) {
+		if (find_card_by_id (data->cards, id) == NULL)
+			g_hash_table_iter_remove (&iter);
+	}
+
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		g_autoptr(GError) error = NULL;
+		g_autofree char *device_path = NULL;
+		g_autofree char *filename = NULL;
+		g_autofree char *path = NULL;
+		History *history;
+
+		if (card->id == NULL ||
+		    g_hash_table_contains (data->histories, card->id))
+			continue;
+		device_path = get_card_device_path (card);
+		if (device_path == NULL)
+			continue;
+
+		filename = g_strdup_printf ("%s.history", card->id);
+		path = g_build_filename (data->history_dir, filename, NULL);
+		history = history_open (path, &error);
+		if (history == NULL) {
+			g_warning ("Could not open usage history: %s", error->message);
+			continue;
+		}
+		g_debug ("Keeping usage history of GPU '%s' in %s", card->id, path);
+		g_hash_table_insert (data->histories, g_strdup (card->id), history);
+	}
+
+	if (g_hash_table_size (data->histories) == 0)
+		g_clear_handle_id (&data->history_timeout_id, g_source_remove);
+	else if (data->history_timeout_id == 0)
+		data->history_timeout_id = g_timeout_add_seconds (1, history_timeout_cb, data);
+}
+
+static gboolean
+energy_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	watchdog_begin (data->watchdog, "energy attribution");
+	energy_tracker_update (data->energy_tracker);
+	watchdog_end (data->watchdog);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+update_energy_tracker (ControlData *data)
+{
+	g_autoptr(GHashTable) device_paths = NULL;
+	guint i;
+
+	if (data->energy_interval == 0)
+		return;
+	if (data->energy_tracker == NULL)
+		data->energy_tracker = energy_tracker_new (g_getenv ("SWITCHEROO_CONTROL_PROC"));
+
+	device_paths = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		char *path;
+
+		if (card->id == NULL)
+			continue;
+		path = get_card_device_path (card);
+		if (path != NULL)
+			g_hash_table_insert (device_paths, card->id, path);
+	}
+	energy_tracker_set_gpus (data->energy_tracker, device_paths);
+
+	if (energy_tracker_get_num_gpus (data->energy_tracker) == 0)
+		g_clear_handle_id (&data->energy_timeout_id, g_source_remove);
+	else if (data->energy_timeout_id == 0)
+		data->energy_timeout_id = g_timeout_add_seconds (data->energy_interval, energy_timeout_cb, data);
+}
+
+static GVariant *
+handle_get_energy_usage (ControlData  *data,
+			 GError      **error)
+{
+	g_autoptr(GPtrArray) usage = NULL;
+	GVariantBuilder builder;
+	guint i;
+
+	if (data->energy_tracker == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "Energy attribution is disabled");
+		return NULL;
+	}
+
+	usage = energy_tracker_get_usage (data->energy_tracker);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sstt)"));
+	for (i = 0; i < usage->len; i++) {
+		EnergyUsage *u = usage->pdata[i];
+
+		g_variant_builder_add (&builder, "(sstt)",
+				       u->app_id, u->gpu_id, u->energy_uj, u->busy_ns);
+	}
+	return g_variant_new ("(a(sstt))", &builder);
+}
+
+static GVariant *
+handle_get_cgroup_usage (ControlData  *data,
+			 GError      **error)
+{
+	g_autoptr(GPtrArray) usage = NULL;
+	GVariantBuilder builder;
+	guint i;
+
+	if (data->energy_tracker == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "Client usage accounting is disabled");
+		return NULL;
+	}
+
+	usage = energy_tracker_get_cgroup_usage (data->energy_tracker);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssttt)"));
+	for (i = 0; i < usage->len; i++) {
+		CgroupUsage *u = usage->pdata[i];
+
+		g_variant_builder_add (&builder, "(ssttt)",
+				       u->cgroup, u->gpu_id, u->busy_ns, u->memory, u->energy_uj);
+	}
+	return g_variant_new ("(a(ssttt))", &builder);
+}
+
+static void
+update_cards_preferred (ControlData *data,
+			GPtrArray   *cards)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		card->preferred = data->preferred_gpu != NULL &&
+			g_strcmp0 (card->id, data->preferred_gpu) == 0;
+	}
+}
+
+static gboolean
+preferred_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	g_debug ("No longer favouring GPU '%s'", data->preferred_gpu);
+	data->preferred_timeout_id = 0;
+	g_clear_pointer (&data->preferred_gpu, g_free);
+	update_cards_preferred (data, data->cards);
+	send_dbus_event (data);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+prefer_gpu (ControlData *data,
+	    const char  *busy,
+	    const char  *idle)
+{
+	g_clear_handle_id (&data->preferred_timeout_id, g_source_remove);
+	data->preferred_timeout_id = g_timeout_add_seconds (data->rebalance_period,
+							    preferred_timeout_cb, data);
+	/* Still imbalanced, keep favouring it for longer */
+	if (g_strcmp0 (data->preferred_gpu, idle) == 0)
+		return;
+
+	g_message ("GPU '%s' is saturated while GPU '%s' is idle, favouring the latter for %u seconds",
+		   busy, idle, data->rebalance_period);
+	g_free (data->preferred_gpu);
+	data->preferred_gpu = g_strdup (idle);
+	update_cards_preferred (data, data->cards);
+	send_dbus_event (data);
+
+	if (data->connection == NULL)
+		return;
+	g_dbus_connection_emit_signal (data->connection,
+				       NULL,
+				       CONTROL_PROXY_DBUS_PATH,
+				       CONTROL_PROXY_IFACE_NAME,
+				       "Imbalanced",
+				       g_variant_new ("(ss)", busy, idle),
+				       NULL);
+}
+
+/* Runtime suspended GPUs are idle, GPUs without a busy percentage
+ * are left out */
+static gboolean
+imbalance_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+	CardData *busy = NULL, *idle = NULL;
+	guint busy_percent = 0, idle_percent = G_MAXUINT;
+	guint i;
+
+	watchdog_begin (data->watchdog, "imbalance detection");
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		TelemetrySample sample;
+		guint percent;
+
+		if (!card->is_discrete || card->id == NULL || card->unavailable != NULL ||
+		    card->function != CARD_FUNCTION_PHYSICAL)
+			continue;
+		if (!get_latest_sample (data, card->id, &sample))
+			continue;
+		if (sample.flags & TELEMETRY_SUSPENDED)
+			percent = 0;
+		else if (sample.flags & TELEMETRY_HAS_BUSY)
+			percent = sample.busy_percent;
+		else
+			continue;
+
+		if (busy == NULL || percent > busy_percent) {
+			busy = card;
+			busy_percent = percent;
+		}
+		if (idle == NULL || percent < idle_percent) {
+			idle = card;
+			idle_percent = percent;
+		}
+	}
+
+	/* An idle GPU with more clients is likely to get busy soon */
+	if (busy == NULL || busy == idle ||
+	    busy_percent < IMBALANCE_BUSY_HIGH || idle_percent > IMBALANCE_BUSY_LOW ||
+	    (data->energy_tracker != NULL &&
+	     energy_tracker_get_num_clients (data->energy_tracker, idle->id) >
+	     energy_tracker_get_num_clients (data->energy_tracker, busy->id))) {
+		data->imbalance_checks = 0;
+		goto out;
+	}
+
+	if (g_strcmp0 (data->imbalance_busy, busy->id) != 0 ||
+	    g_strcmp0 (data->imbalance_idle, idle->id) != 0) {
+		g_free (data->imbalance_busy);
+		data->imbalance_busy = g_strdup (busy->id);
+		g_free (data->imbalance_idle);
+		data->imbalance_idle = g_strdup (idle->id);
+		data->imbalance_checks = 0;
+	}
+	if (++data->imbalance_checks * data->imbalance_interval < data->imbalance_duration)
+		goto out;
+
+	data->imbalance_checks = 0;
+	prefer_gpu (data, busy->id, idle->id);
+
+out:
+	watchdog_end (data->watchdog);
+	return G_SOURCE_CONTINUE;
+}
+
+/* Only checks for imbalances when there's more than one discrete GPU */
+static void
+update_imbalance_detection (ControlData *data)
+{
+	guint i, num_discrete = 0;
+
+	if (data->rebalance_period == 0)
+		return;
+
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+
+		if (card->is_discrete && card->id != NULL && card->unavailable == NULL &&
+		    card->function == CARD_FUNCTION_PHYSICAL)
+			num_discrete++;
+	}
+
+	if (data->preferred_gpu != NULL &&
+	    find_card_by_id (data->cards, data->preferred_gpu) == NULL) {
+		g_clear_handle_id (&data->preferred_timeout_id, g_source_remove);
+		g_clear_pointer (&data->preferred_gpu, g_free);
+	}
+	update_cards_preferred (data, data->cards);
+
+	if (num_discrete < 2) {
+		g_clear_handle_id (&data->imbalance_timeout_id, g_source_remove);
+		data->imbalance_checks = 0;
+	} else if (data->imbalance_timeout_id == 0) {
+		data->imbalance_interval = CLAMP (data->imbalance_duration / IMBALANCE_MIN_CHECKS,
+						  1, IMBALANCE_MAX_CHECK_SECS);
+		data->imbalance_timeout_id = g_timeout_add_seconds (data->imbalance_interval,
+								    imbalance_timeout_cb, data);
+	}
+}
+
+static GVariant *
+handle_get_history (ControlData  *data,
+		    const char   *id,
+		    gint64        from,
+		    gint64        to,
+		    GError      **error)
+{
+	History *history = NULL;
+	GVariant *samples;
+	guint resolution;
+
+	if (data->history_dir == NULL) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "Usage history is disabled");
+		return NULL;
+	}
+	if (data->histories != NULL)
+		history = g_hash_table_lookup (data->histories, id);
+	if (history == NULL) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			     "No usage history for GPU '%s'", id);
+		return NULL;
+	}
+
+	samples = history_query (history, from, to,
+				 g_get_real_time () / G_USEC_PER_SEC,
+				 &resolution);
+	return g_variant_new ("(u@a(xudutttt))", resolution, samples);
+}
+
+static void
+save_perf_state (ControlData *data)
+{
+	g_autoptr(GError) error = NULL;
+
+	/* Not ours anymore after a handover */
+	if (data->perf_state_path == NULL)
+		return;
+	if (!g_key_file_save_to_file (data->perf_state, data->perf_state_path, &error))
+		g_warning ("Could not save performance settings: %s", error->message);
+}
+
+static void
+perf_state_changed_cb (gpointer user_data)
+{
+	save_perf_state (user_data);
+}
+
+static guint
+count_sender_perf_leases (ControlData *data,
+			  const char  *sender)
+{
+	guint i, num_leases = 0;
+
+	for (i = 0; i < data->perf_leases->len; i++) {
+		PerfLease *lease = data->perf_leases->pdata[i];
+
+		if (g_strcmp0 (lease->sender, sender) == 0)
+			num_leases++;
+	}
+	return num_leases;
+}
+
+static void
+release_perf_lease (PerfLease *lease)
+{
+	ControlData *data = lease->data;
+	PerfControl *control;
+
+	control = g_hash_table_lookup (data->perf_controls, lease->id);
+	if (control != NULL &&
+	    perf_control_remove_request (control, lease->request_id) == 0)
+		g_hash_table_remove (data->perf_controls, lease->id);
+	g_ptr_array_remove_fast (data->perf_leases, lease);
+	save_perf_state (data);
+}
+
+static void
+release_all_perf_leases (ControlData *data)
+{
+	if (data->perf_controls == NULL ||
+	    g_hash_table_size (data->perf_controls) == 0)
+		return;
+
+	g_debug ("Releasing all performance requests");
+	g_ptr_array_set_size (data->perf_leases, 0);
+	g_hash_table_remove_all (data->perf_controls);
+	save_perf_state (data);
+}
+
+static gboolean
+perf_lease_closed_cb (int          fd,
+		      GIOCondition condition,
+		      gpointer     user_data)
+{
+	PerfLease *lease = user_data;
+
+	g_debug ("Performance request %u on %s released", lease->request_id, lease->id);
+	lease->fd_watch_id = 0;
+	release_perf_lease (lease);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+perf_lease_expired_cb (gpointer user_data)
+{
+	PerfLease *lease = user_data;
+
+	g_debug ("Performance request %u on %s expired", lease->request_id, lease->id);
+	lease->timeout_id = 0;
+	release_perf_lease (lease);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+parse_perf_request (GVariant     *options,
+		    PerfRequest  *request,
+		    guint        *duration,
+		    GError      **error)
+{
+	GVariantIter iter;
+	const char *key;
+	GVariant *value;
+
+	g_variant_iter_init (&iter, options);
+	while (g_variant_iter_next (&iter, "{&sv}", &key, &value)) {
+		g_autoptr(GVariant) v = value;
+
+		if (g_strcmp0 (key, "Level") == 0 &&
+		    g_variant_is_of_type (v, G_VARIANT_TYPE_STRING)) {
+			request->level = perf_level_from_string (g_variant_get_string (v, NULL));
+			if (request->level == PERF_LEVEL_NONE) {
+				g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+					     "Unknown performance level '%s'", g_variant_get_string (v, NULL));
+				return FALSE;
+			}
+		} else if (g_strcmp0 (key, "MinFrequency") == 0 &&
+			   g_variant_is_of_type (v, G_VARIANT_TYPE_UINT32)) {
+			request->min_freq_mhz = g_variant_get_uint32 (v);
+		} else if (g_strcmp0 (key, "PowerCap") == 0 &&
+			   g_variant_is_of_type (v, G_VARIANT_TYPE_UINT32)) {
+			request->power_cap_uw = g_variant_get_uint32 (v);
+		} else if (g_strcmp0 (key, "Duration") == 0 &&
+			   g_variant_is_of_type (v, G_VARIANT_TYPE_UINT32)) {
+			*duration = MIN (*duration, g_variant_get_uint32 (v));
+		} else {
+			g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "Invalid option '%s' of type '%s'", key, g_variant_get_type_string (v));
+			return FALSE;
+		}
+	}
+
+	if (*duration == 0) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				     "Duration should be positive");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int
+handle_request_performance (ControlData  *data,
+			    const char   *sender,
+			    const char   *id,
+			    GVariant     *options,
+			    GError      **error)
+{
+	PerfRequest request = { 0, };
+	g_autoptr(PerfControl) new_control = NULL;
+	PerfControl *control;
+	PerfLease *lease;
+	CardData *card;
+	g_autofree char *path = NULL;
+	guint duration = data->max_boost_duration;
+	int fds[2];
+
+	if (data->max_boost_duration == 0) {
+		g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+				     "Performance requests are disabled");
+		return -1;
+	}
+
+	card = find_card_by_id (data->cards, id);
+	if (card == NULL) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			     "No GPU with Id '%s'", id);
+		return -1;
+	}
+	path = get_card_device_path (card);
+	if (path == NULL) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+			     "GPU '%s' has no performance controls", id);
+		return -1;
+	}
+	if (data->perf_leases != NULL && data->perf_leases->len >= MAX_PERF_LEASES) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			     "Too many performance requests");
+		return -1;
+	}
+	/* So that a single client can't keep renewing overlapping requests */
+	if (data->perf_leases != NULL &&
+	    count_sender_perf_leases (data, sender) >= MAX_PERF_LEASES_PER_SENDER) {
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_LIMITS_EXCEEDED,
+			     "Too many performance requests from %s", sender);
+		return -1;
+	}
+	if (!parse_perf_request (options, &request, &duration, error))
+		return -1;
+
+	if (data->perf_controls == NULL) {
+		data->perf_controls = g_hash_table_new_full (g_str_hash, g_str_equal,
+							     g_free, (GDestroyNotify) perf_control_free);
+		data->perf_leases = g_ptr_array_new_with_free_func ((GDestroyNotify) free_perf_lease);
+	}
+
+	control = g_hash_table_lookup (data->perf_controls, id);
+	if (control == NULL)
+		control = new_control = perf_control_new (g_udev_device_get_sysfs_path (card->dev),
+							  path, data->perf_state,
+							  perf_state_changed_cb, data);
+	if (!perf_control_check_request (control, &request, error))
+		return -1;
+
+	if (pipe2 (fds, O_CLOEXEC) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not create lease: %s", g_strerror (errno));
+		return -1;
+	}
+	if (new_control != NULL)
+		g_hash_table_insert (data->perf_controls, g_strdup (id), g_steal_pointer (&new_control));
+
+	lease = g_new0 (PerfLease, 1);
+	lease->data = data;
+	lease->id = g_strdup (id);
+	lease->sender = g_strdup (sender);
+	lease->request_id = perf_control_add_request (control, &request);
+	lease->fd = fds[0];
+	/* The write end is never written to, this only wakes up when it's
+	 * closed, by the client, or by the kernel if the client exits */
+	lease->fd_watch_id = g_unix_fd_add (lease->fd, G_IO_HUP | G_IO_ERR,
+					    perf_lease_closed_cb, lease);
+	lease->timeout_id = g_timeout_add_seconds (duration, perf_lease_expired_cb, lease);
+	g_ptr_array_add (data->perf_leases, lease);
+
+	g_debug ("Performance request %u from %s on %s for %u seconds",
+		 lease->request_id, sender, id, duration);
+
+	return fds[1];
+}
+
+static void
+prune_perf_controls (ControlData *data)
+{
+	GHashTableIter iter;
+	const char *id;
+	PerfControl *control;
+	guint i;
+
+	if (data->perf_controls == NULL)
+		return;
+
+	g_hash_table_iter_init (&iter, data->perf_controls);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &id, (gpointer *) &control)) {
+		CardData *card;
+		g_autofree char *path = NULL;
+
+		card = find_card_by_id (data->cards, id);
+		if (card != NULL)
+			path = get_card_device_path (card);
+		if (g_strcmp0 (path, perf_control_get_path (control)) == 0)
+			continue;
+
+		g_debug ("Dropping performance requests for %s", perf_control_get_path (control));
+		for (i = data->perf_leases->len; i > 0; i--) {
+			PerfLease *lease = data->perf_leases->pdata[i - 1];
+
+			if (g_str_equal (lease->id, id))
+				g_ptr_array_remove_index_fast (data->perf_leases, i - 1);
+		}
+		g_hash_table_iter_remove (&iter);
+	}
+	save_perf_state (data);
+}
+
+static void
+update_cards_link_health (ControlData *data,
+			  GPtrArray   *cards)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		AerMonitor *monitor;
+
+		monitor = find_aer_monitor (data, card);
+		card->link_health = monitor ? aer_health_to_string (aer_monitor_get_health (monitor)) : NULL;
+	}
+}
+
+static gboolean
+aer_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+	GHashTableIter iter;
+	AerMonitor *monitor;
+	gboolean changed = FALSE;
+
+	watchdog_begin (data->watchdog, "AER counters");
+	g_hash_table_iter_init (&iter, data->aer_monitors);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &monitor)) {
+		if (aer_monitor_update (monitor, data->aer_threshold))
+			changed = TRUE;
+	}
+	if (changed) {
+		update_cards_link_health (data, data->cards);
+		send_dbus_event (data);
+	}
+	watchdog_end (data->watchdog);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* Follows the GPUs that were added, forgets about the ones that went
+ * away, and only keeps the timer around if there's something to read */
+static void
+update_aer_monitors (ControlData *data)
+{
+	g_autoptr(GHashTable) paths = NULL;
+	GHashTableIter iter;
+	const char *path;
+	guint i;
+
+	if (data->aer_interval == 0)
+		return;
+	if (data->aer_monitors == NULL)
+		data->aer_monitors = g_hash_table_new_full (g_str_hash, g_str_equal,
+							    g_free, (GDestroyNotify) aer_monitor_free);
+
+	paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	for (i = 0; i < data->cards->len; i++) {
+		char *card_path;
+
+		card_path = get_card_device_path (data->cards->pdata[i]);
+		if (card_path != NULL)
+			g_hash_table_add (paths, card_path);
+	}
+
+	g_hash_table_iter_init (&iter, data->aer_monitors);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL)) {
+		if (!g_hash_table_contains (paths, path))
+			g_hash_table_iter_remove (&iter);
+	}
+
+	g_hash_table_iter_init (&iter, paths);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &path, NULL)) {
+		AerMonitor *monitor;
+
+		if (g_hash_table_contains (data->aer_monitors, path))
+			continue;
+		monitor = aer_monitor_new (path);
+		if (monitor == NULL)
+			continue;
+		g_debug ("Monitoring PCIe errors of %s", path);
+		/* Reads the initial counters */
+		aer_monitor_update (monitor, data->aer_threshold);
+		g_hash_table_insert (data->aer_monitors, g_strdup (path), monitor);
+	}
+
+	update_cards_link_health (data, data->cards);
+
+	if (g_hash_table_size (data->aer_monitors) == 0)
+		g_clear_handle_id (&data->aer_timeout_id, g_source_remove);
+	else if (data->aer_timeout_id == 0)
+		data->aer_timeout_id = g_timeout_add_seconds (data->aer_interval, aer_timeout_cb, data);
+}
+
+static GVariant *
+build_set_variant (GHashTable *set)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer key;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+	if (set != NULL) {
+		g_hash_table_iter_init (&iter, set);
+		while (g_hash_table_iter_next (&iter, &key, NULL))
+			g_variant_builder_add (&builder, "s", key);
+	}
+	return g_variant_builder_end (&builder);
+}
+
+static void
+restore_set (GHashTable *set,
+	     GVariant   *state,
+	     const char *key)
+{
+	g_autoptr(GVariantIter) iter = NULL;
+	const char *str;
+
+	if (set == NULL || !g_variant_lookup (state, key, "as", &iter))
+		return;
+	while (g_variant_iter_next (iter, "&s", &str))
+		g_hash_table_add (set, g_strdup (str));
+}
+
+/* What a replacement instance needs to carry on where we left off,
+ * see restore_handover_state() */
+static GVariant *
+build_handover_state (ControlData *data)
+{
+	GVariantBuilder builder, known_builder;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_variant_builder_init (&known_builder, G_VARIANT_TYPE ("a(ssssb)"));
+	g_hash_table_iter_init (&iter, data->known_cards);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		KnownCard *known = value;
+
+		g_variant_builder_add (&known_builder, "(ssssb)", key, known->id,
+				       known->name ? known->name : "",
+				       known->parent_path, known->is_discrete);
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_add (&builder, "{sv}", "Version",
+			       g_variant_new_uint32 (HANDOVER_VERSION));
+	/* What clients know, or can read at any time */
+	g_variant_builder_add (&builder, "{sv}", "Properties", build_properties (data));
+	g_variant_builder_add (&builder, "{sv}", "DetailsWanted",
+			       g_variant_new_boolean (data->details_wanted));
+	g_variant_builder_add (&builder, "{sv}", "KnownCards",
+			       g_variant_builder_end (&known_builder));
+	g_variant_builder_add (&builder, "{sv}", "DrmCapsFailed",
+			       build_set_variant (data->drm_caps_failed));
+	g_variant_builder_add (&builder, "{sv}", "GraphicsFailed",
+			       build_set_variant (data->graphics_failed));
+	g_variant_builder_add (&builder, "{sv}", "Counters",
+			       g_variant_new ("(tttt)",
+					      data->num_uevents,
+					      data->num_rescans,
+					      data->num_changes,
+					      data->num_dbus_requests));
+
+	return g_variant_builder_end (&builder);
+}
+
+/* Called once the caches and known GPU tables are set up, before
+ * the first scan */
+static void
+restore_handover_state (ControlData *data)
+{
+	g_autoptr(GVariantIter) iter = NULL;
+	const char *pci_slot, *id, *name, *parent_path;
+	gboolean is_discrete;
+
+	if (data->handover == NULL)
+		return;
+
+	data->published = g_variant_lookup_value (data->handover, "Properties",
+						  G_VARIANT_TYPE ("a{sv}"));
+
+	if (g_variant_lookup (data->handover, "KnownCards", "a(ssssb)", &iter)) {
+		while (g_variant_iter_next (iter, "(&s&s&s&sb)", &pci_slot, &id,
+					    &name, &parent_path, &is_discrete)) {
+			KnownCard *known;
+
+			known = g_new0 (KnownCard, 1);
+			known->id = g_strdup (id);
+			known->name = *name != '\0' ? g_strdup (name) : NULL;
+			known->parent_path = g_strdup (parent_path);
+			known->is_discrete = is_discrete;
+			g_hash_table_insert (data->known_cards, g_strdup (pci_slot), known);
+		}
+	}
+
+	restore_set (data->drm_caps_failed, data->handover, "DrmCapsFailed");
+	restore_set (data->graphics_failed, data->handover, "GraphicsFailed");
+
+	g_variant_lookup (data->handover, "Counters", "(tttt)",
+			  &data->num_uevents,
+			  &data->num_rescans,
+			  &data->num_changes,
+			  &data->num_dbus_requests);
+}
+
+static void
+request_handover (ControlData *data)
+{
+	g_autoptr(GDBusConnection) connection = NULL;
+	g_autoptr(GVariant) ret = NULL;
+	g_autoptr(GError) error = NULL;
+	guint32 version = 0;
+
+	connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, &error);
+	if (connection != NULL)
+		ret = g_dbus_connection_call_sync (connection,
+						   CONTROL_PROXY_DBUS_NAME,
+						   CONTROL_PROXY_DBUS_PATH,
+						   CONTROL_PROXY_IFACE_NAME,
+						   "Handover",
+						   NULL,
+						   G_VARIANT_TYPE ("(a{sv})"),
+						   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+						   HANDOVER_TIMEOUT_MS, NULL, &error);
+	if (ret == NULL) {
+		g_debug ("Running instance did not hand over its state: %s", error->message);
+		return;
+	}
+
+	g_variant_get (ret, "(@a{sv})", &data->handover);
+	if (!g_variant_lookup (data->handover, "Version", "u", &version) ||
+	    version != HANDOVER_VERSION) {
+		g_debug ("Ignoring handed over state, unsupported version %u", version);
+		g_clear_pointer (&data->handover, g_variant_unref);
+		return;
+	}
+	g_debug ("Running instance handed over its state");
+}
+
+static void
+run_method_call (ControlData           *data,
+		 GDBusMethodInvocation *invocation)
+{
+	const char *sender = g_dbus_method_invocation_get_sender (invocation);
+	const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+	GVariant *parameters = g_dbus_method_invocation_get_parameters (invocation);
+	g_autoptr(GError) error = NULL;
+	gboolean ret = FALSE;
+
+	if (g_strcmp0 (method_name, "VgaSwitcherooPowerOff") == 0 ||
+	    g_strcmp0 (method_name, "VgaSwitcherooScheduleSwitch") == 0) {
+		if (g_strcmp0 (method_name, "VgaSwitcherooPowerOff") == 0) {
+			ret = handle_vga_switcheroo_power_off (data, &error);
+		} else {
+			const char *target;
+
+			g_variant_get (parameters, "(&s)", &target);
+			ret = handle_vga_switcheroo_schedule_switch (data, target, &error);
+		}
+	} else if (g_strcmp0 (method_name, "OpenTelemetry") == 0) {
+		g_autoptr(GUnixFDList) fd_list = NULL;
+		const char *id;
+		int fd;
+
+		g_variant_get (parameters, "(&s)", &id);
+		fd = handle_open_telemetry (data, sender, id, &error);
+		if (fd < 0) {
+			g_dbus_method_invocation_return_gerror (invocation, error);
+			return;
+		}
+		fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+		g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+									 g_variant_new ("(h)", 0),
+									 fd_list);
+		return;
+	} else if (g_strcmp0 (method_name, "GetEnergyUsage") == 0 ||
+		   g_strcmp0 (method_name, "GetCgroupUsage") == 0) {
+		GVariant *value;
+
+		if (g_strcmp0 (method_name, "GetEnergyUsage") == 0)
+			value = handle_get_energy_usage (data, &error);
+		else
+			value = handle_get_cgroup_usage (data, &error);
+		if (value == NULL) {
+			g_dbus_method_invocation_return_gerror (invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value (invocation, value);
+		return;
+	} else if (g_strcmp0 (method_name, "GetHistory") == 0) {
+		const char *id;
+		gint64 from, to;
+		GVariant *value;
+
+		g_variant_get (parameters, "(&sxx)", &id, &from, &to);
+		value = handle_get_history (data, id, from, to, &error);
+		if (value == NULL) {
+			g_dbus_method_invocation_return_gerror (invocation, error);
+			return;
+		}
+		g_dbus_method_invocation_return_value (invocation, value);
+		return;
+	} else if (g_strcmp0 (method_name, "RequestPerformance") == 0) {
+		g_autoptr(GUnixFDList) fd_list = NULL;
+		g_autoptr(GVariant) options = NULL;
+		const char *id;
+		int fd;
+
+		g_variant_get (parameters, "(&s@a{sv})", &id, &options);
+		fd = handle_request_performance (data, sender, id, options, &error);
+		if (fd < 0) {
+			g_dbus_method_invocation_return_gerror (invocation, error);
+			return;
+		}
+		fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+		g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+									 g_variant_new ("(h)", 0),
+									 fd_list);
+		return;
+	} else if (g_strcmp0 (method_name, "Handover") == 0) {
+		/* We keep answering until the new instance takes our name */
+		g_debug ("Handing over state to %s", sender);
+		data->handed_over = TRUE;
+		g_dbus_method_invocation_return_value (invocation,
+						       g_variant_new ("(@a{sv})", build_handover_state (data)));
+		return;
+	} else {
+		g_set_error (&error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+			     "Unknown method '%s'", method_name);
+	}
+
+	if (!ret)
+		g_dbus_method_invocation_return_gerror (invocation, error);
+	else
+		g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static void
+check_authorization_cb (GObject      *source_object,
+			GAsyncResult *res,
+			gpointer      user_data)
+{
+	g_autoptr(GDBusMethodInvocation) invocation = user_data;
+	ControlData *data = g_dbus_method_invocation_get_user_data (invocation);
+	g_autoptr(PolkitAuthorizationResult) result = NULL;
+	g_autoptr(GError) error = NULL;
+
+	result = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source_object),
+							      res, &error);
+	if (result == NULL)
+		g_debug ("Could not check authorization: %s", error->message);
+	if (result == NULL || !polkit_authorization_result_get_is_authorized (result)) {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_ACCESS_DENIED,
+						       "Not authorized to call %s",
+						       g_dbus_method_invocation_get_method_name (invocation));
+		return;
+	}
+
+	watchdog_begin (data->watchdog, "D-Bus method call");
+	run_method_call (data, invocation);
+	watchdog_end (data->watchdog);
+}
+
+static const char *
+get_method_action (const char *method_name)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (method_actions); i++) {
+		if (g_strcmp0 (method_actions[i].method_name, method_name) == 0)
+			return method_actions[i].action_id;
+	}
+	return NULL;
+}
+
+/* Runs the method call once polkit authorised the caller, if it
+ * needs to be */
+static void
+dispatch_method_call (ControlData           *data,
+		      GDBusMethodInvocation *invocation)
+{
+	const char *method_name = g_dbus_method_invocation_get_method_name (invocation);
+	g_autoptr(PolkitSubject) subject = NULL;
+	const char *action_id;
+
+	action_id = get_method_action (method_name);
+	if (action_id == NULL) {
+		run_method_call (data, invocation);
+		return;
+	}
+
+	if (g_str_has_prefix (method_name, "VgaSwitcheroo") && !data->vga_switcheroo) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       G_DBUS_ERROR,
+							       G_DBUS_ERROR_NOT_SUPPORTED,
+							       "vga_switcheroo control is disabled");
+		return;
+	}
+	if (g_strcmp0 (method_name, "RequestPerformance") == 0 && data->max_boost_duration == 0) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       G_DBUS_ERROR,
+							       G_DBUS_ERROR_NOT_SUPPORTED,
+							       "Performance requests are disabled");
+		return;
+	}
+	if (data->authority == NULL) {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_ACCESS_DENIED,
+						       "Not authorized to call %s, polkit is not available",
+						       method_name);
+		return;
+	}
+
+	subject = polkit_system_bus_name_new (g_dbus_method_invocation_get_sender (invocation));
+	polkit_authority_check_authorization (data->authority, subject, action_id, NULL,
+					      POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
+					      NULL, check_authorization_cb,
+					      g_object_ref (invocation));
+}
+
+static gboolean
+deferred_method_call_cb (gpointer user_data)
+{
+	GDBusMethodInvocation *invocation = user_data;
+	ControlData *data = g_dbus_method_invocation_get_user_data (invocation);
+
+	g_hash_table_remove (data->deferred_calls, invocation);
+	watchdog_begin (data->watchdog, "D-Bus method call");
+	dispatch_method_call (data, invocation);
+	watchdog_end (data->watchdog);
+	return G_SOURCE_REMOVE;
+}
+
+/* So that callers waiting on a deferred call get a reply when we exit */
+static void
+reject_deferred_calls (ControlData *data)
+{
+	GHashTableIter iter;
+	gpointer invocation, timeout_id;
+
+	if (data->deferred_calls == NULL)
+		return;
+
+	g_hash_table_iter_init (&iter, data->deferred_calls);
+	while (g_hash_table_iter_next (&iter, &invocation, &timeout_id)) {
+		g_source_remove (GPOINTER_TO_UINT (timeout_id));
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_NO_SERVER,
+						       "switcheroo-control is exiting");
+	}
+	g_clear_pointer (&data->deferred_calls, g_hash_table_unref);
+}
+
+static void
+handle_method_call (GDBusConnection       *connection,
+		    const gchar           *sender,
+		    const gchar           *object_path,
+		    const gchar           *interface_name,
+		    const gchar           *method_name,
+		    GVariant              *parameters,
+		    GDBusMethodInvocation *invocation,
+		    gpointer               user_data)
+{
+	ControlData *data = user_data;
+	SenderStats *stats;
+	guint delay_ms;
+
+	data->num_dbus_requests++;
+	stats = get_sender_stats (data, sender);
+	stats->num_requests++;
+	stats->num_bytes += g_variant_get_size (parameters);
+
+	if (!take_method_token (data, stats, &delay_ms)) {
+		stats->num_throttled++;
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+						       G_DBUS_ERROR_LIMITS_EXCEEDED,
+						       "Too many requests from %s", sender);
+		return;
+	}
+	if (delay_ms > 0) {
+		stats->num_throttled++;
+		g_debug ("Deferring %s call from %s by %u ms", method_name, sender, delay_ms);
+		if (data->deferred_calls == NULL)
+			data->deferred_calls = g_hash_table_new (NULL, NULL);
+		g_hash_table_insert (data->deferred_calls, invocation,
+				     GUINT_TO_POINTER (g_timeout_add (delay_ms, deferred_method_call_cb, invocation)));
+		return;
+	}
+
+	watchdog_begin (data->watchdog, "D-Bus method call");
+	dispatch_method_call (data, invocation);
+	watchdog_end (data->watchdog);
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+	handle_method_call,
+	handle_get_property,
+	NULL
+};
+
+static void
+name_lost_handler (GDBusConnection *connection,
+		   const gchar     *name,
+		   gpointer         user_data)
+{
+	ControlData *data = user_data;
+
+	if (data->handed_over) {
+		g_debug ("Replaced by a new instance of switcheroo-control");
+		/* Telemetry readers need to get rings from the new instance */
+		if (data->telemetry_rings != NULL)
+			g_hash_table_remove_all (data->telemetry_rings);
+		/* Leases can't be handed over, and the new instance owns
+		 * the saved settings now */
+		g_clear_pointer (&data->perf_state_path, g_free);
+		release_all_perf_leases (data);
+		exit (0);
+	}
+
+	g_debug ("switcheroo-control is already running, or it cannot own its D-Bus name. Verify installation.");
+	exit (0);
+}
+
+static void
+bus_acquired_handler (GDBusConnection *connection,
+		      const gchar     *name,
+		      gpointer         user_data)
+{
+	ControlData *data = user_data;
+
+	g_dbus_connection_register_object (connection,
+					   CONTROL_PROXY_DBUS_PATH,
+					   data->introspection_data->interfaces[0],
+					   &interface_vtable,
+					   data,
+					   NULL,
+					   NULL);
+
+	data->connection = g_object_ref (connection);
+}
+
+static void
+name_acquired_handler (GDBusConnection *connection,
+		       const gchar     *name,
+		       gpointer         user_data)
+{
+	ControlData *data = user_data;
+
+	if (!data->init_done)
+		return;
+
+	send_dbus_event (data);
+	/* Only ready once the first snapshot was published */
+	if (!data->ready) {
+		notify_systemd ("READY=1");
+		data->ready = TRUE;
+	}
+}
+
+static gboolean
+setup_dbus (ControlData *data,
+	    gboolean     replace)
+{
+	g_autoptr(GError) error = NULL;
+	GBytes *bytes;
+	GBusNameOwnerFlags flags;
+
+	data->authority = polkit_authority_get_sync (NULL, &error);
+	if (data->authority == NULL)
+		g_warning ("Could not get polkit authority, privileged methods will be refused: %s",
+			   error->message);
+
+	bytes = g_resources_lookup_data ("/net/hadess/SwitcherooControl/net.hadess.SwitcherooControl.xml",
+					 G_RESOURCE_LOOKUP_FLAGS_NONE,
+					 NULL);
+	data->introspection_data = g_dbus_node_info_new_for_xml (g_bytes_get_data (bytes, NULL), NULL);
+	g_bytes_unref (bytes);
+	g_assert (data->introspection_data != NULL);
+
+	flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
+	if (replace)
+		flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
+
+	data->name_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
+					CONTROL_PROXY_DBUS_NAME,
+					flags,
+					bus_acquired_handler,
+					name_acquired_handler,
+					name_lost_handler,
+					data,
+					NULL);
+
+	return TRUE;
+}
+
+static GPtrArray *
+get_card_env (GUdevClient *client,
+	      GUdevDevice *dev)
+{
+	GPtrArray *array;
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	array = g_ptr_array_new_full (0, g_free);
+
+	parent = g_udev_device_get_parent (dev);
+	if (g_strcmp0 (g_udev_device_get_driver (parent), "nvidia") == 0) {
+		g_ptr_array_add (array, g_strdup ("__GLX_VENDOR_LIBRARY_NAME"));
+		g_ptr_array_add (array, g_strdup ("nvidia"));
+
+		/* XXX: __NV_PRIME_RENDER_OFFLOAD_PROVIDER would be needed for
+		 * multi-NVidia setups, see:
+		 * https://download.nvidia.com/XFree86/Linux-x86_64/440.26/README/primerenderoffload.html */
+		g_ptr_array_add (array, g_strdup ("__NV_PRIME_RENDER_OFFLOAD"));
+		g_ptr_array_add (array, g_strdup ("1"));
+
+		/* Make sure Vulkan apps always select Nvidia GPUs */
+		g_ptr_array_add (array, g_strdup ("__VK_LAYER_NV_optimus"));
+		g_ptr_array_add (array, g_strdup ("NVIDIA_only"));
+	} else {
+		char *id;
+
+		/* See the Mesa loader code:
+		 * https://gitlab.freedesktop.org/mesa/mesa/blob/master/src/loader/loader.c#L322 */
+		id = g_strdup (g_udev_device_get_property (dev, "ID_PATH_TAG"));
+		if (id != NULL) {
+			g_ptr_array_add (array, g_strdup ("DRI_PRIME"));
+			g_ptr_array_add (array, id);
+		}
+	}
+
+	if (array->len == 0) {
+		g_ptr_array_free (array, TRUE);
+		return NULL;
+	}
+
+	return array;
+}
+
+static char *
+get_card_name (GUdevDevice *d,
+	       const char  *fallback)
+{
+	const char *vendor, *product;
+	g_autoptr(GUdevDevice) parent = NULL;
+	g_autofree char *renderer = NULL;
+
+	parent = g_udev_device_get_parent (d);
+	vendor = g_udev_device_get_property (parent, "SWITCHEROO_CONTROL_VENDOR_NAME");
+	if (!vendor || *vendor == '\0')
+		vendor = g_udev_device_get_property (parent, "ID_VENDOR_FROM_DATABASE");
+	product = g_udev_device_get_property (parent, "SWITCHEROO_CONTROL_PRODUCT_NAME");
+	if (!product || *product == '\0')
+		product = g_udev_device_get_property (parent, "ID_MODEL_FROM_DATABASE");
+
+	if (!vendor && !product)
+		goto bail;
+
+	if (!vendor)
+		return g_strdup (product);
+	if (!product)
+		return g_strdup (vendor);
+	renderer = g_strdup_printf ("%s %s", vendor, product);
+	return info_cleanup (renderer);
+
+bail:
+	return g_strdup (fallback);
+}
+
+static gboolean
+get_card_is_default (GUdevDevice *d)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	parent = g_udev_device_get_parent (d);
+	return g_udev_device_get_sysfs_attr_as_boolean (parent, "boot_vga");
+}
+
+static gboolean
+get_card_is_discrete (GUdevDevice *d,
+		      gboolean     is_default,
+		      MuxMode      mux_mode)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	const char *driver;
+
+	parent = g_udev_device_get_parent (d);
+	driver = g_udev_device_get_driver (parent);
+	if (g_strcmp0 (driver, "nvidia") == 0 ||
+	    g_strcmp0 (driver, "nouveau") == 0)
+		return TRUE;
+
+	/* With the MUX in discrete mode, the discrete GPU is the boot one */
+	if (mux_mode == MUX_MODE_DISCRETE)
+		return is_default;
+	return !is_default;
+}
+
+static char *
+get_card_pci_slot (GUdevDevice *d)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	const char *slot;
+
+	parent = g_udev_device_get_parent (d);
+	if (g_strcmp0 (g_udev_device_get_subsystem (parent), "pci") != 0)
+		return NULL;
+	slot = g_udev_device_get_property (parent, "PCI_SLOT_NAME");
+	if (slot == NULL)
+		slot = g_udev_device_get_name (parent);
+	return g_strdup (slot);
+}
+
+static char *
+get_card_id (GUdevDevice *d)
+{
+	const char *tag;
+
+	tag = g_udev_device_get_property (d, "ID_PATH_TAG");
+	if (tag != NULL)
+		return g_strdup (tag);
+	return g_path_get_basename (g_udev_device_get_device_file (d));
+}
+
+static CardData *
+get_card_data (GUdevClient *client,
+	       GUdevDevice *d,
+	       MuxMode      mux_mode,
+	       GHashTable  *known_cards)
+{
+	CardData *data;
+	GPtrArray *env;
+	KnownCard *known = NULL;
+
+	env = get_card_env (client, d);
+	if (!env)
+		return NULL;
+
+	data = g_new0 (CardData, 1);
+	data->dev = g_object_ref (d);
+	data->id = get_card_id (d);
+	data->env = env;
+	data->is_default = get_card_is_default (d);
+	data->is_discrete = get_card_is_discrete (d, data->is_default, mux_mode);
+	data->pci_slot = get_card_pci_slot (d);
+
+	/* Reuse what we already know about GPUs coming back from passthrough,
+	 * or rescanned. The name is only worked out when someone needs it,
+	 * see ensure_card_details() */
+	if (data->pci_slot != NULL)
+		known = g_hash_table_lookup (known_cards, data->pci_slot);
+	if (known != NULL) {
+		data->name = g_strdup (known->name);
+	} else if (data->pci_slot != NULL) {
+		g_autoptr(GUdevDevice) parent = NULL;
+
+		parent = g_udev_device_get_parent (d);
+		known = g_new0 (KnownCard, 1);
+		known->id = g_strdup (data->id);
+		known->parent_path = g_strdup (g_udev_device_get_sysfs_path (parent));
+		known->is_discrete = data->is_discrete;
+		g_hash_table_insert (known_cards, g_strdup (data->pci_slot), known);
+	}
+
+	return data;
+}
+
+static const char *
+parse_vga_switcheroo_power (const char *power)
+{
+	if (g_strcmp0 (power, "Pwr") == 0)
+		return "on";
+	if (g_strcmp0 (power, "Off") == 0)
+		return "off";
+	if (g_strcmp0 (power, "DynPwr") == 0)
+		return "dynamic-on";
+	if (g_strcmp0 (power, "DynOff") == 0)
+		return "dynamic-off";
+	return "unknown";
+}
+
+static void
+update_vga_switcheroo_state (ControlData *data,
+			     GPtrArray   *cards)
+{
+	g_autofree char *contents = NULL;
+	g_autoptr(GError) error = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		card->vga_switcheroo_client = FALSE;
+	}
+
+	if (!data->vga_switcheroo)
+		return;
+
+	if (!g_file_get_contents (VGA_SWITCHEROO_PATH, &contents, NULL, &error)) {
+		g_debug ("Could not read vga_switcheroo state: %s", error->message);
+		return;
+	}
+
+	/* Each client is listed as:
+	 * <id>:<IGD|DIS>[-Audio]:<+ if active>:[Dyn]<Pwr|Off>:<PCI slot> */
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		g_auto(GStrv) fields = NULL;
+		guint j;
+
+		fields = g_strsplit (lines[i], ":", 5);
+		if (g_strv_length (fields) != 5)
+			continue;
+		/* Skip the HDMI audio clients */
+		if (g_strcmp0 (fields[1], "IGD") != 0 &&
+		    g_strcmp0 (fields[1], "DIS") != 0)
+			continue;
+
+		for (j = 0; j < cards->len; j++) {
+			CardData *card = cards->pdata[j];
+
+			if (g_strcmp0 (card->pci_slot, fields[4]) != 0)
+				continue;
+			card->vga_switcheroo_client = TRUE;
+			card->vga_switcheroo_active = (fields[2][0] == '+');
+			card->vga_switcheroo_power = parse_vga_switcheroo_power (fields[3]);
+			g_debug ("vga_switcheroo client %s is %s, power %s",
+				 card->pci_slot,
+				 card->vga_switcheroo_active ? "active" : "inactive",
+				 card->vga_switcheroo_power);
+		}
+	}
+}
+
+static char *
+find_lavapipe_icds (void)
+{
+	const char * const icd_dirs[] = {
+		"/etc/vulkan/icd.d",
+		"/usr/share/vulkan/icd.d",
+		NULL
+	};
+	g_autoptr(GPtrArray) icds = NULL;
+	guint i;
+
+	icds = g_ptr_array_new_with_free_func (g_free);
+	for (i = 0; icd_dirs[i] != NULL; i++) {
+		g_autoptr(GDir) dir = NULL;
+		const char *name;
+
+		dir = g_dir_open (icd_dirs[i], 0, NULL);
+		if (dir == NULL)
+			continue;
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			if (g_str_has_prefix (name, "lvp_icd") &&
+			    g_str_has_suffix (name, ".json"))
+				g_ptr_array_add (icds, g_build_filename (icd_dirs[i], name, NULL));
+		}
+	}
+
+	if (icds->len == 0)
+		return NULL;
+	g_ptr_array_add (icds, NULL);
+	return g_strjoinv (":", (char **) icds->pdata);
+}
+
+static void
+add_software_card (ControlData *data,
+		   GPtrArray   *cards)
+{
+	CardData *card;
+	g_autofree char *icds = NULL;
+
+	g_debug ("Adding software rendering GPU");
+
+	card = g_new0 (CardData, 1);
+	card->id = g_strdup (SOFTWARE_GPU_ID);
+	card->name = g_strdup ("Software Rendering");
+	card->capacity = 1.0;
+	card->env = g_ptr_array_new_full (0, g_free);
+	g_ptr_array_add (card->env, g_strdup ("LIBGL_ALWAYS_SOFTWARE"));
+	g_ptr_array_add (card->env, g_strdup ("1"));
+	g_ptr_array_add (card->env, g_strdup ("GALLIUM_DRIVER"));
+	g_ptr_array_add (card->env, g_strdup ("llvmpipe"));
+	/* LP_NUM_THREADS depends on the launching process' CPU affinity
+	 * and cgroup, which we don't know, so launchers set it */
+
+	icds = find_lavapipe_icds ();
+	if (icds != NULL) {
+		g_ptr_array_add (card->env, g_strdup ("VK_ICD_FILENAMES"));
+		g_ptr_array_add (card->env, g_steal_pointer (&icds));
+	}
+
+	g_ptr_array_add (cards, card);
+}
+
+/* The topology used by --fake */
+static const char *fake_topology =
+	"[Simulation]\n"
+	"IncludeHardware=true\n"
+	"\n"
+	"[GPU intel-i740]\n"
+	"Name=Intel i740 “Auburn”\n"
+	"Environment=INTEL_AGP_OFFLOADING;1;INTEL_PCI_MODE;false;\n"
+	"\n"
+	"[GPU trident]\n"
+	"Name=Trident Vesa Local Bus 512KB\n"
+	"Environment=TRIDENT_OFFLOADING;1;\n"
+	"AfterHardware=true\n";
+
+static void
+add_simulated_cards (Simulation *simulation,
+		     GPtrArray  *cards,
+		     gboolean    after_hardware)
+{
+	GPtrArray *gpus;
+	guint i;
+
+	gpus = simulation_get_gpus (simulation);
+	for (i = 0; i < gpus->len; i++) {
+		SimulatedGpu *gpu = gpus->pdata[i];
+		CardData *card;
+		guint j;
+
+		if (!gpu->present || gpu->after_hardware != after_hardware)
+			continue;
+
+		card = g_new0 (CardData, 1);
+		card->id = g_strdup (gpu->id);
+		card->name = g_strdup (gpu->name);
+		card->env = g_ptr_array_new_full (0, g_free);
+		for (j = 0; gpu->env[j] != NULL; j++)
+			g_ptr_array_add (card->env, g_strdup (gpu->env[j]));
+		card->is_default = gpu->is_default;
+		card->is_discrete = gpu->is_discrete;
+
+		g_ptr_array_add (cards, card);
+	}
+}
+
+static CardData *
+get_accel_data (GUdevDevice *d)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	CardData *data;
+	const char *driver;
+	guint i;
+
+	data = g_new0 (CardData, 1);
+	data->dev = g_object_ref (d);
+	data->name = get_card_name (d, "Unknown Accelerator");
+	data->env = g_ptr_array_new_full (0, g_free);
+	data->pci_slot = get_card_pci_slot (d);
+
+	parent = g_udev_device_get_parent (d);
+	driver = g_udev_device_get_driver (parent);
+	for (i = 0; i < G_N_ELEMENTS (accel_drivers); i++) {
+		if (g_strcmp0 (driver, accel_drivers[i].driver) == 0) {
+			data->accel_driver = &accel_drivers[i];
+			break;
+		}
+	}
+
+	if (data->accel_driver != NULL &&
+	    data->accel_driver->index_env != NULL &&
+	    g_udev_device_get_number (d) != NULL) {
+		g_ptr_array_add (data->env, g_strdup (data->accel_driver->index_env));
+		g_ptr_array_add (data->env, g_strdup (g_udev_device_get_number (d)));
+	}
+
+	return data;
+}
+
+static GPtrArray *
+get_accel_cards (ControlData *data)
+{
+	GList *devices, *l;
+	GPtrArray *accels;
+
+	accels = g_ptr_array_new_with_free_func ((GDestroyNotify) free_card_data);
+
+	if (data->simulation != NULL &&
+	    !simulation_get_include_hardware (data->simulation))
+		return accels;
+
+	devices = g_udev_client_query_by_subsystem (data->client, "accel");
+	for (l = devices; l != NULL; l = l->next) {
+		GUdevDevice *d = l->data;
+		const char *path;
+
+		path = g_udev_device_get_device_file (d);
+		if (path != NULL &&
+		    g_str_has_prefix (path, "/dev/accel/accel"))
+			g_ptr_array_add (accels, get_accel_data (d));
+		g_object_unref (d);
+	}
+	g_list_free (devices);
+
+	return accels;
+}
+
+static char *
+get_sysfs_link_name (GUdevDevice *d,
+		     const char  *link)
+{
+	g_autofree char *path = NULL;
+	g_autofree char *target = NULL;
+
+	path = g_build_filename (g_udev_device_get_sysfs_path (d), link, NULL);
+	target = g_file_read_link (path, NULL);
+	if (target == NULL)
+		return NULL;
+	return g_path_get_basename (target);
+}
+
+static CardData *
+find_card_by_parent_name (GPtrArray  *cards,
+			  const char *name)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		g_autoptr(GUdevDevice) parent = NULL;
+
+		if (card->dev == NULL)
+			continue;
+		parent = g_udev_device_get_parent (card->dev);
+		if (g_strcmp0 (g_udev_device_get_name (parent), name) == 0)
+			return card;
+	}
+
+	return NULL;
+}
+
+static guint
+get_virtfn_index (CardData   *pf,
+		  const char *vf_name)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	guint i;
+
+	parent = g_udev_device_get_parent (pf->dev);
+	for (i = 0; ; i++) {
+		g_autofree char *link = NULL;
+		g_autofree char *name = NULL;
+
+		link = g_strdup_printf ("virtfn%u", i);
+		name = get_sysfs_link_name (parent, link);
+		if (name == NULL)
+			break;
+		if (g_strcmp0 (name, vf_name) == 0)
+			return i;
+	}
+
+	return 0;
+}
+
+/* Number of partitions of an amdgpu compute partition mode, 0 for
+ * CPX, which has one partition per XCC */
+static guint
+get_num_compute_partitions (GUdevDevice *parent)
+{
+	const char *mode;
+	guint i;
+
+	mode = g_udev_device_get_sysfs_attr (parent, "current_compute_partition");
+	if (mode == NULL)
+		return 1;
+	for (i = 0; i < G_N_ELEMENTS (compute_partition_modes); i++) {
+		if (g_strcmp0 (mode, compute_partition_modes[i].mode) == 0)
+			return compute_partition_modes[i].num_partitions;
+	}
+	return 0;
+}
+
+static gint
+compare_pci_slot (gconstpointer a,
+		  gconstpointer b)
+{
+	const CardData *card_a = *(const CardData **) a;
+	const CardData *card_b = *(const CardData **) b;
+
+	return g_strcmp0 (card_a->pci_slot, card_b->pci_slot);
+}
+
+static gint
+compare_function_index (gconstpointer a,
+			gconstpointer b)
+{
+	const CardData *card_a = *(const CardData **) a;
+	const CardData *card_b = *(const CardData **) b;
+
+	return (card_a->function_index > card_b->function_index) -
+		(card_a->function_index < card_b->function_index);
+}
+
+/* Partition devices aren't children of their GPU. The kernel creates
+ * the partitions of each GPU in turn as it probes them, in PCI order,
+ * so hand them out in that order, but only if the numbers add up */
+static GHashTable *
+assign_partitions (GPtrArray *partitioned,
+		   GPtrArray *partitions)
+{
+	GHashTable *owners;
+	guint i, j, next = 0;
+
+	owners = g_hash_table_new (NULL, NULL);
+	g_ptr_array_sort (partitioned, compare_pci_slot);
+	g_ptr_array_sort (partitions, compare_function_index);
+
+	for (i = 0; i < partitioned->len; i++) {
+		CardData *pf = partitioned->pdata[i];
+		g_autoptr(GUdevDevice) parent = NULL;
+		guint num_partitions;
+
+		parent = g_udev_device_get_parent (pf->dev);
+		num_partitions = get_num_compute_partitions (parent);
+		/* Only the last GPU can take whatever is left */
+		if (num_partitions == 0 && i == partitioned->len - 1)
+			num_partitions = partitions->len - next + 1;
+		if (num_partitions == 0 || next + num_partitions - 1 > partitions->len)
+			break;
+
+		/* The first partition uses the GPU's own render node */
+		for (j = 1; j < num_partitions; j++) {
+			CardData *card = partitions->pdata[next++];
+
+			card->function_index = j;
+			g_hash_table_insert (owners, card, pf);
+		}
+	}
+
+	if (i != partitioned->len || next != partitions->len) {
+		g_debug ("Could not work out which GPUs %u compute partitions belong to",
+			 partitions->len);
+		g_hash_table_remove_all (owners);
+	}
+
+	return owners;
+}
+
+static guint64
+get_card_vram (CardData *card)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	parent = g_udev_device_get_parent (card->dev);
+	if (parent == NULL)
+		return 0;
+	return g_udev_device_get_sysfs_attr_as_uint64 (parent, "mem_info_vram_total");
+}
+
+/* Partitions split the GPU evenly, by definition of the partition mode.
+ * Virtual functions get their share of the VRAM if their driver tells
+ * us how much they were provisioned with, an even share otherwise */
+static void
+set_group_capacity (GPtrArray  *cards,
+		    const char *group)
+{
+	g_autoptr(GPtrArray) members = NULL;
+	guint64 total_vram = 0;
+	gboolean have_vram = TRUE;
+	guint i;
+
+	members = g_ptr_array_new ();
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		guint64 vram;
+
+		if (g_strcmp0 (card->group, group) != 0)
+			continue;
+		g_ptr_array_add (members, card);
+		vram = card->function == CARD_FUNCTION_PARTITION ? 0 : get_card_vram (card);
+		have_vram = have_vram && vram > 0;
+		total_vram += vram;
+	}
+
+	for (i = 0; i < members->len; i++) {
+		CardData *card = members->pdata[i];
+
+		if (have_vram)
+			card->capacity = (gdouble) get_card_vram (card) / total_vram;
+		else
+			card->capacity = 1.0 / members->len;
+	}
+}
+
+static void
+group_card_functions (GPtrArray *cards)
+{
+	g_autoptr(GPtrArray) partitioned = NULL;
+	g_autoptr(GPtrArray) partitions = NULL;
+	g_autoptr(GHashTable) owners = NULL;
+	guint i;
+
+	/* Find the partitions, and the GPUs they could belong to */
+	partitioned = g_ptr_array_new ();
+	partitions = g_ptr_array_new ();
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		g_autoptr(GUdevDevice) parent = NULL;
+		const char *name;
+
+		card->capacity = 1.0;
+		if (card->dev == NULL)
+			continue;
+
+		parent = g_udev_device_get_parent (card->dev);
+		name = g_udev_device_get_name (parent);
+		if (g_strcmp0 (g_udev_device_get_subsystem (parent), "pci") == 0) {
+			if (get_num_compute_partitions (parent) != 1)
+				g_ptr_array_add (partitioned, card);
+		} else if (g_str_has_prefix (name, "amdgpu_xcp.")) {
+			card->function = CARD_FUNCTION_PARTITION;
+			card->function_index = g_ascii_strtoull (name + strlen ("amdgpu_xcp."), NULL, 10);
+			g_ptr_array_add (partitions, card);
+		}
+	}
+	owners = assign_partitions (partitioned, partitions);
+
+	/* Attach virtual functions and partitions to their physical GPU */
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		g_autoptr(GUdevDevice) parent = NULL;
+		CardData *pf = NULL;
+
+		if (card->dev == NULL)
+			continue;
+
+		parent = g_udev_device_get_parent (card->dev);
+		if (card->function == CARD_FUNCTION_PARTITION) {
+			pf = g_hash_table_lookup (owners, card);
+			if (pf == NULL)
+				card->function_index = 0;
+		} else if (g_strcmp0 (g_udev_device_get_subsystem (parent), "pci") == 0) {
+			g_autofree char *physfn = NULL;
+
+			physfn = get_sysfs_link_name (parent, "physfn");
+			if (physfn == NULL)
+				continue;
+			card->function = CARD_FUNCTION_VIRTUAL;
+			pf = find_card_by_parent_name (cards, physfn);
+			if (pf != NULL)
+				card->function_index = get_virtfn_index (pf, g_udev_device_get_name (parent));
+		}
+
+		if (pf == NULL || pf->id == NULL)
+			continue;
+
+		g_free (card->group);
+		card->group = g_strdup (pf->id);
+		g_free (pf->group);
+		pf->group = g_strdup (pf->id);
+		card->is_default = FALSE;
+		card->is_discrete = pf->is_discrete;
+	}
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		if (card->group != NULL && g_strcmp0 (card->group, card->id) == 0)
+			set_group_capacity (cards, card->group);
+	}
+}
+
+static GUdevDevice *
+find_mux_device (GUdevClient        *client,
+		 const MuxAttribute *mux)
+{
+	GList *devices, *l;
+	GUdevDevice *ret = NULL;
+
+	if (mux->name != NULL)
+		return g_udev_client_query_by_subsystem_and_name (client, mux->subsystem, mux->name);
+
+	devices = g_udev_client_query_by_subsystem (client, mux->subsystem);
+	for (l = devices; l != NULL; l = l->next) {
+		GUdevDevice *d = l->data;
+
+		if (ret == NULL && g_udev_device_has_sysfs_attr (d, mux->attribute))
+			ret = g_object_ref (d);
+		g_object_unref (d);
+	}
+	g_list_free (devices);
+
+	return ret;
+}
+
+static gboolean
+is_mux_device (GUdevDevice *device)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (mux_attributes); i++) {
+		if (g_strcmp0 (g_udev_device_get_subsystem (device), mux_attributes[i].subsystem) != 0)
+			continue;
+		if (mux_attributes[i].name == NULL ||
+		    g_strcmp0 (g_udev_device_get_name (device), mux_attributes[i].name) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static MuxMode
+get_mux_mode (GUdevClient *client)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (mux_attributes); i++) {
+		g_autoptr(GUdevDevice) dev = NULL;
+		const char *value;
+
+		dev = find_mux_device (client, &mux_attributes[i]);
+		if (!dev)
+			continue;
+		value = g_udev_device_get_sysfs_attr (dev, mux_attributes[i].attribute);
+		if (!value)
+			continue;
+
+		g_debug ("Found MUX switch %s/%s with value '%s'",
+			 g_udev_device_get_name (dev), mux_attributes[i].attribute, value);
+		if (g_strcmp0 (value, mux_attributes[i].discrete_value) == 0)
+			return MUX_MODE_DISCRETE;
+		return MUX_MODE_HYBRID;
+	}
+
+	return MUX_MODE_NONE;
+}
+
+static void
+apply_mux_mode (GPtrArray *cards,
+		MuxMode    mux_mode)
+{
+	guint i;
+
+	if (mux_mode != MUX_MODE_DISCRETE)
+		return;
+
+	/* The discrete GPU is driving the display, so it is the default,
+	 * and applications don't need to be offloaded to it */
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		card->is_default = card->is_discrete;
+		if (card->is_discrete)
+			g_ptr_array_set_size (card->env, 0);
+	}
+}
+
+static gboolean
+has_card_with_pci_slot (GPtrArray  *cards,
+			const char *pci_slot)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		if (g_strcmp0 (card->pci_slot, pci_slot) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+add_unavailable_cards (ControlData *data,
+		       GPtrArray   *cards)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init (&iter, data->known_cards);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		const char *pci_slot = key;
+		KnownCard *known = value;
+		g_autoptr(GUdevDevice) parent = NULL;
+		const char *driver;
+		const char *reason;
+		CardData *card;
+
+		if (has_card_with_pci_slot (cards, pci_slot))
+			continue;
+
+		parent = g_udev_client_query_by_sysfs_path (data->client, known->parent_path);
+		if (parent == NULL) {
+			g_debug ("GPU %s was removed", pci_slot);
+			g_hash_table_iter_remove (&iter);
+			continue;
+		}
+
+		driver = g_udev_device_get_driver (parent);
+		if (g_strcmp0 (driver, "vfio-pci") == 0 ||
+		    g_strcmp0 (driver, "pci-stub") == 0) {
+			reason = "passthrough";
+		} else if (driver == NULL) {
+			reason = "unbound";
+		} else {
+			/* The driver failed to set it up, or its render
+			 * node is being recreated */
+			reason = "no-render-node";
+		}
+
+		g_debug ("GPU %s is unavailable: %s", pci_slot, reason);
+		card = g_new0 (CardData, 1);
+		card->id = g_strdup (known->id);
+		card->name = g_strdup (known->name);
+		card->env = g_ptr_array_new_full (0, g_free);
+		card->is_discrete = known->is_discrete;
+		card->pci_slot = g_strdup (pci_slot);
+		card->capacity = 1.0;
+		card->unavailable = reason;
+		g_ptr_array_add (cards, card);
+	}
+}
+
+static guint
+count_available_cards (GPtrArray *cards)
+{
+	guint i, num_available = 0;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		if (card->unavailable == NULL)
+			num_available++;
+	}
+
+	return num_available;
+}
+
+/* The kernel's DRM driver version doesn't change without the module changing */
+static char *
+get_drm_caps_key (GUdevDevice *d)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	g_autofree char *module_version_path = NULL;
+	g_autofree char *version = NULL;
+	const char *pci_id, *driver;
+
+	parent = g_udev_device_get_parent (d);
+	if (parent == NULL)
+		return NULL;
+	pci_id = g_udev_device_get_property (parent, "PCI_ID");
+	driver = g_udev_device_get_driver (parent);
+	if (pci_id == NULL || driver == NULL)
+		return NULL;
+
+	module_version_path = g_strdup_printf ("/sys/module/%s/version", driver);
+	if (g_file_get_contents (module_version_path, &version, NULL, NULL)) {
+		g_strstrip (version);
+	} else {
+		struct utsname u;
+
+		if (uname (&u) < 0)
+			return NULL;
+		version = g_strdup (u.release);
+	}
+
+	return g_strdup_printf ("%s %s %s", pci_id, driver, version);
+}
+
+static gboolean
+get_card_is_awake (GUdevDevice *d)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+	const char *status;
+
+	parent = g_udev_device_get_parent (d);
+	if (parent == NULL)
+		return TRUE;
+	status = g_udev_device_get_sysfs_attr (parent, "power/runtime_status");
+	return status == NULL || g_strcmp0 (status, "active") == 0;
+}
+
+/* Opening the render node would wake up a suspended GPU, so only probe
+ * GPUs that are already awake, and only once per driver version */
+static void
+probe_card_capabilities (ControlData *data,
+			 GPtrArray   *cards)
+{
+	g_autoptr(GError) error = NULL;
+	gboolean save = FALSE;
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+		g_autofree char *key = NULL;
+		g_autoptr(GError) probe_error = NULL;
+		const char *path;
+
+		if (card->dev == NULL)
+			continue;
+		key = get_drm_caps_key (card->dev);
+		if (key == NULL)
+			continue;
+
+		card->drm_caps = drm_caps_load (data->drm_caps_cache, key);
+		if (card->drm_caps != NULL ||
+		    g_hash_table_contains (data->drm_caps_failed, key))
+			continue;
+
+		path = g_udev_device_get_device_file (card->dev);
+		if (!get_card_is_awake (card->dev)) {
+			g_debug ("Not probing suspended GPU %s", path);
+			continue;
+		}
+
+		card->drm_caps = drm_caps_probe (path, &probe_error);
+		if (card->drm_caps == NULL) {
+			g_debug ("Could not probe GPU capabilities: %s", probe_error->message);
+			g_hash_table_add (data->drm_caps_failed, g_steal_pointer (&key));
+			continue;
+		}
+
+		g_debug ("Probed %s: %s %s", path, card->drm_caps->driver, card->drm_caps->version);
+		drm_caps_save (card->drm_caps, data->drm_caps_cache, key);
+		save = TRUE;
+	}
+
+	if (!save)
+		return;
+
+	if (!g_key_file_save_to_file (data->drm_caps_cache, data->drm_caps_cache_path, &error))
+		g_warning ("Could not save GPU capabilities: %s", error->message);
+}
+
+static GKeyFile *
+load_cache_file (const char  *name,
+		 char       **path)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree char *dir = NULL;
+	const char *cache_dir;
+	GKeyFile *keyfile;
+
+	/* Set by systemd's CacheDirectory= */
+	cache_dir = g_getenv ("CACHE_DIRECTORY");
+	if (cache_dir != NULL)
+		dir = g_strndup (cache_dir, strcspn (cache_dir, ":"));
+	else
+		dir = g_build_filename (g_get_user_cache_dir (), "switcheroo-control", NULL);
+	if (g_mkdir_with_parents (dir, 0755) < 0)
+		g_warning ("Could not create cache directory '%s': %s", dir, g_strerror (errno));
+
+	*path = g_build_filename (dir, name, NULL);
+	keyfile = g_key_file_new ();
+	if (!g_key_file_load_from_file (keyfile, *path, G_KEY_FILE_NONE, &error) &&
+	    !g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+		g_warning ("Could not load cache '%s': %s", *path, error->message);
+
+	return keyfile;
+}
+
+static void
+setup_drm_caps_cache (ControlData *data)
+{
+	data->drm_caps_cache = load_cache_file ("drm-capabilities", &data->drm_caps_cache_path);
+	data->drm_caps_failed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+}
+
+static int
+compare_strings (const char **a,
+		 const char **b)
+{
+	return g_strcmp0 (*a, *b);
+}
+
+/* Changes whenever the installed EGL or Vulkan drivers change */
+static char *
+get_graphics_stack_stamp (void)
+{
+	const char * const dirs[] = {
+		"/usr/share/glvnd/egl_vendor.d",
+		"/etc/glvnd/egl_vendor.d",
+		"/usr/share/vulkan/icd.d",
+		"/etc/vulkan/icd.d",
+		NULL
+	};
+	g_autoptr(GChecksum) checksum = NULL;
+	guint i;
+
+	checksum = g_checksum_new (G_CHECKSUM_SHA1);
+	for (i = 0; dirs[i] != NULL; i++) {
+		g_autoptr(GDir) dir = NULL;
+		g_autoptr(GPtrArray) names = NULL;
+		const char *name;
+		guint j;
+
+		dir = g_dir_open (dirs[i], 0, NULL);
+		if (dir == NULL)
+			continue;
+		names = g_ptr_array_new_with_free_func (g_free);
+		while ((name = g_dir_read_name (dir)) != NULL)
+			g_ptr_array_add (names, g_strdup (name));
+		g_ptr_array_sort (names, (GCompareFunc) compare_strings);
+
+		for (j = 0; j < names->len; j++) {
+			g_autofree char *path = NULL;
+			g_autofree char *entry = NULL;
+			GStatBuf buf;
+
+			path = g_build_filename (dirs[i], names->pdata[j], NULL);
+			if (g_stat (path, &buf) < 0)
+				continue;
+			entry = g_strdup_printf ("%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT "\n",
+						 path, (gint64) buf.st_mtime, (gint64) buf.st_size);
+			g_checksum_update (checksum, (const guchar *) entry, -1);
+		}
+	}
+
+	return g_strndup (g_checksum_get_string (checksum), 12);
+}
+
+/* Results from before the graphics drivers were last changed will
+ * never be looked up again */
+static void
+prune_graphics_cache (ControlData *data)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree char *suffix = NULL;
+	g_auto(GStrv) groups = NULL;
+	gboolean changed = FALSE;
+	guint i;
+
+	suffix = g_strdup_printf (" %s", data->graphics_stamp);
+	groups = g_key_file_get_groups (data->graphics_cache, NULL);
+	for (i = 0; groups[i] != NULL; i++) {
+		if (g_str_has_suffix (groups[i], suffix))
+			continue;
+		g_key_file_remove_group (data->graphics_cache, groups[i], NULL);
+		changed = TRUE;
+	}
+
+	if (changed &&
+	    !g_key_file_save_to_file (data->graphics_cache, data->graphics_cache_path, &error))
+		g_warning ("Could not save graphics capabilities: %s", error->message);
+}
+
+static void
+setup_graphics_cache (ControlData *data)
+{
+	data->graphics_stamp = get_graphics_stack_stamp ();
+	data->graphics_cache = load_cache_file ("graphics-capabilities", &data->graphics_cache_path);
+	prune_graphics_cache (data);
+	data->graphics_failed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	data->probe_cancellable = g_cancellable_new ();
+}
+
+static void
+setup_perf_state (ControlData *data)
+{
+	data->perf_state = load_cache_file ("performance-state", &data->perf_state_path);
+	/* Settings that are still in use by the instance we're replacing
+	 * are restored by that instance */
+	if (data->handover != NULL) {
+		g_key_file_unref (data->perf_state);
+		data->perf_state = g_key_file_new ();
+		return;
+	}
+	if (perf_state_restore (data->perf_state))
+		save_perf_state (data);
+}
+
+static char *
+get_graphics_key (ControlData *data,
+		  CardData    *card)
+{
+	g_autofree char *drm_key = NULL;
+
+	if (card->dev == NULL) {
+		if (g_strcmp0 (card->id, SOFTWARE_GPU_ID) == 0)
+			return g_strdup_printf ("%s %s", SOFTWARE_GPU_ID, data->graphics_stamp);
+		return NULL;
+	}
+
+	drm_key = get_drm_caps_key (card->dev);
+	if (drm_key == NULL)
+		return NULL;
+	return g_strdup_printf ("%s %s", drm_key, data->graphics_stamp);
+}
+
+static GVariant *
+get_cached_graphics (GKeyFile   *cache,
+		     const char *key)
+{
+	g_auto(GStrv) keys = NULL;
+	GVariantBuilder builder;
+	guint i;
+
+	keys = g_key_file_get_keys (cache, key, NULL, NULL);
+	if (keys == NULL)
+		return NULL;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	for (i = 0; keys[i] != NULL; i++) {
+		if (g_strcmp0 (keys[i], "Extensions") == 0) {
+			g_auto(GStrv) list = NULL;
+
+			list = g_key_file_get_string_list (cache, key, keys[i], NULL, NULL);
+			g_variant_builder_add (&builder, "{sv}", keys[i],
+					       g_variant_new_strv ((const char * const *) list, -1));
+		} else {
+			g_autofree char *value = NULL;
+
+			value = g_key_file_get_string (cache, key, keys[i], NULL);
+			g_variant_builder_add (&builder, "{sv}", keys[i],
+					       g_variant_new_string (value ? value : ""));
+		}
+	}
+
+	return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static void
+lookup_graphics_caps (ControlData *data,
+		      GPtrArray   *cards)
+{
+	guint i;
+
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		card->graphics_key = get_graphics_key (data, card);
+		if (card->graphics_key != NULL)
+			card->graphics = get_cached_graphics (data->graphics_cache, card->graphics_key);
+	}
+}
+
+static void
+name_card (ControlData *data,
+	   GPtrArray   *cards,
+	   CardData    *card)
+{
+	KnownCard *known = NULL;
+	CardData *pf = NULL;
+
+	if (card->function != CARD_FUNCTION_PHYSICAL && card->group != NULL)
+		pf = find_card_by_id (cards, card->group);
+
+	g_debug ("Naming GPU %s", card->id);
+	if (pf != NULL && pf->name != NULL) {
+		card->name = g_strdup_printf ("%s (%s %u)", pf->name,
+					      card->function == CARD_FUNCTION_VIRTUAL ? "Virtual Function" : "Partition",
+					      card->function_index);
+	} else if (card->dev != NULL) {
+		card->name = get_card_name (card->dev, "Unknown Graphics Controller");
+	} else {
+		card->name = g_strdup ("Unknown Graphics Controller");
+	}
+
+	/* So that it's not worked out again on the next rescan */
+	if (card->pci_slot != NULL)
+		known = g_hash_table_lookup (data->known_cards, card->pci_slot);
+	if (known != NULL && known->name == NULL)
+		known->name = g_strdup (card->name);
+}
+
+/* Only the inventory of GPUs, their environment, whether they're the
+ * default one, and their cached capabilities are worked out on every
+ * rescan. Names and graphics API support are only worked out when
+ * someone first reads the GPUs, and cached after that */
+static void
+ensure_card_details (ControlData *data,
+		     GPtrArray   *cards)
+{
+	g_autoptr(GPtrArray) pending = NULL;
+	guint i;
+
+	pending = g_ptr_array_new ();
+	for (i = 0; i < cards->len; i++) {
+		CardData *card = cards->pdata[i];
+
+		if (!card->details_done)
+			g_ptr_array_add (pending, card);
+	}
+	if (pending->len == 0)
+		return;
+
+	/* Virtual functions and partitions are named after their GPU */
+	for (i = 0; i < pending->len; i++) {
+		CardData *card = pending->pdata[i];
+
+		if (card->name == NULL && card->function == CARD_FUNCTION_PHYSICAL)
+			name_card (data, cards, card);
+	}
+	for (i = 0; i < pending->len; i++) {
+		CardData *card = pending->pdata[i];
+
+		if (card->name == NULL)
+			name_card (data, cards, card);
+		card->details_done = TRUE;
+	}
+
+	if (data->probe_graphics)
+		lookup_graphics_caps (data, pending);
+}
+
+static GPtrArray *
+get_drm_cards (ControlData *data)
+{
+	GList *devices, *l;
+	GPtrArray *cards;
+
+	cards = g_ptr_array_new_with_free_func ((GDestroyNotify) free_card_data);
+	data->mux_mode = get_mux_mode (data->client);
+
+	if (data->simulation != NULL)
+		add_simulated_cards (data->simulation, cards, FALSE);
+
+	if (data->simulation != NULL &&
+	    !simulation_get_include_hardware (data->simulation))
+		devices = NULL;
+	else
+		devices = g_udev_client_query_by_subsystem (data->client, "drm");
+	for (l = devices; l != NULL; l = l->next) {
+		GUdevDevice *d = l->data;
+		const char *path;
+
+		path = g_udev_device_get_device_file (d);
+		if (path != NULL &&
+		    g_str_has_prefix (path, "/dev/dri/render")) {
+			CardData *card;
+			card = get_card_data (data->client, d, data->mux_mode, data->known_cards);
+			if (card)
+				g_ptr_array_add (cards, card);
+		}
+		g_object_unref (d);
+	}
+	g_list_free (devices);
+
+	if (data->simulation != NULL)
+		add_simulated_cards (data->simulation, cards, TRUE);
+
+	group_card_functions (cards);
+	apply_mux_mode (cards, data->mux_mode);
+
+	if (data->software_gpu && cards->len == 0)
+		add_software_card (data, cards);
+
+	/* Make sure the only card is the default */
+	if (cards->len == 1) {
+		CardData *card = cards->pdata[0];
+		card->is_default = TRUE;
+	}
+
+	update_vga_switcheroo_state (data, cards);
+	add_unavailable_cards (data, cards);
+
+	/* Straight away, as the GPU might be asleep by the time
+	 * someone reads the GPUs */
+	probe_card_capabilities (data, cards);
+
+	return cards;
+}
+
+/* Maps each DRM parent device's sysfs path to its primary node, so
+ * that the drm subsystem is only enumerated once per spec */
+static GHashTable *
+get_primary_nodes (GUdevClient *client)
+{
+	GHashTable *ret;
+	GList *devices, *l;
+
+	ret = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	devices = g_udev_client_query_by_subsystem (client, "drm");
+	for (l = devices; l != NULL; l = l->next) {
+		GUdevDevice *d = l->data;
+		g_autoptr(GUdevDevice) p = NULL;
+		const char *path;
+
+		path = g_udev_device_get_device_file (d);
+		if (path != NULL &&
+		    g_str_has_prefix (path, "/dev/dri/card")) {
+			p = g_udev_device_get_parent (d);
+			if (p != NULL &&
+			    !g_hash_table_contains (ret, g_udev_device_get_sysfs_path (p)))
+				g_hash_table_insert (ret,
+						     g_strdup (g_udev_device_get_sysfs_path (p)),
+						     g_strdup (path));
+		}
+		g_object_unref (d);
+	}
+	g_list_free (devices);
+
+	return ret;
+}
+
+static const char *
+get_card_primary_node (GHashTable  *primary_nodes,
+		       GUdevDevice *render)
+{
+	g_autoptr(GUdevDevice) parent = NULL;
+
+	parent = g_udev_device_get_parent (render);
+	if (parent == NULL)
+		return NULL;
+
+	return g_hash_table_lookup (primary_nodes,
+				    g_udev_device_get_sysfs_path (parent));
+}
+
+static void
+write_gpus_cdi_spec (ControlData *data)
+{
+	g_autoptr(CdiSpec) spec = NULL;
+	g_autoptr(GHashTable) primary_nodes = NULL;
+	g_autoptr(GError) error = NULL;
+	guint i;
+
+	spec = cdi_spec_new ("hadess.net/gpu");
+	primary_nodes = get_primary_nodes (data->client);
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+		const char *nodes[3] = { NULL, };
+
+		if (card->dev == NULL || card->unavailable != NULL)
+			continue;
+
+		nodes[0] = g_udev_device_get_device_file (card->dev);
+		nodes[1] = get_card_primary_node (primary_nodes, card->dev);
+
+		cdi_spec_add_device (spec, card->id, nodes, card->env);
+		if (card->is_default)
+			cdi_spec_add_device (spec, "default", nodes, card->env);
+	}
+
+	if (!cdi_spec_write (spec, data->cdi_spec_dir, &error))
+		g_warning ("Could not write GPU CDI spec: %s", error->message);
 }
 
 static void
-bus_acquired_handler (GDBusConnection *connection,
-		      const gchar     *name,
-		      gpointer         user_data)
+write_accels_cdi_spec (ControlData *data)
 {
-	ControlData *data = user_data;
+	g_autoptr(CdiSpec) spec = NULL;
+	g_autoptr(GError) error = NULL;
+	guint i;
 
-	g_dbus_connection_register_object (connection,
-					   CONTROL_PROXY_DBUS_PATH,
-					   data->introspection_data->interfaces[0],
-					   &interface_vtable,
-					   data,
-					   NULL,
-					   NULL);
+	spec = cdi_spec_new ("hadess.net/accel");
+	for (i = 0; i < data->accels->len; i++) {
+		CardData *accel = data->accels->pdata[i];
+		const char *nodes[2] = { NULL, };
 
-	data->connection = g_object_ref (connection);
+		nodes[0] = g_udev_device_get_device_file (accel->dev);
+		cdi_spec_add_device (spec, g_udev_device_get_name (accel->dev),
+				     nodes, accel->env);
+	}
+
+	if (!cdi_spec_write (spec, data->cdi_spec_dir, &error))
+		g_warning ("Could not write accelerator CDI spec: %s", error->message);
 }
 
-static void
-name_acquired_handler (GDBusConnection *connection,
-		       const gchar     *name,
-		       gpointer         user_data)
+static gboolean
+cards_changed (GPtrArray *old_cards,
+	       GPtrArray *new_cards)
 {
-	ControlData *data = user_data;
+	g_autoptr(GVariant) old_gpus = NULL;
+	g_autoptr(GVariant) new_gpus = NULL;
 
-	if (data->init_done)
-		send_dbus_event (data);
+	if (old_cards->len != new_cards->len)
+		return TRUE;
+
+	old_gpus = g_variant_ref_sink (build_gpus_variant (old_cards));
+	new_gpus = g_variant_ref_sink (build_gpus_variant (new_cards));
+	return !g_variant_equal (old_gpus, new_gpus);
 }
 
 static gboolean
-setup_dbus (ControlData *data,
-	    gboolean     replace)
+accels_changed (GPtrArray *old_accels,
+		GPtrArray *new_accels)
 {
-	GBytes *bytes;
-	GBusNameOwnerFlags flags;
+	g_autoptr(GVariant) old_variant = NULL;
+	g_autoptr(GVariant) new_variant = NULL;
 
-	bytes = g_resources_lookup_data ("/net/hadess/SwitcherooControl/net.hadess.SwitcherooControl.xml",
-					 G_RESOURCE_LOOKUP_FLAGS_NONE,
-					 NULL);
-	data->introspection_data = g_dbus_node_info_new_for_xml (g_bytes_get_data (bytes, NULL), NULL);
-	g_bytes_unref (bytes);
-	g_assert (data->introspection_data != NULL);
+	if (old_accels->len != new_accels->len)
+		return TRUE;
 
-	flags = G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
-	if (replace)
-		flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
+	old_variant = g_variant_ref_sink (build_accels_variant (old_accels));
+	new_variant = g_variant_ref_sink (build_accels_variant (new_accels));
+	return !g_variant_equal (old_variant, new_variant);
+}
 
-	data->name_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
-					CONTROL_PROXY_DBUS_NAME,
-					flags,
-					bus_acquired_handler,
-					name_acquired_handler,
-					name_lost_handler,
-					data,
-					NULL);
+static void refresh_cards (ControlData *data);
+static void start_graphics_probe (ControlData *data);
 
-	return TRUE;
+static gboolean
+graphics_probe_timeout_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	g_debug ("Graphics probe for '%s' timed out", data->probe_key);
+	data->probe_timeout_id = 0;
+	g_subprocess_force_exit (data->probe);
+
+	return G_SOURCE_REMOVE;
 }
 
-static GPtrArray *
-get_card_env (GUdevClient *client,
-	      GUdevDevice *dev)
+static void
+graphics_probe_done_cb (GObject      *source_object,
+			GAsyncResult *res,
+			gpointer      user_data)
 {
-	GPtrArray *array;
-	g_autoptr(GUdevDevice) parent = NULL;
-
-	array = g_ptr_array_new_full (0, g_free);
+	GSubprocess *subprocess = G_SUBPROCESS (source_object);
+	ControlData *data;
+	g_autoptr(GKeyFile) result = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree char *output = NULL;
+	g_auto(GStrv) keys = NULL;
+	guint i;
 
-	parent = g_udev_device_get_parent (dev);
-	if (g_strcmp0 (g_udev_device_get_driver (parent), "nvidia") == 0) {
-		g_ptr_array_add (array, g_strdup ("__GLX_VENDOR_LIBRARY_NAME"));
-		g_ptr_array_add (array, g_strdup ("nvidia"));
+	if (!g_subprocess_communicate_utf8_finish (subprocess, res, &output, NULL, &error) &&
+	    g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		return;
 
-		/* XXX: __NV_PRIME_RENDER_OFFLOAD_PROVIDER would be needed for
-		 * multi-NVidia setups, see:
-		 * https://download.nvidia.com/XFree86/Linux-x86_64/440.26/README/primerenderoffload.html */
-		g_ptr_array_add (array, g_strdup ("__NV_PRIME_RENDER_OFFLOAD"));
-		g_ptr_array_add (array, g_strdup ("1"));
+	data = user_data;
+	g_clear_handle_id (&data->probe_timeout_id, g_source_remove);
 
-		/* Make sure Vulkan apps always select Nvidia GPUs */
-		g_ptr_array_add (array, g_strdup ("__VK_LAYER_NV_optimus"));
-		g_ptr_array_add (array, g_strdup ("NVIDIA_only"));
-	} else {
-		char *id;
+	result = g_key_file_new ();
+	if (error == NULL &&
+	    g_subprocess_get_successful (subprocess) &&
+	    g_key_file_load_from_data (result, output, -1, G_KEY_FILE_NONE, NULL))
+		keys = g_key_file_get_keys (result, "Graphics", NULL, NULL);
 
-		/* See the Mesa loader code:
-		 * https://gitlab.freedesktop.org/mesa/mesa/blob/master/src/loader/loader.c#L322 */
-		id = g_strdup (g_udev_device_get_property (dev, "ID_PATH_TAG"));
-		if (id != NULL) {
-			g_ptr_array_add (array, g_strdup ("DRI_PRIME"));
-			g_ptr_array_add (array, id);
-		}
+	if (keys == NULL) {
+		g_debug ("Could not probe graphics APIs for '%s'", data->probe_key);
+		g_hash_table_add (data->graphics_failed, g_steal_pointer (&data->probe_key));
+		g_clear_object (&data->probe);
+		start_graphics_probe (data);
+		return;
 	}
 
-	if (array->len == 0) {
-		g_ptr_array_free (array, TRUE);
-		return NULL;
+	g_debug ("Probed graphics APIs for '%s'", data->probe_key);
+	for (i = 0; keys[i] != NULL; i++) {
+		g_autofree char *value = NULL;
+
+		value = g_key_file_get_value (result, "Graphics", keys[i], NULL);
+		g_key_file_set_value (data->graphics_cache, data->probe_key, keys[i], value);
 	}
+	if (!g_key_file_save_to_file (data->graphics_cache, data->graphics_cache_path, &error))
+		g_warning ("Could not save graphics capabilities: %s", error->message);
 
-	return array;
+	g_clear_pointer (&data->probe_key, g_free);
+	g_clear_object (&data->probe);
+
+	/* Publishes the result, and probes the next GPU */
+	refresh_cards (data);
 }
 
+/* Only when we were started as a systemd service ourselves */
 static char *
-get_card_name (GUdevDevice *d)
+get_systemd_run (void)
 {
-	const char *vendor, *product;
-	g_autoptr(GUdevDevice) parent = NULL;
-	g_autofree char *renderer = NULL;
-
-	parent = g_udev_device_get_parent (d);
-	vendor = g_udev_device_get_property (parent, "SWITCHEROO_CONTROL_VENDOR_NAME");
-	if (!vendor || *vendor == '\0')
-		vendor = g_udev_device_get_property (parent, "ID_VENDOR_FROM_DATABASE");
-	product = g_udev_device_get_property (parent, "SWITCHEROO_CONTROL_PRODUCT_NAME");
-	if (!product || *product == '\0')
-		product = g_udev_device_get_property (parent, "ID_MODEL_FROM_DATABASE");
-
-	if (!vendor && !product)
-		goto bail;
-
-	if (!vendor)
-		return g_strdup (product);
-	if (!product)
-		return g_strdup (vendor);
-	renderer = g_strdup_printf ("%s %s", vendor, product);
-	return info_cleanup (renderer);
-
-bail:
-	return g_strdup ("Unknown Graphics Controller");
+	if (g_getenv ("INVOCATION_ID") == NULL)
+		return NULL;
+	return g_find_program_in_path ("systemd-run");
 }
 
 static gboolean
-get_card_is_default (GUdevDevice *d)
+spawn_graphics_probe (ControlData *data,
+		      CardData    *card)
 {
-	g_autoptr(GUdevDevice) parent = NULL;
+	g_autoptr(GSubprocessLauncher) launcher = NULL;
+	g_autoptr(GPtrArray) argv = NULL;
+	g_autoptr(GPtrArray) envp = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autofree char *systemd_run = NULL;
+	const char *helper;
+	guint i;
 
-	parent = g_udev_device_get_parent (d);
-	return g_udev_device_get_sysfs_attr_as_boolean (parent, "boot_vga");
-}
+	helper = g_getenv ("SWITCHEROO_CONTROL_PROBE");
+	if (helper == NULL) {
+		helper = LIBEXECDIR "/switcheroo-control-probe";
+		systemd_run = get_systemd_run ();
+	}
 
-static CardData *
-get_card_data (GUdevClient *client,
-	       GUdevDevice *d)
-{
-	CardData *data;
-	GPtrArray *env;
+	argv = g_ptr_array_new_with_free_func (g_free);
+	/* Our service unit sets MemoryDenyWriteExecute=, which the shader
+	 * compilers in software renderers like llvmpipe and lavapipe can't
+	 * run under, so run the helper in its own transient unit */
+	if (systemd_run != NULL) {
+		g_ptr_array_add (argv, g_steal_pointer (&systemd_run));
+		g_ptr_array_add (argv, g_strdup ("--quiet"));
+		g_ptr_array_add (argv, g_strdup ("--pipe"));
+		g_ptr_array_add (argv, g_strdup ("--collect"));
+		g_ptr_array_add (argv, g_strdup ("--service-type=exec"));
+		g_ptr_array_add (argv, g_strdup_printf ("--property=RuntimeMaxSec=%u", PROBE_TIMEOUT_SECS));
+		g_ptr_array_add (argv, g_strdup ("--property=ProtectSystem=strict"));
+		g_ptr_array_add (argv, g_strdup ("--property=ProtectHome=true"));
+		g_ptr_array_add (argv, g_strdup ("--property=PrivateTmp=true"));
+		g_ptr_array_add (argv, g_strdup ("--property=PrivateNetwork=true"));
+		g_ptr_array_add (argv, g_strdup ("--setenv=MESA_SHADER_CACHE_DISABLE=true"));
+		for (i = 0; i + 1 < card->env->len; i += 2)
+			g_ptr_array_add (argv, g_strdup_printf ("--setenv=%s=%s",
+								(const char *) card->env->pdata[i],
+								(const char *) card->env->pdata[i + 1]));
+		g_ptr_array_add (argv, g_strdup ("--"));
+	}
+	g_ptr_array_add (argv, g_strdup (helper));
+	if (card->dev != NULL)
+		g_ptr_array_add (argv, g_strdup_printf ("--render-node=%s",
+							g_udev_device_get_device_file (card->dev)));
+	if (card->pci_slot != NULL)
+		g_ptr_array_add (argv, g_strdup_printf ("--pci-slot=%s", card->pci_slot));
+	g_ptr_array_add (argv, NULL);
 
-	env = get_card_env (client, d);
-	if (!env)
-		return NULL;
+	/* Only what the drivers need, and nothing from our own environment */
+	envp = g_ptr_array_new_with_free_func (g_free);
+	g_ptr_array_add (envp, g_strdup ("MESA_SHADER_CACHE_DISABLE=true"));
+	for (i = 0; i + 1 < card->env->len; i += 2)
+		g_ptr_array_add (envp, g_strdup_printf ("%s=%s",
+							(const char *) card->env->pdata[i],
+							(const char *) card->env->pdata[i + 1]));
+	g_ptr_array_add (envp, NULL);
 
-	data = g_new0 (CardData, 1);
-	data->dev = g_object_ref (d);
-	data->name = get_card_name (d);
-	data->env = env;
-	data->is_default = get_card_is_default (d);
+	launcher = g_subprocess_launcher_new (G_SUBPROCESS_FLAGS_STDOUT_PIPE |
+					      G_SUBPROCESS_FLAGS_STDERR_SILENCE);
+	g_subprocess_launcher_set_environ (launcher, (char **) envp->pdata);
+	g_subprocess_launcher_set_cwd (launcher, "/");
+	data->probe = g_subprocess_launcher_spawnv (launcher,
+						    (const char * const *) argv->pdata,
+						    &error);
+	if (data->probe == NULL) {
+		g_debug ("Could not run graphics probe helper: %s", error->message);
+		return FALSE;
+	}
 
-	return data;
+	g_debug ("Probing graphics APIs for '%s'", card->graphics_key);
+	data->probe_key = g_strdup (card->graphics_key);
+	g_subprocess_communicate_utf8_async (data->probe, NULL, data->probe_cancellable,
+					     graphics_probe_done_cb, data);
+	data->probe_timeout_id = g_timeout_add_seconds (PROBE_TIMEOUT_SECS,
+							graphics_probe_timeout_cb, data);
+
+	return TRUE;
 }
 
+/* Probes one GPU at a time, skipping suspended ones, as initialising
+ * a driver would wake them up */
 static void
-add_fake_intel_card (GPtrArray *cards)
+start_graphics_probe (ControlData *data)
 {
-	CardData *card;
-	const char *env[] = {
-		"INTEL_AGP_OFFLOADING", "1",
-		"INTEL_PCI_MODE", "false",
-		NULL
-	};
 	guint i;
 
-	card = g_new0 (CardData, 1);
-	card->name = "Intel i740 “Auburn”";
-	card->env = g_ptr_array_new ();
-	for (i = 0; env[i] != NULL; i++)
-		g_ptr_array_add (card->env, g_strdup (env[i]));
+	if (!data->probe_graphics || data->probe != NULL)
+		return;
 
-	g_ptr_array_add (cards, card);
+	for (i = 0; i < data->cards->len; i++) {
+		CardData *card = data->cards->pdata[i];
+
+		if (card->graphics_key == NULL ||
+		    card->graphics != NULL ||
+		    card->unavailable != NULL ||
+		    g_hash_table_contains (data->graphics_failed, card->graphics_key))
+			continue;
+		if (card->dev != NULL && !get_card_is_awake (card->dev))
+			continue;
+
+		if (spawn_graphics_probe (data, card))
+			return;
+		g_hash_table_add (data->graphics_failed, g_strdup (card->graphics_key));
+	}
 }
 
 static void
-add_fake_trident_card (GPtrArray *cards)
+want_card_details (ControlData *data)
 {
-	CardData *card;
-	const char *env[] = {
-		"TRIDENT_OFFLOADING", "1",
-		NULL
-	};
-	guint i;
-
-	card = g_new0 (CardData, 1);
-	card->name = "Trident Vesa Local Bus 512KB";
-	card->env = g_ptr_array_new ();
-	for (i = 0; env[i] != NULL; i++)
-		g_ptr_array_add (card->env, g_strdup (env[i]));
+	if (data->details_wanted)
+		return;
 
-	g_ptr_array_add (cards, card);
+	data->details_wanted = TRUE;
+	ensure_card_details (data, data->cards);
+	start_graphics_probe (data);
 }
 
-static GPtrArray *
-get_drm_cards (ControlData *data)
+static void
+refresh_cards (ControlData *data)
 {
-	GList *devices, *l;
-	GPtrArray *cards;
+	GPtrArray *cards, *accels;
+	MuxMode old_mux_mode;
+	gboolean changed = FALSE;
+	guint num_gpus;
 
-	cards = g_ptr_array_new_with_free_func ((GDestroyNotify) free_card_data);
+	watchdog_begin (data->watchdog, "GPU rescan");
+	data->num_rescans++;
+	old_mux_mode = data->mux_mode;
+	cards = get_drm_cards (data);
+	if (data->details_wanted)
+		ensure_card_details (data, cards);
+	/* Otherwise the freshly scanned GPUs would always look different
+	 * from ones with a link health, or that are favoured */
+	update_cards_link_health (data, cards);
+	update_cards_preferred (data, cards);
+	num_gpus = count_available_cards (cards);
+	if (old_mux_mode != data->mux_mode ||
+	    cards_changed (data->cards, cards)) {
+		if (num_gpus != data->num_gpus)
+			g_debug ("GPUs added or removed (old: %d new: %d)",
+				 data->num_gpus, num_gpus);
+		else
+			g_debug ("GPUs changed (MUX mode: %s)",
+				 mux_mode_to_str (data->mux_mode));
+		g_ptr_array_free (data->cards, TRUE);
+		data->cards = cards;
+		data->num_gpus = num_gpus;
+		if (data->cdi_spec_dir)
+			write_gpus_cdi_spec (data);
+		prune_telemetry_rings (data);
+		prune_perf_controls (data);
+		update_aer_monitors (data);
+		update_histories (data);
+		update_energy_tracker (data);
+		update_imbalance_detection (data);
+		changed = TRUE;
+	} else {
+		g_ptr_array_free (cards, TRUE);
+	}
+
+	accels = get_accel_cards (data);
+	if (accels_changed (data->accels, accels)) {
+		g_debug ("Accelerators changed (old: %d new: %d)",
+			 data->accels->len, accels->len);
+		g_ptr_array_free (data->accels, TRUE);
+		data->accels = accels;
+		if (data->cdi_spec_dir)
+			write_accels_cdi_spec (data);
+		changed = TRUE;
+	} else {
+		g_ptr_array_free (accels, TRUE);
+	}
 
-	if (data->add_fake_cards)
-		add_fake_intel_card (cards);
+	if (changed)
+		send_dbus_event (data);
 
-	devices = g_udev_client_query_by_subsystem (data->client, "drm");
-	for (l = devices; l != NULL; l = l->next) {
-		GUdevDevice *d = l->data;
-		const char *path;
+	start_graphics_probe (data);
+	watchdog_end (data->watchdog);
+}
 
-		path = g_udev_device_get_device_file (d);
-		if (path != NULL &&
-		    g_str_has_prefix (path, "/dev/dri/render")) {
-			CardData *card;
-			card = get_card_data (data->client, d);
-			if (card)
-				g_ptr_array_add (cards, card);
-		}
-		g_object_unref (d);
-	}
-	g_list_free (devices);
+/* Display controllers, PCI class 0x03 */
+static gboolean
+is_pci_gpu (GUdevDevice *device)
+{
+	const char *pci_class;
 
-	if (data->add_fake_cards)
-		add_fake_trident_card (cards);
+	pci_class = g_udev_device_get_property (device, "PCI_CLASS");
+	return pci_class != NULL && strlen (pci_class) == 5 && pci_class[0] == '3';
+}
 
-	/* Make sure the only card is the default */
-	if (cards->len == 1) {
-		CardData *card = cards->pdata[0];
-		card->is_default = TRUE;
-	}
+/* We only listen to the platform and firmware-attributes subsystems
+ * for MUX switches, and to the PCI subsystem for GPUs changing drivers,
+ * don't rescan for every other device in them */
+static gboolean
+uevent_is_relevant (ControlData *data,
+		    const char  *action,
+		    GUdevDevice *device)
+{
+	const char *subsystem = g_udev_device_get_subsystem (device);
 
-	return cards;
+	if (g_strcmp0 (subsystem, "platform") == 0 ||
+	    g_strcmp0 (subsystem, "firmware-attributes") == 0)
+		return is_mux_device (device);
+	if (g_strcmp0 (subsystem, "pci") == 0)
+		return (g_strcmp0 (action, "bind") == 0 ||
+			g_strcmp0 (action, "unbind") == 0 ||
+			g_strcmp0 (action, "remove") == 0) &&
+			is_pci_gpu (device);
+
+	return TRUE;
 }
 
 static void
@@ -418,34 +4456,72 @@ uevent_cb (GUdevClient *client,
 	   gpointer     user_data)
 {
 	ControlData *data = user_data;
-	GPtrArray *cards;
-	guint num_gpus;
 
-	cards = get_drm_cards (data);
-	num_gpus = cards->len;
-	if (num_gpus != data->num_gpus) {
-		g_debug ("GPUs added or removed (old: %d new: %d)",
-			 data->num_gpus, num_gpus);
-		g_ptr_array_free (data->cards, TRUE);
-		data->cards = cards;
-		data->num_gpus = cards->len;
-		send_dbus_event (data);
-	} else {
-		g_ptr_array_free (cards, TRUE);
+	data->num_uevents++;
+	if (!uevent_is_relevant (data, action, device)) {
+		g_debug ("Ignoring %s uevent for %s", action, g_udev_device_get_sysfs_path (device));
+		return;
 	}
+
+	watchdog_begin (data->watchdog, "udev event");
+	refresh_cards (data);
+	watchdog_end (data->watchdog);
+}
+
+static void
+simulation_changed_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	refresh_cards (data);
 }
 
 static void
 get_num_gpus (ControlData *data)
 {
-	const gchar * const subsystem[] = { "drm", NULL };
+	const gchar * const subsystem[] = { "drm", "accel", "pci", "platform", "firmware-attributes", NULL };
+	gboolean details_wanted = FALSE;
 
 	data->client = g_udev_client_new (subsystem);
+	data->known_cards = g_hash_table_new_full (g_str_hash, g_str_equal,
+						   g_free, (GDestroyNotify) free_known_card);
+	setup_drm_caps_cache (data);
+	if (data->probe_graphics)
+		setup_graphics_cache (data);
+	restore_handover_state (data);
+	setup_perf_state (data);
 	data->cards = get_drm_cards (data);
-	data->num_gpus = data->cards->len;
+	data->num_gpus = count_available_cards (data->cards);
+	update_aer_monitors (data);
+	update_histories (data);
+	update_energy_tracker (data);
+	update_imbalance_detection (data);
+	data->accels = get_accel_cards (data);
+	if (data->cdi_spec_dir) {
+		write_gpus_cdi_spec (data);
+		write_accels_cdi_spec (data);
+	}
 
 	g_signal_connect (G_OBJECT (data->client), "uevent",
 			  G_CALLBACK (uevent_cb), data);
+	/* Clients of the instance we replaced already asked for details */
+	if (data->handover != NULL &&
+	    g_variant_lookup (data->handover, "DetailsWanted", "b", &details_wanted) &&
+	    details_wanted)
+		want_card_details (data);
+	g_clear_pointer (&data->handover, g_variant_unref);
+	if (data->simulation != NULL)
+		simulation_start (data->simulation, simulation_changed_cb, data);
+}
+
+static gboolean
+quit_signal_cb (gpointer user_data)
+{
+	ControlData *data = user_data;
+
+	g_debug ("Exiting on signal");
+	g_main_loop_quit (data->loop);
+	return G_SOURCE_REMOVE;
 }
 
 int main (int argc, char **argv)
@@ -455,12 +4531,49 @@ int main (int argc, char **argv)
 	g_autoptr(GError) error = NULL;
 	gboolean verbose = FALSE;
 	gboolean add_fake_cards = FALSE;
+	g_autofree char *simulate = NULL;
+	Simulation *simulation = NULL;
+	gboolean vga_switcheroo = FALSE;
+	gboolean software_gpu = FALSE;
+	g_autofree char *cdi_spec_dir = NULL;
+	gboolean probe_graphics = FALSE;
+	g_autofree char *metrics_file = NULL;
+	g_autofree char *history_dir = NULL;
+	gint metrics_interval = 60;
+	gint telemetry_interval = 100;
+	gint rate_limit = 0;
+	gint rate_burst = 200;
+	gint stall_threshold = 1000;
+	gint max_boost_duration = 0;
+	gint aer_interval = 0;
+	gint aer_threshold = 10;
+	gint energy_interval = 0;
+	gint rebalance_period = 0;
+	gint imbalance_duration = 30;
 	gboolean replace = FALSE;
 	gboolean ret;
 	const GOptionEntry options[] = {
 		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Show extra debugging information", NULL },
 		{ "fake", 'f', 0, G_OPTION_ARG_NONE, &add_fake_cards, "Add fake GPUs to the output", NULL },
+		{ "simulate", 0, 0, G_OPTION_ARG_FILENAME, &simulate, "Simulate the GPUs described in FILE", "FILE" },
 		{ "replace", 'r', 0, G_OPTION_ARG_NONE, &replace, "Replace the running instance of switcheroo-control", NULL },
+		{ "vga-switcheroo", 0, 0, G_OPTION_ARG_NONE, &vga_switcheroo, "Allow controlling the legacy vga_switcheroo mux", NULL },
+		{ "software-gpu", 0, 0, G_OPTION_ARG_NONE, &software_gpu, "Add a software rendering GPU if there are no GPUs", NULL },
+		{ "probe-graphics", 0, 0, G_OPTION_ARG_NONE, &probe_graphics, "Probe the OpenGL and Vulkan support of GPUs", NULL },
+		{ "metrics-file", 0, 0, G_OPTION_ARG_FILENAME, &metrics_file, "Export OpenMetrics to FILE", "FILE" },
+		{ "metrics-interval", 0, 0, G_OPTION_ARG_INT, &metrics_interval, "Check for metrics changes every SECS seconds (default: 60)", "SECS" },
+		{ "telemetry-interval", 0, 0, G_OPTION_ARG_INT, &telemetry_interval, "Sample GPU telemetry every MSECS milliseconds while it has readers (default: 100)", "MSECS" },
+		{ "rate-limit", 0, 0, G_OPTION_ARG_INT, &rate_limit, "Limit each client to N requests per second, 0 to disable (default: 0)", "N" },
+		{ "rate-burst", 0, 0, G_OPTION_ARG_INT, &rate_burst, "Allow bursts of N requests over the rate limit (default: 200)", "N" },
+		{ "max-boost-duration", 0, 0, G_OPTION_ARG_INT, &max_boost_duration, "Allow clients to change GPU performance levels for up to SECS seconds, 0 to disable (default: 0)", "SECS" },
+		{ "aer-interval", 0, 0, G_OPTION_ARG_INT, &aer_interval, "Check the GPUs' PCIe error counters every SECS seconds, 0 to disable (default: 0)", "SECS" },
+		{ "aer-threshold", 0, 0, G_OPTION_ARG_INT, &aer_threshold, "Consider PCIe links with N or more correctable errors per minute degraded (default: 10)", "N" },
+		{ "energy-interval", 0, 0, G_OPTION_ARG_INT, &energy_interval, "Account the GPU usage and energy of applications and cgroups every SECS seconds, 0 to disable (default: 0)", "SECS" },
+		{ "rebalance-period", 0, 0, G_OPTION_ARG_INT, &rebalance_period, "Favour an idle discrete GPU for SECS seconds when another is saturated, 0 to disable (default: 0)", "SECS" },
+		{ "imbalance-duration", 0, 0, G_OPTION_ARG_INT, &imbalance_duration, "Only rebalance after discrete GPUs were imbalanced for SECS seconds (default: 30)", "SECS" },
+		{ "history-dir", 0, 0, G_OPTION_ARG_FILENAME, &history_dir, "Keep a history of the GPUs' usage in DIR", "DIR" },
+		{ "stall-threshold", 0, 0, G_OPTION_ARG_INT, &stall_threshold, "Report main loop stalls longer than MSECS milliseconds (default: 1000)", "MSECS" },
+		{ "cdi-spec-dir", 0, 0, G_OPTION_ARG_FILENAME, &cdi_spec_dir, "Write Container Device Interface specs to DIR", "DIR" },
 		{ NULL}
 	};
 
@@ -477,16 +4590,95 @@ int main (int argc, char **argv)
 	if (verbose)
 		g_setenv ("G_MESSAGES_DEBUG", "all", TRUE);
 
+	if (metrics_interval <= 0) {
+		g_print ("Failed to parse arguments: --metrics-interval should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (rate_limit < 0 || rate_burst <= 0) {
+		g_print ("Failed to parse arguments: --rate-limit and --rate-burst should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (stall_threshold <= 0) {
+		g_print ("Failed to parse arguments: --stall-threshold should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (aer_interval < 0 || aer_threshold <= 0) {
+		g_print ("Failed to parse arguments: --aer-interval and --aer-threshold should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (rebalance_period < 0 || imbalance_duration <= 0) {
+		g_print ("Failed to parse arguments: --rebalance-period and --imbalance-duration should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (energy_interval < 0) {
+		g_print ("Failed to parse arguments: --energy-interval should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (max_boost_duration < 0) {
+		g_print ("Failed to parse arguments: --max-boost-duration should be positive\n");
+		return EXIT_FAILURE;
+	}
+	if (telemetry_interval < 10) {
+		g_print ("Failed to parse arguments: --telemetry-interval should be at least 10\n");
+		return EXIT_FAILURE;
+	}
+
+	if (history_dir != NULL && g_mkdir_with_parents (history_dir, 0755) < 0) {
+		g_print ("Failed to create history directory %s: %s\n", history_dir, g_strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	if (add_fake_cards && simulate != NULL) {
+		g_print ("Failed to parse arguments: --fake and --simulate are mutually exclusive\n");
+		return EXIT_FAILURE;
+	}
+	if (add_fake_cards)
+		simulation = simulation_new_for_data (fake_topology, &error);
+	else if (simulate != NULL)
+		simulation = simulation_new_for_file (simulate, &error);
+	if (error != NULL) {
+		g_print ("Failed to load simulation: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
 	data = g_new0 (ControlData, 1);
-	data->add_fake_cards = add_fake_cards;
+	data->simulation = simulation;
+	data->vga_switcheroo = vga_switcheroo;
+	data->software_gpu = software_gpu;
+	data->cdi_spec_dir = g_steal_pointer (&cdi_spec_dir);
+	data->probe_graphics = probe_graphics;
+	data->metrics_file = g_steal_pointer (&metrics_file);
+	data->telemetry_interval = telemetry_interval;
+	data->rate_limit = rate_limit;
+	data->rate_burst = rate_burst;
+	data->max_boost_duration = max_boost_duration;
+	data->aer_interval = aer_interval;
+	data->aer_threshold = aer_threshold;
+	data->history_dir = g_steal_pointer (&history_dir);
+	data->energy_interval = energy_interval;
+	data->rebalance_period = rebalance_period;
+	data->imbalance_duration = imbalance_duration;
+	data->watchdog = watchdog_new (stall_threshold);
 
+	/* Carry on from the running instance's state, so that we can
+	 * answer straight away, and only signal what really changed */
+	if (replace)
+		request_handover (data);
 	get_num_gpus (data);
 	setup_dbus (data, replace);
 	data->init_done = TRUE;
 	if (data->connection)
 		send_dbus_event (data);
 
+	if (data->metrics_file) {
+		write_metrics (data);
+		data->metrics_timeout_id = g_timeout_add_seconds (metrics_interval, metrics_timeout_cb, data);
+	}
+
 	data->loop = g_main_loop_new (NULL, TRUE);
+	/* So that performance settings get restored when stopped */
+	g_unix_signal_add (SIGTERM, quit_signal_cb, data);
+	g_unix_signal_add (SIGINT, quit_signal_cb, data);
 	g_main_loop_run (data->loop);
 
 	free_control_data (data);
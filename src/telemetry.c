@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gio/gio.h>
+
+#include "telemetry.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+G_STATIC_ASSERT (sizeof (TelemetryHeader) == 40);
+G_STATIC_ASSERT (sizeof (TelemetrySample) == 64);
+
+typedef enum {
+	ATTR_RUNTIME_STATUS,
+	ATTR_BUSY,
+	ATTR_MEM_BUSY,
+	ATTR_VRAM_USED,
+	ATTR_VRAM_TOTAL,
+	ATTR_TEMPERATURE,
+	ATTR_POWER,
+	ATTR_FREQUENCY,
+	NUM_ATTRS
+} TelemetryAttr;
+
+struct _TelemetryRing {
+	char *device_path;
+	int fd;
+	gboolean write_sealed;
+	gsize size;
+	TelemetryHeader *header;
+	TelemetrySample *samples;
+	/* Kept open, so that sampling is a single pread() per attribute */
+	int attrs[NUM_ATTRS];
+};
+
+static int
+open_attr (const char *dir,
+	   const char *name)
+{
+	g_autofree char *path = NULL;
+
+	path = g_build_filename (dir, name, NULL);
+	return open (path, O_RDONLY | O_CLOEXEC);
+}
+
+char *
+find_hwmon_path (const char *device_path)
+{
+	g_autofree char *hwmon_dir = NULL;
+	g_autoptr(GDir) dir = NULL;
+	const char *name;
+
+	hwmon_dir = g_build_filename (device_path, "hwmon", NULL);
+	dir = g_dir_open (hwmon_dir, 0, NULL);
+	if (dir == NULL)
+		return NULL;
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		if (g_str_has_prefix (name, "hwmon"))
+			return g_build_filename (hwmon_dir, name, NULL);
+	}
+	return NULL;
+}
+
+static void
+open_attrs (TelemetryRing *ring)
+{
+	g_autofree char *hwmon_path = NULL;
+
+	ring->attrs[ATTR_RUNTIME_STATUS] = open_attr (ring->device_path, "power/runtime_status");
+	ring->attrs[ATTR_BUSY] = open_attr (ring->device_path, "gpu_busy_percent");
+	ring->attrs[ATTR_MEM_BUSY] = open_attr (ring->device_path, "mem_busy_percent");
+	ring->attrs[ATTR_VRAM_USED] = open_attr (ring->device_path, "mem_info_vram_used");
+	ring->attrs[ATTR_VRAM_TOTAL] = open_attr (ring->device_path, "mem_info_vram_total");
+
+	hwmon_path = find_hwmon_path (ring->device_path);
+	if (hwmon_path == NULL) {
+		ring->attrs[ATTR_TEMPERATURE] = -1;
+		ring->attrs[ATTR_POWER] = -1;
+		ring->attrs[ATTR_FREQUENCY] = -1;
+		return;
+	}
+	ring->attrs[ATTR_TEMPERATURE] = open_attr (hwmon_path, "temp1_input");
+	ring->attrs[ATTR_POWER] = open_attr (hwmon_path, "power1_average");
+	if (ring->attrs[ATTR_POWER] < 0)
+		ring->attrs[ATTR_POWER] = open_attr (hwmon_path, "power1_input");
+	ring->attrs[ATTR_FREQUENCY] = open_attr (hwmon_path, "freq1_input");
+}
+
+static gboolean
+create_memfd (TelemetryRing  *ring,
+	      GError        **error)
+{
+	int seals;
+
+	ring->fd = memfd_create ("switcheroo-telemetry", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (ring->fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not create memfd: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	ring->size = sizeof (TelemetryHeader) + TELEMETRY_NUM_SLOTS * sizeof (TelemetrySample);
+	if (ftruncate (ring->fd, ring->size) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not size memfd: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	ring->header = mmap (NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if (ring->header == MAP_FAILED) {
+		ring->header = NULL;
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not map memfd: %s", g_strerror (errno));
+		return FALSE;
+	}
+	ring->samples = (TelemetrySample *) (ring->header + 1);
+
+	/* Our own mapping stays writable, but nobody else can write to
+	 * the ring, or resize it under the readers' feet. Kernels older
+	 * than 5.1 don't support sealing future writes, in which case
+	 * readers get a read-only file description instead */
+	seals = F_SEAL_SHRINK | F_SEAL_GROW;
+	if (fcntl (ring->fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == 0) {
+		ring->write_sealed = TRUE;
+	} else if (fcntl (ring->fd, F_ADD_SEALS, seals) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not seal memfd: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+TelemetryRing *
+telemetry_ring_new (const char  *device_path,
+		    guint        interval_ms,
+		    GError     **error)
+{
+	TelemetryRing *ring;
+	guint i;
+
+	ring = g_new0 (TelemetryRing, 1);
+	ring->device_path = g_strdup (device_path);
+	ring->fd = -1;
+	for (i = 0; i < NUM_ATTRS; i++)
+		ring->attrs[i] = -1;
+
+	if (!create_memfd (ring, error)) {
+		telemetry_ring_free (ring);
+		return NULL;
+	}
+
+	ring->header->magic = TELEMETRY_MAGIC;
+	ring->header->version = TELEMETRY_VERSION;
+	ring->header->header_size = sizeof (TelemetryHeader);
+	ring->header->sample_size = sizeof (TelemetrySample);
+	ring->header->num_slots = TELEMETRY_NUM_SLOTS;
+	ring->header->interval_ms = interval_ms;
+	ring->header->state = TELEMETRY_STATE_PAUSED;
+
+	open_attrs (ring);
+
+	return ring;
+}
+
+void
+telemetry_ring_free (TelemetryRing *ring)
+{
+	guint i;
+
+	if (ring == NULL)
+		return;
+
+	/* Readers keep their mappings, and see that the ring is done */
+	if (ring->header != NULL) {
+		telemetry_ring_set_state (ring, TELEMETRY_STATE_CLOSED);
+		munmap (ring->header, ring->size);
+	}
+	if (ring->fd >= 0)
+		close (ring->fd);
+	for (i = 0; i < NUM_ATTRS; i++) {
+		if (ring->attrs[i] >= 0)
+			close (ring->attrs[i]);
+	}
+	g_free (ring->device_path);
+	g_free (ring);
+}
+
+const char *
+telemetry_ring_get_path (TelemetryRing *ring)
+{
+	return ring->device_path;
+}
+
+int
+telemetry_ring_dup_fd (TelemetryRing  *ring,
+		       GError        **error)
+{
+	g_autofree char *path = NULL;
+	int fd;
+
+	if (ring->write_sealed) {
+		fd = fcntl (ring->fd, F_DUPFD_CLOEXEC, 3);
+	} else {
+		path = g_strdup_printf ("/proc/self/fd/%d", ring->fd);
+		fd = open (path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0)
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "Could not duplicate memfd: %s", g_strerror (errno));
+	return fd;
+}
+
+void
+telemetry_ring_set_state (TelemetryRing  *ring,
+			  TelemetryState  state)
+{
+	__atomic_store_n (&ring->header->state, state, __ATOMIC_RELEASE);
+}
+
+static gboolean
+read_attr (int    fd,
+	   char  *buf,
+	   gsize  size)
+{
+	ssize_t len;
+
+	if (fd < 0)
+		return FALSE;
+	len = pread (fd, buf, size - 1, 0);
+	if (len <= 0)
+		return FALSE;
+	buf[len] = '\0';
+	return TRUE;
+}
+
+static gboolean
+read_attr_u64 (int      fd,
+	       guint64 *value)
+{
+	char buf[32];
+	char *end;
+
+	if (!read_attr (fd, buf, sizeof (buf)))
+		return FALSE;
+	*value = g_ascii_strtoull (buf, &end, 10);
+	return end != buf;
+}
+
+static gboolean
+read_attr_s64 (int     fd,
+	       gint64 *value)
+{
+	char buf[32];
+	char *end;
+
+	if (!read_attr (fd, buf, sizeof (buf)))
+		return FALSE;
+	*value = g_ascii_strtoll (buf, &end, 10);
+	return end != buf;
+}
+
+static void
+read_sample (TelemetryRing   *ring,
+	     TelemetrySample *sample)
+{
+	char status[32];
+	guint64 value, total;
+	gint64 temperature;
+
+	/* Reading most attributes of a runtime suspended GPU would wake it up */
+	if (read_attr (ring->attrs[ATTR_RUNTIME_STATUS], status, sizeof (status)) &&
+	    !g_str_has_prefix (status, "active")) {
+		sample->flags |= TELEMETRY_SUSPENDED;
+		return;
+	}
+
+	if (read_attr_u64 (ring->attrs[ATTR_BUSY], &value)) {
+		sample->busy_percent = value;
+		sample->flags |= TELEMETRY_HAS_BUSY;
+	}
+	if (read_attr_u64 (ring->attrs[ATTR_MEM_BUSY], &value)) {
+		sample->mem_busy_percent = value;
+		sample->flags |= TELEMETRY_HAS_MEM_BUSY;
+	}
+	if (read_attr_u64 (ring->attrs[ATTR_VRAM_USED], &value) &&
+	    read_attr_u64 (ring->attrs[ATTR_VRAM_TOTAL], &total)) {
+		sample->vram_used = value;
+		sample->vram_total = total;
+		sample->flags |= TELEMETRY_HAS_VRAM;
+	}
+	if (read_attr_s64 (ring->attrs[ATTR_TEMPERATURE], &temperature)) {
+		sample->temperature_mc = temperature;
+		sample->flags |= TELEMETRY_HAS_TEMPERATURE;
+	}
+	if (read_attr_u64 (ring->attrs[ATTR_POWER], &value)) {
+		sample->power_uw = value;
+		sample->flags |= TELEMETRY_HAS_POWER;
+	}
+	if (read_attr_u64 (ring->attrs[ATTR_FREQUENCY], &value)) {
+		sample->frequency_hz = value;
+		sample->flags |= TELEMETRY_HAS_FREQUENCY;
+	}
+}
+
+/* Only for the writer, which doesn't need to retry */
+gboolean
+telemetry_ring_get_latest (TelemetryRing   *ring,
+			   TelemetrySample *sample)
+{
+	guint64 head = ring->header->head;
+
+	if (head == 0)
+		return FALSE;
+	*sample = ring->samples[(head - 1) % TELEMETRY_NUM_SLOTS];
+	return TRUE;
+}
+
+void
+telemetry_ring_sample (TelemetryRing *ring)
+{
+	TelemetrySample sample = { 0, };
+	TelemetrySample *slot;
+	guint64 head, seq;
+
+	sample.timestamp_us = g_get_monotonic_time ();
+	read_sample (ring, &sample);
+
+	/* Single writer seqlock: the slot's sequence number is odd
+	 * while it's being written to */
+	head = ring->header->head;
+	slot = &ring->samples[head % TELEMETRY_NUM_SLOTS];
+	seq = slot->seq;
+	sample.seq = seq + 2;
+	__atomic_store_n (&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	memcpy ((char *) slot + sizeof (slot->seq),
+		(char *) &sample + sizeof (sample.seq),
+		sizeof (sample) - sizeof (sample.seq));
+	__atomic_store_n (&slot->seq, sample.seq, __ATOMIC_RELEASE);
+	__atomic_store_n (&ring->header->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Layout of the shared-memory telemetry ring of a GPU, as handed out
+ * by the OpenTelemetry D-Bus method. The daemon is the only writer,
+ * readers map the file descriptor read-only.
+ *
+ * To read the latest sample, load "head" with acquire semantics. If it
+ * is 0, no samples were written yet, otherwise the latest sample is in
+ * slot (head - 1) % num_slots. Load the slot's "seq", copy the sample,
+ * and load "seq" again. If it was odd, or changed, the slot was being
+ * overwritten and the read should be retried.
+ */
+
+#define TELEMETRY_MAGIC   0x52545753 /* "SWTR" */
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_NUM_SLOTS 128
+
+typedef enum {
+	TELEMETRY_STATE_RUNNING = 0,
+	/* No readers are left, samples are stale */
+	TELEMETRY_STATE_PAUSED  = 1,
+	/* The GPU went away, no more samples will be written */
+	TELEMETRY_STATE_CLOSED  = 2
+} TelemetryState;
+
+typedef enum {
+	TELEMETRY_HAS_BUSY        = 1 << 0,
+	TELEMETRY_HAS_MEM_BUSY    = 1 << 1,
+	TELEMETRY_HAS_VRAM        = 1 << 2,
+	TELEMETRY_HAS_TEMPERATURE = 1 << 3,
+	TELEMETRY_HAS_POWER       = 1 << 4,
+	TELEMETRY_HAS_FREQUENCY   = 1 << 5
+} TelemetryFlags;
+
+/* The GPU was runtime suspended, and was not woken up. Outside of
+ * TelemetryFlags, as enum values need to fit in an int */
+#define TELEMETRY_SUSPENDED       (1u << 31)
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 header_size;
+	guint32 sample_size;
+	guint32 num_slots;
+	guint32 interval_ms;
+	guint32 state;
+	guint32 padding;
+	guint64 head;
+} TelemetryHeader;
+
+typedef struct {
+	guint64 seq;
+	guint64 timestamp_us;     /* CLOCK_MONOTONIC */
+	guint32 flags;            /* TelemetryFlags */
+	guint32 busy_percent;
+	guint32 mem_busy_percent;
+	gint32  temperature_mc;   /* millidegrees Celsius */
+	guint64 power_uw;
+	guint64 frequency_hz;
+	guint64 vram_used;        /* bytes */
+	guint64 vram_total;       /* bytes */
+} TelemetrySample;
+
+typedef struct _TelemetryRing TelemetryRing;
+
+TelemetryRing *telemetry_ring_new        (const char     *device_path,
+					  guint           interval_ms,
+					  GError        **error);
+void           telemetry_ring_free       (TelemetryRing  *ring);
+const char    *telemetry_ring_get_path   (TelemetryRing  *ring);
+int            telemetry_ring_dup_fd     (TelemetryRing  *ring,
+					  GError        **error);
+void           telemetry_ring_set_state  (TelemetryRing  *ring,
+					  TelemetryState  state);
+void           telemetry_ring_sample     (TelemetryRing  *ring);
+gboolean       telemetry_ring_get_latest (TelemetryRing  *ring,
+					  TelemetrySample *sample);
+
+char          *find_hwmon_path           (const char     *device_path);
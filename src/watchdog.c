@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "watchdog.h"
+
+/*
+ * The main loop marks the start and end of each of its handlers, and
+ * a thread reports the handlers that run for longer than the stall
+ * threshold while they're still running. When nothing is running, the
+ * thread sleeps until the next handler starts.
+ *
+ * If systemd's watchdog is enabled, the thread also pings the main
+ * loop twice per watchdog period, and only feeds the watchdog if the
+ * previous ping was answered, and no handler is stalled.
+ */
+
+struct _Watchdog {
+	GThread *thread;
+	GMutex lock;
+	GCond cond;
+	gboolean quit;
+	GMainContext *context;
+
+	gint64 stall_threshold;
+
+	/* The handler currently running in the main loop */
+	guint depth;
+	const char *activity;
+	gint64 busy_since;
+	gboolean stall_reported;
+
+	/* systemd watchdog */
+	gint64 watchdog_usec;
+	gint64 next_feed;
+	guint64 ping_seq;
+	guint64 pong_seq;
+	gint64 ping_time;
+
+	/* Statistics */
+	guint64 num_stalls;
+	gint64 max_dispatch;
+	gint64 max_latency;
+};
+
+void
+notify_systemd (const char *state)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	const char *socket_path;
+	size_t len;
+	int fd;
+
+	socket_path = g_getenv ("NOTIFY_SOCKET");
+	if (socket_path == NULL)
+		return;
+	len = strlen (socket_path);
+	if ((socket_path[0] != '/' && socket_path[0] != '@') ||
+	    len >= sizeof (addr.sun_path))
+		return;
+
+	memcpy (addr.sun_path, socket_path, len);
+	/* Abstract namespace */
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if (sendto (fd, state, strlen (state), MSG_NOSIGNAL,
+		    (struct sockaddr *) &addr, offsetof (struct sockaddr_un, sun_path) + len) < 0)
+		g_debug ("Could not notify systemd of '%s': %s", state, g_strerror (errno));
+	close (fd);
+}
+
+static gint64
+get_watchdog_usec (void)
+{
+	const char *str;
+	guint64 pid;
+
+	str = g_getenv ("WATCHDOG_PID");
+	if (str != NULL) {
+		pid = g_ascii_strtoull (str, NULL, 10);
+		if (pid != (guint64) getpid ())
+			return 0;
+	}
+
+	str = g_getenv ("WATCHDOG_USEC");
+	if (str == NULL)
+		return 0;
+	return g_ascii_strtoll (str, NULL, 10);
+}
+
+static gboolean
+pong_cb (gpointer user_data)
+{
+	Watchdog *watchdog = user_data;
+
+	g_mutex_lock (&watchdog->lock);
+	watchdog->pong_seq = watchdog->ping_seq;
+	watchdog->max_latency = MAX (watchdog->max_latency,
+				     g_get_monotonic_time () - watchdog->ping_time);
+	g_mutex_unlock (&watchdog->lock);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* Called with the lock held */
+static void
+feed_watchdog (Watchdog *watchdog,
+	       gint64    now)
+{
+	g_autoptr(GSource) source = NULL;
+
+	if (watchdog->pong_seq != watchdog->ping_seq) {
+		g_warning ("Main loop did not answer within %" G_GINT64_FORMAT " ms, not feeding the watchdog",
+			   (now - watchdog->ping_time) / 1000);
+		return;
+	}
+	if (watchdog->stall_reported) {
+		g_debug ("Main loop stalled in %s, not feeding the watchdog", watchdog->activity);
+		return;
+	}
+
+	notify_systemd ("WATCHDOG=1");
+
+	watchdog->ping_seq++;
+	watchdog->ping_time = now;
+	source = g_idle_source_new ();
+	g_source_set_priority (source, G_PRIORITY_HIGH);
+	g_source_set_callback (source, pong_cb, watchdog, NULL);
+	g_source_attach (source, watchdog->context);
+}
+
+static gpointer
+watchdog_thread (gpointer user_data)
+{
+	Watchdog *watchdog = user_data;
+
+	g_mutex_lock (&watchdog->lock);
+	while (!watchdog->quit) {
+		gint64 now, deadline = G_MAXINT64;
+
+		now = g_get_monotonic_time ();
+
+		if (watchdog->busy_since != 0 && !watchdog->stall_reported) {
+			gint64 stall_time = watchdog->busy_since + watchdog->stall_threshold;
+
+			if (now >= stall_time) {
+				g_warning ("Main loop stalled in %s for more than %" G_GINT64_FORMAT " ms",
+					   watchdog->activity, watchdog->stall_threshold / 1000);
+				watchdog->stall_reported = TRUE;
+			} else {
+				deadline = stall_time;
+			}
+		}
+
+		if (watchdog->watchdog_usec > 0) {
+			if (now >= watchdog->next_feed) {
+				feed_watchdog (watchdog, now);
+				watchdog->next_feed = now + watchdog->watchdog_usec / 2;
+			}
+			deadline = MIN (deadline, watchdog->next_feed);
+		}
+
+		if (deadline == G_MAXINT64)
+			g_cond_wait (&watchdog->cond, &watchdog->lock);
+		else
+			g_cond_wait_until (&watchdog->cond, &watchdog->lock, deadline);
+	}
+	g_mutex_unlock (&watchdog->lock);
+
+	return NULL;
+}
+
+Watchdog *
+watchdog_new (guint stall_threshold_ms)
+{
+	Watchdog *watchdog;
+
+	watchdog = g_new0 (Watchdog, 1);
+	g_mutex_init (&watchdog->lock);
+	g_cond_init (&watchdog->cond);
+	watchdog->context = g_main_context_ref (g_main_context_default ());
+	watchdog->stall_threshold = (gint64) stall_threshold_ms * 1000;
+	watchdog->watchdog_usec = get_watchdog_usec ();
+	if (watchdog->watchdog_usec > 0)
+		g_debug ("systemd watchdog enabled, feeding it every %" G_GINT64_FORMAT " ms",
+			 watchdog->watchdog_usec / 2000);
+
+	watchdog->thread = g_thread_new ("watchdog", watchdog_thread, watchdog);
+
+	return watchdog;
+}
+
+void
+watchdog_free (Watchdog *watchdog)
+{
+	if (watchdog == NULL)
+		return;
+
+	g_mutex_lock (&watchdog->lock);
+	watchdog->quit = TRUE;
+	g_cond_signal (&watchdog->cond);
+	g_mutex_unlock (&watchdog->lock);
+	g_thread_join (watchdog->thread);
+
+	g_main_context_unref (watchdog->context);
+	g_mutex_clear (&watchdog->lock);
+	g_cond_clear (&watchdog->cond);
+	g_free (watchdog);
+}
+
+/* The activity needs to be a static string */
+void
+watchdog_begin (Watchdog   *watchdog,
+		const char *activity)
+{
+	if (watchdog == NULL)
+		return;
+
+	g_mutex_lock (&watchdog->lock);
+	if (watchdog->depth++ == 0) {
+		watchdog->activity = activity;
+		watchdog->busy_since = g_get_monotonic_time ();
+		watchdog->stall_reported = FALSE;
+		g_cond_signal (&watchdog->cond);
+	}
+	g_mutex_unlock (&watchdog->lock);
+}
+
+void
+watchdog_end (Watchdog *watchdog)
+{
+	gint64 duration;
+
+	if (watchdog == NULL)
+		return;
+
+	g_mutex_lock (&watchdog->lock);
+	if (--watchdog->depth > 0) {
+		g_mutex_unlock (&watchdog->lock);
+		return;
+	}
+
+	duration = g_get_monotonic_time () - watchdog->busy_since;
+	watchdog->max_dispatch = MAX (watchdog->max_dispatch, duration);
+	if (duration >= watchdog->stall_threshold) {
+		watchdog->num_stalls++;
+		g_warning ("Main loop was stalled in %s for %" G_GINT64_FORMAT " ms",
+			   watchdog->activity, duration / 1000);
+	}
+	watchdog->busy_since = 0;
+	watchdog->stall_reported = FALSE;
+	g_mutex_unlock (&watchdog->lock);
+}
+
+void
+watchdog_get_stats (Watchdog *watchdog,
+		    guint64  *num_stalls,
+		    gint64   *max_dispatch_usec,
+		    gint64   *max_latency_usec)
+{
+	g_mutex_lock (&watchdog->lock);
+	*num_stalls = watchdog->num_stalls;
+	*max_dispatch_usec = watchdog->max_dispatch;
+	*max_latency_usec = watchdog->max_latency;
+	g_mutex_unlock (&watchdog->lock);
+}
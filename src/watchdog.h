@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2026 The switcheroo-control authors
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation, or (at your option) any later version.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _Watchdog Watchdog;
+
+Watchdog *watchdog_new       (guint         stall_threshold_ms);
+void      watchdog_free      (Watchdog     *watchdog);
+void      watchdog_begin     (Watchdog     *watchdog,
+			      const char   *activity);
+void      watchdog_end       (Watchdog     *watchdog);
+void      watchdog_get_stats (Watchdog     *watchdog,
+			      guint64      *num_stalls,
+			      gint64       *max_dispatch_usec,
+			      gint64       *max_latency_usec);
+
+void      notify_systemd     (const char   *state);
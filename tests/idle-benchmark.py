@@ -0,0 +1,309 @@
+#!/usr/bin/python3
+
+# switcheroo-control background cost benchmark
+#
+# Starts the daemon with its default options on a private system bus
+# against a umockdev testbed, and measures its context switches, CPU time
+# and system calls while it is idle, and while a connector is noisily
+# hotplugged. Fails if the daemon wakes up at all while idle, or, when
+# given a baseline saved on the same machine, if the number of system
+# calls per event regressed.
+#
+# Run in built tree to test local built binaries, or from anywhere else to test
+# system installed binaries.
+#
+# Copyright: (C) 2026 The switcheroo-control authors
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+import argparse
+import glob
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+try:
+    import gi
+    from gi.repository import GLib
+    from gi.repository import Gio
+    gi.require_version('UMockdev', '1.0')
+    from gi.repository import UMockdev
+except (ImportError, ValueError) as e:
+    sys.stderr.write('Skipping benchmark, PyGobject or umockdev not available: %s\n' % str(e))
+    sys.exit(0)
+
+SC = 'net.hadess.SwitcherooControl'
+SC_PATH = '/net/hadess/SwitcherooControl'
+
+# Per-event system calls can grow by that much before it's a regression
+SYSCALL_TOLERANCE = 0.10
+
+TRACE_LINE_RE = re.compile(r'^(\d+)\s+(\d+\.\d+)\s+([a-z0-9_]+)\(')
+POLL_SYSCALLS = ('poll', 'ppoll', 'epoll_wait', 'epoll_pwait', 'select', 'pselect6')
+
+
+def find_daemon():
+    builddir = os.getenv('top_builddir', '.')
+    path = os.path.join(builddir, 'src', 'switcheroo-control')
+    if os.access(path, os.X_OK):
+        return path
+    with open('/usr/lib/systemd/system/switcheroo-control.service') as f:
+        for line in f:
+            if line.startswith('ExecStart='):
+                return line.split('=', 1)[1].strip()
+    raise RuntimeError('could not determine daemon path')
+
+
+def read_counters(pid):
+    '''Sum the scheduler counters of all the daemon's threads'''
+
+    counters = { 'voluntary-switches': 0, 'involuntary-switches': 0, 'run-ns': 0, 'timeslices': 0 }
+    for task in glob.glob('/proc/%d/task/*' % pid):
+        try:
+            with open(os.path.join(task, 'status')) as f:
+                for line in f:
+                    if line.startswith('voluntary_ctxt_switches:'):
+                        counters['voluntary-switches'] += int(line.split()[1])
+                    elif line.startswith('nonvoluntary_ctxt_switches:'):
+                        counters['involuntary-switches'] += int(line.split()[1])
+            with open(os.path.join(task, 'schedstat')) as f:
+                run_ns, _, timeslices = f.read().split()
+                counters['run-ns'] += int(run_ns)
+                counters['timeslices'] += int(timeslices)
+        except (FileNotFoundError, ProcessLookupError):
+            # Thread exited in the meantime
+            pass
+
+    with open('/proc/%d/stat' % pid) as f:
+        # The command name can contain spaces, skip past it
+        fields = f.read().rsplit(')', 1)[1].split()
+    ticks = os.sysconf('SC_CLK_TCK')
+    counters['cpu-ms'] = (int(fields[11]) + int(fields[12])) * 1000 // ticks
+
+    return counters
+
+
+def count_syscalls(trace_path, start, end):
+    '''Count the system calls started between start and end, from strace's output'''
+
+    syscalls = {}
+    with open(trace_path) as f:
+        for line in f:
+            m = TRACE_LINE_RE.match(line)
+            if not m:
+                continue
+            timestamp = float(m.group(2))
+            if start <= timestamp <= end:
+                syscalls[m.group(3)] = syscalls.get(m.group(3), 0) + 1
+    return syscalls
+
+
+class Benchmark:
+    def __init__(self, args):
+        self.args = args
+        self.testbed = UMockdev.Testbed.new()
+        self.daemon = None
+        self.daemon_pid = None
+        self.trace = None
+        self.failures = []
+
+    def add_gpu(self, driver, slot, boot_vga, minor):
+        tag = 'pci-' + slot.replace(':', '_').replace('.', '_')
+        parent = self.testbed.add_device('pci', '%s VGA controller' % driver, None,
+                [ 'boot_vga', '1' if boot_vga else '0' ],
+                [ 'DRIVER', driver,
+                  'PCI_CLASS', '30000',
+                  'PCI_SLOT_NAME', slot ]
+                )
+        card = self.testbed.add_device('drm', 'dri/card%d' % minor, parent,
+                [],
+                [ 'DEVNAME', '/dev/dri/card%d' % minor,
+                  'ID_PATH_TAG', tag ]
+                )
+        self.testbed.add_device('drm', 'dri/renderD%d' % (128 + minor), parent,
+                [],
+                [ 'DEVNAME', '/dev/dri/renderD%d' % (128 + minor),
+                  'ID_PATH_TAG', tag ]
+                )
+        return card
+
+    def start_daemon(self):
+        env = os.environ.copy()
+        env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
+        env['CACHE_DIRECTORY'] = os.path.join(self.testbed.get_root_dir(), 'cache')
+        # As the shipped unit doesn't enable the systemd watchdog
+        env.pop('NOTIFY_SOCKET', None)
+        env.pop('WATCHDOG_USEC', None)
+
+        cmd = [find_daemon()]
+
+        strace = shutil.which('strace')
+        if strace and not self.args.no_strace:
+            # Keep the preload library out of strace itself
+            self.trace = os.path.join(self.testbed.get_root_dir(), 'trace')
+            preload = env.pop('LD_PRELOAD', '')
+            cmd = [strace, '-f', '-qq', '-ttt', '-o', self.trace,
+                   '-E', 'LD_PRELOAD=' + preload] + cmd
+        else:
+            print('strace not available, not counting system calls')
+
+        self.log = tempfile.NamedTemporaryFile()
+        self.daemon = subprocess.Popen(cmd, env=env, stdout=self.log, stderr=subprocess.STDOUT)
+
+        bus = Gio.bus_get_sync(Gio.BusType.SYSTEM, None)
+        for i in range(100):
+            time.sleep(0.1)
+            try:
+                bus.call_sync(SC, SC_PATH, 'org.freedesktop.DBus.Properties', 'Get',
+                              GLib.Variant('(ss)', (SC, 'NumGPUs')), None,
+                              Gio.DBusCallFlags.NO_AUTO_START, -1, None)
+                break
+            except GLib.GError:
+                pass
+        else:
+            raise RuntimeError('daemon did not start in 10 seconds')
+
+        if self.trace:
+            children = open('/proc/%d/task/%d/children' % (self.daemon.pid, self.daemon.pid)).read().split()
+            self.daemon_pid = int(children[0])
+        else:
+            self.daemon_pid = self.daemon.pid
+
+    def stop_daemon(self):
+        if self.daemon:
+            self.daemon.terminate()
+            self.daemon.wait()
+            self.daemon = None
+
+    def measure(self, name, scenario, num_events=0):
+        before = read_counters(self.daemon_pid)
+        start = time.time()
+        scenario()
+        end = time.time()
+        after = read_counters(self.daemon_pid)
+
+        result = { 'scenario': name, 'duration': round(end - start, 3) }
+        per_minute = 60.0 / (end - start)
+        for k in before:
+            result[k] = after[k] - before[k]
+            result[k + '-per-minute'] = round(result[k] * per_minute, 2)
+
+        if self.trace:
+            syscalls = count_syscalls(self.trace, start, end)
+            result['syscalls'] = sum(syscalls.values())
+            result['syscalls-per-minute'] = round(result['syscalls'] * per_minute, 2)
+            result['poll-wakeups'] = sum(syscalls.get(s, 0) for s in POLL_SYSCALLS)
+            if num_events > 0:
+                result['events'] = num_events
+                result['syscalls-per-event'] = round(result['syscalls'] / num_events, 2)
+                result['top-syscalls'] = dict(sorted(syscalls.items(), key=lambda s: -s[1])[:10])
+
+        return result
+
+    def run(self):
+        intel = self.add_gpu('i915', '0000:00:02.0', True, 0)
+        self.add_gpu('nouveau', '0000:01:00.0', False, 1)
+        connector = self.testbed.add_device('drm', 'dri/card0-HDMI-A-1', intel,
+                [ 'status', 'disconnected' ], [])
+
+        self.start_daemon()
+        # Let the start-up settle
+        time.sleep(2)
+
+        results = []
+
+        results.append(self.measure('idle', lambda: time.sleep(self.args.idle_time)))
+
+        def hotplug():
+            for i in range(self.args.events):
+                self.testbed.set_attribute(connector, 'status', 'connected' if i % 2 == 0 else 'disconnected')
+                self.testbed.uevent(connector, 'change')
+                time.sleep(self.args.event_interval)
+            # Let the last event be processed
+            time.sleep(1)
+        results.append(self.measure('connector-hotplug', hotplug, self.args.events))
+
+        self.stop_daemon()
+        return results
+
+    def check(self, results, baseline):
+        idle = results[0]
+        # Nothing is enabled that needs a timer, so an idle daemon should sleep
+        if idle['voluntary-switches'] > 0 or idle.get('poll-wakeups', 0) > 0:
+            self.failures.append('daemon woke up %d times while idle (%d poll wakeups)' %
+                                 (idle['voluntary-switches'], idle.get('poll-wakeups', 0)))
+
+        if baseline is None:
+            return
+        hotplug = results[1]
+        if 'syscalls-per-event' in hotplug and 'syscalls-per-event' in baseline:
+            budget = baseline['syscalls-per-event'] * (1 + SYSCALL_TOLERANCE)
+            if hotplug['syscalls-per-event'] > budget:
+                self.failures.append('%s system calls per event, over the %.2f budget' %
+                                     (hotplug['syscalls-per-event'], budget))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure the background cost of switcheroo-control')
+    parser.add_argument('--idle-time', type=float, default=30, help='seconds to stay idle (default: 30)')
+    parser.add_argument('--events', type=int, default=50, help='number of connector events (default: 50)')
+    parser.add_argument('--event-interval', type=float, default=0.1, help='seconds between events (default: 0.1)')
+    parser.add_argument('--baseline', help='compare per-event system calls to this baseline, which must exist')
+    parser.add_argument('--save-baseline', help='save the per-event system calls to this file')
+    parser.add_argument('--no-strace', action='store_true', help='do not count system calls')
+    args = parser.parse_args()
+
+    if args.baseline and not os.path.exists(args.baseline):
+        print('FAIL: baseline %s not found, create it with --save-baseline' % args.baseline)
+        return 1
+
+    # Private system bus, so that the daemon can own its name
+    test_bus = Gio.TestDBus.new(Gio.TestDBusFlags.NONE)
+    test_bus.up()
+    os.environ.pop('DBUS_SESSION_BUS_ADDRESS', None)
+    os.environ['DBUS_SYSTEM_BUS_ADDRESS'] = test_bus.get_bus_address()
+
+    benchmark = Benchmark(args)
+    try:
+        results = benchmark.run()
+    finally:
+        benchmark.stop_daemon()
+        test_bus.down()
+
+    print(json.dumps(results, indent=2))
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+    benchmark.check(results, baseline)
+
+    if args.save_baseline and 'syscalls-per-event' in results[1]:
+        with open(args.save_baseline, 'w') as f:
+            json.dump({ 'syscalls-per-event': results[1]['syscalls-per-event'] }, f, indent=2)
+            f.write('\n')
+
+    for failure in benchmark.failures:
+        print('FAIL: ' + failure)
+    return 1 if benchmark.failures else 0
+
+
+if __name__ == '__main__':
+    # run ourselves under umockdev
+    if 'umockdev' not in os.environ.get('LD_PRELOAD', ''):
+        os.execvp('umockdev-wrapper', ['umockdev-wrapper'] + sys.argv)
+
+    sys.exit(main())
@@ -20,6 +20,11 @@
 
 import os
 import sys
+import json
+import mmap
+import shutil
+import socket
+import struct
 import dbus
 import tempfile
 import subprocess
@@ -105,6 +110,7 @@ class Tests(dbusmock.DBusTestCase):
         self.proxy = None
         self.log = None
         self.daemon = None
+        self.drm_nodes = {}
 
     def run(self, result=None):
         super(Tests, self).run(result)
@@ -122,7 +128,7 @@ class Tests(dbusmock.DBusTestCase):
     # Daemon control and D-BUS I/O
     #
 
-    def start_daemon(self):
+    def start_daemon(self, args=None):
         '''Start daemon and create DBus proxy.
 
         When done, this sets self.proxy as the Gio.DBusProxy for switcheroo-control.
@@ -133,11 +139,14 @@ class Tests(dbusmock.DBusTestCase):
         # note: Python doesn't propagate the setenv from Testbed.new(), so we
         # have to do that ourselves
         env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
+        env['CACHE_DIRECTORY'] = os.path.join(self.testbed.get_root_dir(), 'cache')
         self.log = tempfile.NamedTemporaryFile()
         if os.getenv('VALGRIND') != None:
             daemon_path = ['valgrind', self.daemon_path, '-v']
         else:
             daemon_path = [self.daemon_path, '-v']
+        if args:
+            daemon_path += args
 
         self.daemon = subprocess.Popen(daemon_path,
                                        env=env, stdout=self.log,
@@ -174,6 +183,15 @@ class Tests(dbusmock.DBusTestCase):
         self.daemon = None
         self.proxy = None
 
+    def start_polkitd(self, allowed):
+        '''Start a mock polkitd, authorising the given actions.'''
+
+        polkitd, obj_polkit = self.spawn_server_template('polkitd', {}, stdout=subprocess.DEVNULL)
+        self.addCleanup(polkitd.wait)
+        self.addCleanup(polkitd.terminate)
+        obj_polkit.SetAllowed(allowed)
+        return obj_polkit
+
     def get_dbus_property(self, name):
         '''Get property value from daemon D-Bus interface.'''
 
@@ -302,6 +320,40 @@ class Tests(dbusmock.DBusTestCase):
                   'ID_PATH_TAG', 'pci-0000_01_00_0' ]
                 )
 
+    def add_pci_gpu(self, driver, slot, boot_vga, vendor, model, minor, pci_id=None):
+        '''Add a PCI GPU with a consistent set of properties'''
+
+        tag = 'pci-' + slot.replace(':', '_').replace('.', '_')
+        properties = [ 'DRIVER', driver,
+                       'PCI_CLASS', '30000',
+                       'PCI_SLOT_NAME', slot,
+                       'ID_VENDOR_FROM_DATABASE', vendor,
+                       'ID_MODEL_FROM_DATABASE', model ]
+        if pci_id:
+            properties += [ 'PCI_ID', pci_id ]
+        parent = self.testbed.add_device('pci', '%s VGA controller %s' % (driver, slot), None,
+                [ 'boot_vga', '1' if boot_vga else '0' ],
+                properties
+                )
+        self.testbed.set_attribute_link(parent, 'driver', '../../' + driver)
+
+        card = self.testbed.add_device('drm', 'dri/card%d' % minor, parent,
+                [],
+                [ 'DEVNAME', '/dev/dri/card%d' % minor,
+                  'ID_PATH', 'pci-' + slot,
+                  'ID_PATH_TAG', tag ]
+                )
+
+        render = self.testbed.add_device('drm', 'dri/renderD%d' % (128 + minor), parent,
+                [],
+                [ 'DEVNAME', '/dev/dri/renderD%d' % (128 + minor),
+                  'ID_PATH', 'pci-' + slot,
+                  'ID_PATH_TAG', tag ]
+                )
+        self.drm_nodes[parent] = [card, render]
+
+        return parent
+
     def add_vc4_gpu(self):
         parent = self.testbed.add_device('platform', 'VC4 platform device', None,
                 [],
@@ -500,6 +552,1160 @@ class Tests(dbusmock.DBusTestCase):
 
         self.stop_daemon()
 
+    def test_vga_switcheroo(self):
+        '''legacy vga_switcheroo mux'''
+
+        self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'HD Graphics 3000', 0)
+        self.add_pci_gpu('radeon', '0000:01:00.0', False, 'AMD', 'Whistler', 1)
+
+        switch_dir = os.path.join(self.testbed.get_root_dir(), 'sys', 'kernel', 'debug', 'vgaswitcheroo')
+        os.makedirs(switch_dir)
+        switch_path = os.path.join(switch_dir, 'switch')
+        with open(switch_path, 'w') as f:
+            f.write('0:IGD:+:Pwr:0000:00:02.0\n1:DIS: :DynPwr:0000:01:00.0\n2:DIS-Audio: :Pwr:0000:01:00.1\n')
+
+        self.start_daemon(['--vga-switcheroo'])
+
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(len(gpus), 2)
+        igd = next(gpu for gpu in gpus if gpu['Default'])
+        dis = next(gpu for gpu in gpus if not gpu['Default'])
+        self.assertEqual(igd['VgaSwitcherooActive'], True)
+        self.assertEqual(igd['VgaSwitcherooPower'], 'on')
+        self.assertEqual(dis['VgaSwitcherooActive'], False)
+        self.assertEqual(dis['VgaSwitcherooPower'], 'dynamic-on')
+
+        polkitd = self.start_polkitd([])
+        with self.assertRaisesRegex(GLib.GError, 'AccessDenied'):
+            self.proxy.VgaSwitcherooPowerOff()
+        with open(switch_path) as f:
+            self.assertFalse(f.read().startswith('OFF'))
+
+        polkitd.SetAllowed(['net.hadess.SwitcherooControl.vga-switcheroo'])
+        self.proxy.VgaSwitcherooPowerOff()
+        with open(switch_path) as f:
+            self.assertTrue(f.read().startswith('OFF'))
+
+        with open(switch_path, 'w') as f:
+            f.write('0:IGD:+:Pwr:0000:00:02.0\n1:DIS: :Off:0000:01:00.0\n')
+        self.proxy.VgaSwitcherooScheduleSwitch('(s)', 'discrete')
+        with open(switch_path) as f:
+            self.assertTrue(f.read().startswith('DDIS'))
+
+        with self.assertRaises(GLib.GError):
+            self.proxy.VgaSwitcherooScheduleSwitch('(s)', 'both')
+
+        # The discrete GPU being active means it can't be powered off
+        with open(switch_path, 'w') as f:
+            f.write('0:IGD: :Off:0000:00:02.0\n1:DIS:+:Pwr:0000:01:00.0\n')
+        with self.assertRaises(GLib.GError):
+            self.proxy.VgaSwitcherooPowerOff()
+
+        self.stop_daemon()
+
+    def test_vga_switcheroo_disabled(self):
+        '''vga_switcheroo control needs to be enabled'''
+
+        self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'HD Graphics 3000', 0)
+
+        self.start_daemon()
+        gpus = self.get_dbus_property('GPUs')
+        self.assertNotIn('VgaSwitcherooActive', gpus[0])
+        with self.assertRaises(GLib.GError):
+            self.proxy.VgaSwitcherooPowerOff()
+
+        self.stop_daemon()
+
+    def test_mux_mode(self):
+        '''firmware MUX in discrete mode'''
+
+        mux = self.testbed.add_device('platform', 'asus-nb-wmi', None,
+                [ 'gpu_mux_mode', '0' ],
+                [ 'DRIVER', 'asus-nb-wmi' ]
+                )
+        self.add_pci_gpu('i915', '0000:00:02.0', False, 'Intel Corporation', 'UHD Graphics 630', 0)
+        self.add_pci_gpu('nvidia', '0000:01:00.0', True, 'NVIDIA Corporation', 'TU106M [GeForce RTX 2060 Mobile]', 1)
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('MuxMode'), 'discrete')
+
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(len(gpus), 2)
+        nvidia = next(gpu for gpu in gpus if gpu['Name'].startswith('NVIDIA'))
+        intel = next(gpu for gpu in gpus if gpu['Name'].startswith('Intel'))
+        self.assertEqual(nvidia['Default'], True)
+        self.assertEqual(nvidia['Discrete'], True)
+        self.assertEqual(len(nvidia['Environment']), 0)
+        self.assertEqual(intel['Default'], False)
+        self.assertEqual(intel['Discrete'], False)
+
+        self.testbed.set_attribute(mux, 'gpu_mux_mode', '1')
+        self.testbed.uevent(mux, 'change')
+        self.assertEventually(lambda: self.get_dbus_property('MuxMode') == 'hybrid')
+
+        # Other platform devices don't cause rescans
+        other = self.testbed.add_device('platform', 'serial8250', None, [], [])
+        self.testbed.uevent(other, 'change')
+        self.assertEventually(lambda: self.have_text_in_log('Ignoring change uevent for ' + other))
+
+        self.stop_daemon()
+
+    def test_mux_mode_dgpu_only(self):
+        '''firmware MUX with a dgpu_only attribute'''
+
+        self.testbed.add_device('firmware-attributes', 'vendor-wmi', None,
+                [ 'attributes/dgpu_only/current_value', '1' ],
+                []
+                )
+        self.add_pci_gpu('i915', '0000:00:02.0', False, 'Intel Corporation', 'UHD Graphics 630', 0)
+        self.add_pci_gpu('nvidia', '0000:01:00.0', True, 'NVIDIA Corporation', 'TU106M [GeForce RTX 2060 Mobile]', 1)
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('MuxMode'), 'discrete')
+        gpus = self.get_dbus_property('GPUs')
+        nvidia = next(gpu for gpu in gpus if gpu['Name'].startswith('NVIDIA'))
+        self.assertEqual(nvidia['Default'], True)
+
+        self.stop_daemon()
+
+    def test_no_mux(self):
+        '''no firmware MUX'''
+
+        self.add_intel_gpu()
+        self.add_nouveau_gpu()
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('MuxMode'), 'none')
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(gpus[0]['Discrete'], True)
+        self.assertEqual(gpus[1]['Discrete'], False)
+
+        self.stop_daemon()
+
+    def test_accelerators(self):
+        '''NPUs and compute accelerators'''
+
+        self.add_intel_gpu()
+
+        parent = self.testbed.add_device('pci', 'Intel NPU', None,
+                [],
+                [ 'DRIVER', 'intel_vpu',
+                  'PCI_CLASS', '120000',
+                  'PCI_ID', '8086:7D1D',
+                  'PCI_SLOT_NAME', '0000:00:0b.0',
+                  'ID_VENDOR_FROM_DATABASE', 'Intel Corporation',
+                  'ID_MODEL_FROM_DATABASE', 'Meteor Lake NPU' ]
+                )
+        self.testbed.set_attribute_link(parent, 'driver', '../../intel_vpu')
+        self.testbed.add_device('accel', 'accel/accel0', parent,
+                [],
+                [ 'DEVNAME', '/dev/accel/accel0' ]
+                )
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+
+        accels = self.get_dbus_property('Accelerators')
+        self.assertEqual(len(accels), 1)
+        self.assertEqual(accels[0]['Name'], 'Intel Corporation Meteor Lake NPU')
+        self.assertEqual(accels[0]['Type'], 'npu')
+        self.assertEqual(accels[0]['Device'], '/dev/accel/accel0')
+        self.assertEqual(accels[0]['Driver'], 'intel_vpu')
+        self.assertEqual(accels[0]['PciId'], '8086:7D1D')
+
+        parent = self.testbed.add_device('pci', 'Gaudi', None,
+                [],
+                [ 'DRIVER', 'habanalabs',
+                  'PCI_ID', '1DA3:1020',
+                  'PCI_SLOT_NAME', '0000:02:00.0',
+                  'ID_MODEL_FROM_DATABASE', 'Gaudi2' ]
+                )
+        self.testbed.set_attribute_link(parent, 'driver', '../../habanalabs')
+        self.testbed.add_device('accel', 'accel/accel1', parent,
+                [],
+                [ 'DEVNAME', '/dev/accel/accel1' ]
+                )
+        self.assertEventually(lambda: len(self.get_dbus_property('Accelerators')) == 2)
+
+        accels = self.get_dbus_property('Accelerators')
+        gaudi = next(accel for accel in accels if accel['Device'] == '/dev/accel/accel1')
+        self.assertEqual(gaudi['Type'], 'compute')
+        self.assertEqual(list(gaudi['Environment']), ['HABANA_VISIBLE_DEVICES', '1'])
+
+        self.stop_daemon()
+
+    def test_sriov(self):
+        '''SR-IOV virtual functions'''
+
+        self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'UHD Graphics 770', 0)
+        pf = self.add_pci_gpu('xe', '0000:03:00.0', False, 'Intel Corporation', 'Flex 170', 1)
+        self.testbed.set_attribute(pf, 'sriov_numvfs', '2')
+        for i in range(2):
+            vf = self.add_pci_gpu('xe', '0000:03:00.%d' % (i + 1), False, 'Intel Corporation', 'Flex 170 VF', 2 + i)
+            self.testbed.set_attribute_link(vf, 'physfn', '../' + os.path.basename(pf))
+            self.testbed.set_attribute_link(pf, 'virtfn%d' % i, '../' + os.path.basename(vf))
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 4)
+
+        gpus = self.get_dbus_property('GPUs')
+        igpu = next(gpu for gpu in gpus if gpu['Id'] == 'pci-0000_00_02_0')
+        self.assertEqual(igpu['Function'], 'physical')
+        self.assertNotIn('Group', igpu)
+        self.assertEqual(igpu['Capacity'], 1.0)
+
+        group = [gpu for gpu in gpus if gpu.get('Group') == 'pci-0000_03_00_0']
+        self.assertEqual(len(group), 3)
+        for gpu in group:
+            self.assertAlmostEqual(gpu['Capacity'], 1.0 / 3)
+            self.assertEqual(gpu['Discrete'], True)
+        vf = next(gpu for gpu in group if gpu['Id'] == 'pci-0000_03_00_2')
+        self.assertEqual(vf['Function'], 'virtual')
+        self.assertEqual(vf['Name'], 'Intel Corporation Flex 170 (Virtual Function 1)')
+        self.assertEqual(vf['Device'], '/dev/dri/renderD131')
+
+        # Launches go to the same member, none of them being used
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        for i in range(3):
+            out = subprocess.run([tool_path, 'launch', 'env'], capture_output=True)
+            self.assertIn(b'DRI_PRIME=pci-0000_03_00_0', out.stdout)
+
+        self.stop_daemon()
+
+    def test_sriov_vram(self):
+        '''SR-IOV virtual functions sharing VRAM'''
+
+        pf = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Instinct MI210', 0)
+        self.testbed.set_attribute(pf, 'mem_info_vram_total', '8589934592')
+        for i, vram in enumerate(['17179869184', '8589934592']):
+            vf = self.add_pci_gpu('amdgpu', '0000:03:00.%d' % (i + 1), False, 'AMD', 'Instinct MI210 VF', 1 + i)
+            self.testbed.set_attribute(vf, 'mem_info_vram_total', vram)
+            self.testbed.set_attribute_link(vf, 'physfn', '../' + os.path.basename(pf))
+            self.testbed.set_attribute_link(pf, 'virtfn%d' % i, '../' + os.path.basename(vf))
+
+        self.start_daemon()
+        capacity = {gpu['Id']: gpu['Capacity'] for gpu in self.get_dbus_property('GPUs')}
+        self.assertAlmostEqual(capacity['pci-0000_03_00_0'], 0.25)
+        self.assertAlmostEqual(capacity['pci-0000_03_00_1'], 0.5)
+        self.assertAlmostEqual(capacity['pci-0000_03_00_2'], 0.25)
+
+        self.stop_daemon()
+
+    def test_compute_partitions(self):
+        '''amdgpu compute partitions of several GPUs'''
+
+        def add_partition(index, minor):
+            xcp = self.testbed.add_device('platform', 'amdgpu_xcp.%d' % index, None, [], [])
+            tag = 'platform-amdgpu_xcp_%d' % index
+            self.testbed.add_device('drm', 'dri/renderD%d' % (128 + minor), xcp,
+                    [],
+                    [ 'DEVNAME', '/dev/dri/renderD%d' % (128 + minor),
+                      'ID_PATH', 'platform-amdgpu_xcp.%d' % index,
+                      'ID_PATH_TAG', tag ]
+                    )
+
+        # Probed in PCI order, the first GPU in DPX mode, the second in CPX mode
+        first = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Instinct MI300X', 0)
+        self.testbed.set_attribute(first, 'current_compute_partition', 'DPX')
+        second = self.add_pci_gpu('amdgpu', '0000:04:00.0', False, 'AMD', 'Instinct MI300X', 1)
+        self.testbed.set_attribute(second, 'current_compute_partition', 'CPX')
+        for i in range(4):
+            add_partition(i, 2 + i)
+
+        self.start_daemon()
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(len(gpus), 6)
+
+        first_group = [gpu for gpu in gpus if gpu.get('Group') == 'pci-0000_03_00_0']
+        self.assertEqual(sorted(gpu['Id'] for gpu in first_group),
+                         ['pci-0000_03_00_0', 'platform-amdgpu_xcp_0'])
+        for gpu in first_group:
+            self.assertAlmostEqual(gpu['Capacity'], 0.5)
+
+        second_group = [gpu for gpu in gpus if gpu.get('Group') == 'pci-0000_04_00_0']
+        self.assertEqual(len(second_group), 4)
+        for gpu in second_group:
+            self.assertAlmostEqual(gpu['Capacity'], 0.25)
+        partition = next(gpu for gpu in second_group if gpu['Id'] == 'platform-amdgpu_xcp_3')
+        self.assertEqual(partition['Function'], 'partition')
+        self.assertEqual(partition['Name'], 'AMD Instinct MI300X (Partition 3)')
+
+        # The partitions can't be told apart if the numbers don't add up
+        self.stop_daemon()
+        self.testbed.set_attribute(first, 'current_compute_partition', 'QPX')
+        self.testbed.set_attribute(second, 'current_compute_partition', 'QPX')
+        self.start_daemon()
+        gpus = self.get_dbus_property('GPUs')
+        self.assertFalse(any('Group' in gpu for gpu in gpus))
+
+        self.stop_daemon()
+
+    def test_passthrough(self):
+        '''GPU bound to vfio-pci for passthrough'''
+
+        intel = self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'UHD Graphics 630', 0)
+        parent = self.add_pci_gpu('nvidia', '0000:01:00.0', False, 'NVIDIA Corporation', 'TU106M [GeForce RTX 2060 Mobile]', 1)
+
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 2)
+
+        # unbind from nvidia, bind to vfio-pci
+        for node in self.drm_nodes[parent]:
+            self.testbed.remove_device(node)
+        self.testbed.set_attribute_link(parent, 'driver', '../../vfio-pci')
+        self.testbed.uevent(parent, 'bind')
+
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 1)
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(len(gpus), 2)
+        self.assertEqual(self.get_dbus_property('HasDualGpu'), False)
+        nvidia = next(gpu for gpu in gpus if gpu['Id'] == 'pci-0000_01_00_0')
+        self.assertEqual(nvidia['Unavailable'], 'passthrough')
+        self.assertEqual(nvidia['Name'], 'NVIDIA Corporation TU106M [GeForce RTX 2060 Mobile]')
+        self.assertEqual(len(nvidia['Environment']), 0)
+
+        # and back
+        self.testbed.set_attribute_link(parent, 'driver', '../../nvidia')
+        render = self.testbed.add_device('drm', 'dri/renderD129', parent,
+                [],
+                [ 'DEVNAME', '/dev/dri/renderD129',
+                  'ID_PATH', 'pci-0000:01:00.0',
+                  'ID_PATH_TAG', 'pci-0000_01_00_0' ]
+                )
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 2)
+        gpus = self.get_dbus_property('GPUs')
+        nvidia = next(gpu for gpu in gpus if gpu['Id'] == 'pci-0000_01_00_0')
+        self.assertNotIn('Unavailable', nvidia)
+        self.assertIn('__NV_PRIME_RENDER_OFFLOAD', nvidia['Environment'])
+
+        # Other PCI devices changing drivers don't cause rescans
+        nic = self.testbed.add_device('pci', 'Ethernet controller', None, [],
+                [ 'DRIVER', 'e1000e', 'PCI_CLASS', '20000' ])
+        self.testbed.uevent(nic, 'bind')
+        self.assertEventually(lambda: self.have_text_in_log('Ignoring bind uevent for ' + nic))
+
+        # Still bound, but without a render node
+        self.testbed.remove_device(render)
+        self.testbed.uevent(self.drm_nodes[intel][1], 'change')
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 1)
+        nvidia = next(gpu for gpu in self.get_dbus_property('GPUs') if gpu['Id'] == 'pci-0000_01_00_0')
+        self.assertEqual(nvidia['Unavailable'], 'no-render-node')
+
+        self.stop_daemon()
+
+    def test_software_gpu(self):
+        '''software rendering GPU'''
+
+        # Limit our cgroup to 1 CPU
+        with open('/proc/self/cgroup') as f:
+            cgroup = next(line[3:].strip() for line in f if line.startswith('0::'))
+        cgroup_dir = os.path.join(self.testbed.get_root_dir(), 'sys', 'fs', 'cgroup', cgroup.lstrip('/'))
+        os.makedirs(cgroup_dir)
+        with open(os.path.join(cgroup_dir, 'cpu.max'), 'w') as f:
+            f.write('100000 100000\n')
+
+        self.start_daemon(['--software-gpu'])
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(gpus[0]['Id'], 'software')
+        self.assertEqual(gpus[0]['Default'], True)
+        sc_env = gpus[0]['Environment']
+        self.assertEqual(sc_env[sc_env.index('LIBGL_ALWAYS_SOFTWARE') + 1], '1')
+        self.assertNotIn('LP_NUM_THREADS', sc_env)
+
+        # Sized for the launched process' cgroup
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        env = os.environ.copy()
+        env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
+        env.pop('LP_NUM_THREADS', None)
+        out = subprocess.run([tool_path, 'launch', 'env'], capture_output=True, env=env)
+        self.assertIn(b'LP_NUM_THREADS=1\n', out.stdout)
+
+        # Real GPUs replace it
+        self.add_intel_gpu()
+        self.assertEventually(lambda: self.get_dbus_property('GPUs')[0].get('Id') != 'software')
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+
+        self.stop_daemon()
+
+    def test_software_gpu_threads(self):
+        '''software rendering GPU uses all the CPUs'''
+
+        self.start_daemon(['--software-gpu'])
+
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        env = os.environ.copy()
+        env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
+        env.pop('LP_NUM_THREADS', None)
+        out = subprocess.run([tool_path, 'launch', 'env'], capture_output=True, env=env)
+        self.assertIn(b'LP_NUM_THREADS=%d\n' % len(os.sched_getaffinity(0)), out.stdout)
+
+        # Unless the user asked for something else
+        env['LP_NUM_THREADS'] = '3'
+        out = subprocess.run([tool_path, 'launch', 'env'], capture_output=True, env=env)
+        self.assertIn(b'LP_NUM_THREADS=3\n', out.stdout)
+
+        self.stop_daemon()
+
+    def test_fake(self):
+        '''fake GPUs survive rescans'''
+
+        self.add_intel_gpu()
+
+        self.start_daemon(['--fake'])
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 3)
+        ids = [gpu['Id'] for gpu in self.get_dbus_property('GPUs')]
+        self.assertEqual(ids, ['intel-i740', 'pci-0000_00_02_0', 'trident'])
+
+        self.add_nouveau_gpu()
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 4)
+        self.assertEqual(self.daemon.poll(), None, 'daemon crashed')
+
+        self.stop_daemon()
+
+    def test_simulation(self):
+        '''scripted simulation of GPUs'''
+
+        self.add_intel_gpu()
+
+        topology = tempfile.NamedTemporaryFile(mode='w', suffix='.conf')
+        topology.write('''[GPU integrated]
+Name=Simulated Integrated
+Environment=SIM_GPU;0;
+Default=true
+
+[GPU eGPU]
+Name=Simulated eGPU
+Environment=SIM_GPU;1;
+Discrete=true
+Count=2
+Present=false
+
+[Event plug]
+GPU=eGPU
+Action=add
+Time=0.5
+''')
+        topology.flush()
+
+        self.start_daemon(['--simulate', topology.name])
+        # Real hardware is hidden by default
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(gpus[0]['Id'], 'integrated')
+        self.assertEqual(gpus[0]['Name'], 'Simulated Integrated')
+
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 3)
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual([gpu['Id'] for gpu in gpus], ['integrated', 'eGPU-0', 'eGPU-1'])
+        self.assertEqual(gpus[2]['Name'], 'Simulated eGPU #1')
+        self.assertEqual(gpus[2]['Discrete'], True)
+        self.assertEqual(gpus[2]['Environment'], ['SIM_GPU', '1'])
+        self.assertEqual(self.get_dbus_property('HasDualGpu'), True)
+
+        self.stop_daemon()
+
+        # Counts can't be negative
+        for gpu_key, event_key in [('Count=-1', ''), ('', 'Repeat=-1')]:
+            with tempfile.NamedTemporaryFile(mode='w', suffix='.conf') as invalid:
+                invalid.write('[GPU eGPU]\n%s\n[Event plug]\nGPU=eGPU\nAction=add\n%s\n' % (gpu_key, event_key))
+                invalid.flush()
+                out = subprocess.run([self.daemon_path, '--simulate', invalid.name], capture_output=True)
+                self.assertEqual(out.returncode, 1)
+                self.assertIn(b'Failed to load simulation', out.stdout)
+
+    def test_cdi_specs(self):
+        '''Container Device Interface specs'''
+
+        self.add_intel_gpu()
+        cdi_dir = tempfile.mkdtemp()
+        self.addCleanup(shutil.rmtree, cdi_dir)
+        gpu_spec = os.path.join(cdi_dir, 'hadess.net-gpu.json')
+
+        self.start_daemon(['--cdi-spec-dir', cdi_dir])
+        with open(gpu_spec) as f:
+            spec = json.load(f)
+        self.assertEqual(spec['kind'], 'hadess.net/gpu')
+        self.assertEqual([d['name'] for d in spec['devices']], ['pci-0000_00_02_0', 'default'])
+        nodes = [n['path'] for n in spec['devices'][0]['containerEdits']['deviceNodes']]
+        self.assertEqual(nodes, ['/dev/dri/renderD128', '/dev/dri/card0'])
+        self.assertFalse(os.path.exists(os.path.join(cdi_dir, 'hadess.net-accel.json')))
+
+        self.add_nouveau_gpu()
+        self.assertEventually(lambda: len(json.load(open(gpu_spec))['devices']) == 3)
+        devices = {d['name']: d for d in json.load(open(gpu_spec))['devices']}
+        self.assertIn('DRI_PRIME=pci-0000_01_00_0', devices['pci-0000_01_00_0']['containerEdits']['env'])
+        self.assertEqual(devices['default'], dict(devices['pci-0000_00_02_0'], name='default'))
+
+        self.stop_daemon()
+
+    def test_drm_capabilities(self):
+        '''cached render node capabilities'''
+
+        self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'UHD Graphics 620', 0, '8086:5917')
+        nvidia = self.add_pci_gpu('nouveau', '0000:01:00.0', False, 'NVIDIA Corporation', 'GeForce 930MX', 1, '10DE:134F')
+        self.testbed.set_attribute(nvidia, 'power/runtime_status', 'suspended')
+
+        cache_dir = os.path.join(self.testbed.get_root_dir(), 'cache')
+        os.makedirs(cache_dir)
+        release = os.uname().release
+        with open(os.path.join(cache_dir, 'drm-capabilities'), 'w') as f:
+            f.write('''[8086:5917 i915 %s]
+Driver=i915
+Version=1.6.0
+Capabilities=prime-import;prime-export;syncobj;syncobj-timeline;
+
+[8086:5917 i915 0.0-old]
+Driver=i915
+Version=0.1.0
+Capabilities=
+''' % release)
+
+        self.start_daemon()
+        # Probed when first seen, rather than when the GPUs are read
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 2)
+        self.assertTrue(self.have_text_in_log('Not probing suspended GPU /dev/dri/renderD129'))
+
+        gpus = {gpu['Id']: gpu for gpu in self.get_dbus_property('GPUs')}
+        intel = gpus['pci-0000_00_02_0']
+        self.assertEqual(intel['Driver'], 'i915')
+        self.assertEqual(intel['DriverVersion'], '1.6.0')
+        self.assertIn('syncobj-timeline', intel['Capabilities'])
+
+        # Not probed while it is asleep
+        self.assertNotIn('Driver', gpus['pci-0000_01_00_0'])
+
+        self.stop_daemon()
+
+    def test_graphics_probe(self):
+        '''graphics API probe helper'''
+
+        self.add_pci_gpu('i915', '0000:00:02.0', True, 'Intel Corporation', 'UHD Graphics 620', 0, '8086:5917')
+
+        # Fake helper that records how it was called
+        calls = os.path.join(self.testbed.get_root_dir(), 'probe-calls')
+        helper = os.path.join(self.testbed.get_root_dir(), 'probe-helper')
+        with open(helper, 'w') as f:
+            f.write('''#!/bin/sh
+echo "$@" "$DRI_PRIME" >> %s
+cat <<EOF
+[Graphics]
+Renderer=Mesa Intel(R) UHD Graphics 620 (KBL GT2)
+GLVersion=4.6 (Core Profile) Mesa 24.0.5
+MesaVersion=24.0.5
+Extensions=GL_ARB_gl_spirv;VK_KHR_ray_query;
+EOF
+''' % calls)
+        os.chmod(helper, 0o755)
+        os.environ['SWITCHEROO_CONTROL_PROBE'] = helper
+        self.addCleanup(os.environ.pop, 'SWITCHEROO_CONTROL_PROBE')
+
+        self.start_daemon(['--probe-graphics'])
+        self.assertEventually(lambda: 'Graphics' in self.get_dbus_property('GPUs')[0])
+        graphics = self.get_dbus_property('GPUs')[0]['Graphics']
+        self.assertEqual(graphics['MesaVersion'], '24.0.5')
+        self.assertEqual(graphics['Extensions'], ['GL_ARB_gl_spirv', 'VK_KHR_ray_query'])
+        with open(calls) as f:
+            self.assertEqual(f.read(), '--render-node=/dev/dri/renderD128 --pci-slot=0000:00:02.0 pci-0000_00_02_0\n')
+        self.stop_daemon()
+
+        # Cached across restarts
+        self.start_daemon(['--probe-graphics'])
+        self.assertIn('Graphics', self.get_dbus_property('GPUs')[0])
+        with open(calls) as f:
+            self.assertEqual(len(f.readlines()), 1)
+        self.stop_daemon()
+
+        # Results from an older graphics stack are pruned
+        cache = os.path.join(self.testbed.get_root_dir(), 'cache', 'graphics-capabilities')
+        with open(cache, 'a') as f:
+            f.write('\n[8086:5917 i915 000000000000]\nRenderer=Stale\n')
+        self.start_daemon(['--probe-graphics'])
+        with open(cache) as f:
+            contents = f.read()
+        self.assertNotIn('Stale', contents)
+        self.assertIn('24.0.5', contents)
+        self.stop_daemon()
+
+    def test_graphics_probe_software(self):
+        '''graphics API probe helper with llvmpipe'''
+
+        builddir = os.getenv('top_builddir', '.')
+        helper = os.path.join(builddir, 'src', 'switcheroo-control-probe')
+        if not os.access(helper, os.X_OK):
+            self.skipTest('graphics probe helper not built')
+        os.environ['SWITCHEROO_CONTROL_PROBE'] = helper
+        self.addCleanup(os.environ.pop, 'SWITCHEROO_CONTROL_PROBE')
+
+        self.start_daemon(['--software-gpu', '--probe-graphics'])
+        self.assertEventually(lambda: 'Graphics' in self.get_dbus_property('GPUs')[0] or
+                              self.have_text_in_log('Could not probe graphics APIs'), timeout=200)
+        if self.have_text_in_log('Could not probe graphics APIs'):
+            self.skipTest('no working llvmpipe or lavapipe')
+        graphics = self.get_dbus_property('GPUs')[0]['Graphics']
+        self.assertIn('llvmpipe', graphics.get('Renderer', '') + graphics.get('VulkanDevice', ''))
+
+        self.stop_daemon()
+
+    def test_metrics(self):
+        '''OpenMetrics export'''
+
+        self.add_intel_gpu()
+        metrics = os.path.join(self.testbed.get_root_dir(), 'switcheroo.prom')
+
+        self.start_daemon(['--metrics-file', metrics, '--metrics-interval', '1'])
+        with open(metrics) as f:
+            contents = f.read()
+        self.assertIn('switcheroo_gpu_info{id="pci-0000_00_02_0",name="Intel® UHD Graphics 620 (Kabylake GT2)",'
+                      'driver="i915",default="true",class="integrated",function="physical"} 1\n', contents)
+        self.assertIn('switcheroo_gpus 1\n', contents)
+        self.assertTrue(contents.endswith('# EOF\n'))
+
+        self.add_nouveau_gpu()
+        self.assertEventually(lambda: 'switcheroo_gpus 2\n' in open(metrics).read())
+        self.assertRegex(open(metrics).read(), r'switcheroo_uevents_total [1-9]')
+
+        # Not rewritten when idle
+        time.sleep(1.5)
+        mtime = os.stat(metrics).st_mtime_ns
+        time.sleep(2.5)
+        self.assertEqual(os.stat(metrics).st_mtime_ns, mtime)
+
+        self.stop_daemon()
+
+    def test_lazy_details(self):
+        '''GPU details worked out once, and cached across rescans'''
+
+        self.add_intel_gpu()
+        self.start_daemon()
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+
+        # Nothing is worked out until the GPUs are read
+        time.sleep(0.5)
+        self.assertFalse(self.have_text_in_log('Naming GPU'))
+
+        # But clients are told the GPUs changed
+        signals = []
+        self.dbus.signal_subscribe(None, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                                   SC_PATH, None, Gio.DBusSignalFlags.NONE,
+                                   lambda *args: signals.append(args[5]))
+        self.add_nouveau_gpu()
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 2)
+        self.assertEventually(lambda: any('GPUs' in s[2] for s in signals))
+        self.assertFalse(any('GPUs' in s[1] for s in signals))
+        self.assertFalse(self.have_text_in_log('Naming GPU'))
+
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(sorted([gpu['Name'] for gpu in gpus]),
+                         ['GM108M [GeForce 930MX]', 'Intel® UHD Graphics 620 (Kabylake GT2)'])
+        self.assertEqual(self.count_text_in_log('Naming GPU pci-0000_00_02_0'), 1)
+        self.assertEqual(self.count_text_in_log('Naming GPU pci-0000_01_00_0'), 1)
+
+        # Not worked out again on the next rescan
+        self.add_pci_gpu('amdgpu', '0000:03:00.0', False, 'AMD', 'Radeon RX 6600', 2)
+        self.assertEventually(lambda: self.get_dbus_property('NumGPUs') == 3)
+        self.get_dbus_property('GPUs')
+        self.assertEqual(self.count_text_in_log('Naming GPU pci-0000_00_02_0'), 1)
+        self.assertEqual(self.count_text_in_log('Naming GPU pci-0000_01_00_0'), 1)
+
+        self.stop_daemon()
+
+    def test_replace_handover(self):
+        '''state handed over to a replacement instance'''
+
+        self.add_intel_gpu()
+        self.add_nouveau_gpu()
+        self.start_polkitd(['net.hadess.SwitcherooControl.handover'])
+        self.start_daemon()
+        gpus = self.get_dbus_property('GPUs')
+        self.assertEqual(len(gpus), 2)
+
+        signals = []
+        self.dbus.signal_subscribe(None, 'org.freedesktop.DBus.Properties', 'PropertiesChanged',
+                                   SC_PATH, None, Gio.DBusSignalFlags.NONE,
+                                   lambda *args: signals.append(args[5]))
+
+        old_daemon = self.daemon
+        old_log = self.log
+        self.addCleanup(old_daemon.wait)
+        self.addCleanup(old_daemon.kill)
+        self.start_daemon(['--replace'])
+
+        self.assertEventually(lambda: old_daemon.poll() is not None)
+        self.assertEqual(old_daemon.returncode, 0)
+        with open(old_log.name) as f:
+            self.assertIn('Replaced by a new instance', f.read())
+        self.assertTrue(self.have_text_in_log('Running instance handed over its state'))
+        self.assertEventually(lambda: self.have_text_in_log('Not sending D-Bus event, no properties changed'))
+
+        # Nothing changed, and nothing was worked out again
+        self.assertEqual(signals, [])
+        self.assertEqual(self.get_dbus_property('GPUs'), gpus)
+        self.assertFalse(self.have_text_in_log('Naming GPU'))
+
+        self.stop_daemon()
+
+    def test_telemetry(self):
+        '''shared-memory telemetry ring'''
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'gpu_busy_percent', '42')
+        self.testbed.set_attribute(amd, 'mem_info_vram_used', '1048576')
+        self.testbed.set_attribute(amd, 'mem_info_vram_total', '8589934592')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        self.add_pci_gpu('nouveau', '0000:01:00.0', False, 'NVIDIA Corporation', 'GeForce 930MX', 1)
+
+        self.start_daemon(['--telemetry-interval', '50'])
+        ret, fds = self.proxy.call_with_unix_fd_list_sync('OpenTelemetry',
+                                                          GLib.Variant('(s)', ('pci-0000_03_00_0',)),
+                                                          Gio.DBusCallFlags.NONE, -1, None, None)
+        fd = fds.get(ret.unpack()[0])
+        self.addCleanup(os.close, fd)
+
+        # Readers can't write to the ring
+        with self.assertRaises(OSError):
+            mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+        ring = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+        self.addCleanup(ring.close)
+
+        magic, version, header_size, sample_size, num_slots, interval, state, _, head = \
+            struct.unpack_from('=7IIQ', ring)
+        self.assertEqual(magic, 0x52545753)
+        self.assertEqual((version, header_size, sample_size, interval), (1, 40, 64, 50))
+        self.assertEqual(state, 0)
+        self.assertGreater(head, 0)
+
+        seq, timestamp, flags, busy, mem_busy, temp, power, freq, vram_used, vram_total = \
+            struct.unpack_from('=QQIIIiQQQQ', ring, header_size + ((head - 1) % num_slots) * sample_size)
+        self.assertEqual(seq % 2, 0)
+        self.assertEqual(flags, 1 << 0 | 1 << 2)
+        self.assertEqual(busy, 42)
+        self.assertEqual((vram_used, vram_total), (1048576, 8589934592))
+
+        # Sampled by the daemon, without asking again
+        self.assertEventually(lambda: struct.unpack_from('=Q', ring, 32)[0] > head + 2)
+
+        with self.assertRaises(GLib.GError):
+            self.proxy.call_with_unix_fd_list_sync('OpenTelemetry', GLib.Variant('(s)', ('pci-0000_05_00_0',)),
+                                                   Gio.DBusCallFlags.NONE, -1, None, None)
+
+        # A single reader can't open rings forever
+        for i in range(15):
+            ret, fds = self.proxy.call_with_unix_fd_list_sync('OpenTelemetry',
+                                                              GLib.Variant('(s)', ('pci-0000_03_00_0',)),
+                                                              Gio.DBusCallFlags.NONE, -1, None, None)
+            os.close(fds.get(ret.unpack()[0]))
+        with self.assertRaisesRegex(GLib.GError, 'LimitsExceeded'):
+            self.proxy.call_with_unix_fd_list_sync('OpenTelemetry', GLib.Variant('(s)', ('pci-0000_03_00_0',)),
+                                                   Gio.DBusCallFlags.NONE, -1, None, None)
+
+        self.stop_daemon()
+
+    def test_performance_request(self):
+        '''time-bounded performance level leases'''
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'power_dpm_force_performance_level', 'auto\n')
+        self.testbed.set_attribute(amd, 'hwmon/hwmon3/power1_cap', '150000000\n')
+        self.testbed.set_attribute(amd, 'hwmon/hwmon3/power1_cap_min', '50000000\n')
+        self.testbed.set_attribute(amd, 'hwmon/hwmon3/power1_cap_max', '200000000\n')
+        intel = self.add_pci_gpu('i915', '0000:00:02.0', False, 'Intel Corporation', 'UHD Graphics 620', 1)
+        intel_card = self.drm_nodes[intel][0]
+        self.testbed.set_attribute(intel_card, 'gt_min_freq_mhz', '300\n')
+        self.testbed.set_attribute(intel_card, 'gt_RP0_freq_mhz', '1100\n')
+
+        def read_attr(device, name):
+            with open(self.testbed.get_root_dir() + device + '/' + name) as f:
+                return f.read().strip()
+
+        def request(gpu, options):
+            ret, fds = self.proxy.call_with_unix_fd_list_sync('RequestPerformance',
+                                                              GLib.Variant('(sa{sv})', (gpu, options)),
+                                                              Gio.DBusCallFlags.NONE, -1, None, None)
+            return fds.get(ret.unpack()[0])
+
+        polkitd = self.start_polkitd([])
+
+        # Disabled by default
+        self.start_daemon()
+        with self.assertRaisesRegex(GLib.GError, 'NotSupported'):
+            request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'high')})
+        self.stop_daemon()
+
+        # Only for authorised clients
+        self.start_daemon(['--max-boost-duration', '2'])
+        with self.assertRaisesRegex(GLib.GError, 'AccessDenied'):
+            request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'high')})
+        self.assertEqual(read_attr(amd, 'power_dpm_force_performance_level'), 'auto')
+        polkitd.SetAllowed(['net.hadess.SwitcherooControl.request-performance'])
+
+        # Clamped to the maximum power cap
+        lease1 = request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'high'),
+                                              'PowerCap': GLib.Variant('u', 300000000)})
+        self.assertEqual(read_attr(amd, 'power_dpm_force_performance_level'), 'high')
+        self.assertEqual(read_attr(amd, 'hwmon/hwmon3/power1_cap'), '200000000')
+
+        # Highest level and lowest cap win
+        lease2 = request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'low'),
+                                              'PowerCap': GLib.Variant('u', 100000000),
+                                              'Duration': GLib.Variant('u', 60)})
+        self.assertEqual(read_attr(amd, 'power_dpm_force_performance_level'), 'high')
+        self.assertEqual(read_attr(amd, 'hwmon/hwmon3/power1_cap'), '100000000')
+
+        os.close(lease1)
+        self.assertEventually(lambda: read_attr(amd, 'power_dpm_force_performance_level') == 'low')
+        self.assertEqual(read_attr(amd, 'hwmon/hwmon3/power1_cap'), '100000000')
+
+        # Expires after the policy's maximum duration, even if still open
+        self.assertEventually(lambda: read_attr(amd, 'power_dpm_force_performance_level') == 'auto')
+        self.assertEqual(read_attr(amd, 'hwmon/hwmon3/power1_cap'), '150000000')
+        os.close(lease2)
+
+        with self.assertRaises(GLib.GError):
+            request('pci-0000_00_02_0', {'Level': GLib.Variant('s', 'high')})
+        with self.assertRaises(GLib.GError):
+            request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'turbo')})
+
+        # Each client only gets a few requests at a time
+        leases = [request('pci-0000_03_00_0', {'Level': GLib.Variant('s', 'low')}) for i in range(4)]
+        with self.assertRaisesRegex(GLib.GError, 'LimitsExceeded'):
+            request('pci-0000_03_00_0', {'PowerCap': GLib.Variant('u', 50000000)})
+        self.assertEqual(read_attr(amd, 'hwmon/hwmon3/power1_cap'), '150000000')
+        for lease in leases:
+            os.close(lease)
+        self.assertEventually(lambda: read_attr(amd, 'power_dpm_force_performance_level') == 'auto')
+
+        # Restored by the next instance if the daemon crashes
+        lease3 = request('pci-0000_00_02_0', {'MinFrequency': GLib.Variant('u', 5000)})
+        self.addCleanup(os.close, lease3)
+        self.assertEqual(read_attr(intel_card, 'gt_min_freq_mhz'), '1100')
+        self.stop_daemon()
+        self.assertEqual(read_attr(intel_card, 'gt_min_freq_mhz'), '1100')
+        self.start_daemon()
+        self.assertEqual(read_attr(intel_card, 'gt_min_freq_mhz'), '300')
+
+        self.stop_daemon()
+
+    def test_pcie_errors(self):
+        '''PCIe AER link health'''
+
+        def counters(prefix, total):
+            return 'RxErr 0\nBadTLP %d\n%s %d\n' % (total, prefix, total)
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'aer_dev_correctable', counters('TOTAL_ERR_COR', 3))
+        self.testbed.set_attribute(amd, 'aer_dev_nonfatal', counters('TOTAL_ERR_NONFATAL', 0))
+        self.testbed.set_attribute(amd, 'aer_dev_fatal', counters('TOTAL_ERR_FATAL', 0))
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        self.add_intel_gpu()
+
+        self.start_daemon(['--aer-interval', '1', '--aer-threshold', '60'])
+        health = lambda: {gpu['Id']: gpu.get('LinkHealth') for gpu in self.get_dbus_property('GPUs')}
+        self.assertEqual(health(), {'pci-0000_03_00_0': 'good', 'pci-0000_00_02_0': None})
+
+        # Errors from before the daemon started don't count
+        time.sleep(1.5)
+        self.assertEqual(health()['pci-0000_03_00_0'], 'good')
+
+        # Rescanning doesn't see the link health as a change
+        num_changes = self.count_text_in_log('GPUs changed')
+        self.testbed.uevent(self.drm_nodes[amd][0], 'change')
+        time.sleep(0.5)
+        self.assertEqual(self.count_text_in_log('GPUs changed'), num_changes)
+
+        self.testbed.set_attribute(amd, 'aer_dev_correctable', counters('TOTAL_ERR_COR', 1003))
+        self.assertEventually(lambda: health()['pci-0000_03_00_0'] == 'degraded')
+        self.testbed.set_attribute(amd, 'aer_dev_nonfatal', counters('TOTAL_ERR_NONFATAL', 1))
+        self.assertEventually(lambda: health()['pci-0000_03_00_0'] == 'failing')
+        self.assertEventually(lambda: health()['pci-0000_03_00_0'] == 'good')
+
+        # Not read while suspended
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'suspended')
+        self.testbed.set_attribute(amd, 'aer_dev_fatal', counters('TOTAL_ERR_FATAL', 1))
+        time.sleep(2.5)
+        self.assertEqual(health()['pci-0000_03_00_0'], 'good')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        self.assertEventually(lambda: health()['pci-0000_03_00_0'] == 'failing')
+
+        self.stop_daemon()
+
+    def test_imbalance(self):
+        '''rebalancing hints for saturated discrete GPUs'''
+
+        self.add_intel_gpu()
+        busy = self.add_pci_gpu('amdgpu', '0000:03:00.0', False, 'AMD', 'Radeon RX 7600', 1)
+        self.testbed.set_attribute(busy, 'gpu_busy_percent', '100')
+        self.testbed.set_attribute(busy, 'power/runtime_status', 'active')
+        idle = self.add_pci_gpu('amdgpu', '0000:04:00.0', False, 'AMD', 'Radeon RX 7600', 2)
+        self.testbed.set_attribute(idle, 'power/runtime_status', 'suspended')
+
+        signals = []
+        self.dbus.signal_subscribe(None, 'net.hadess.SwitcherooControl', 'Imbalanced',
+                                   SC_PATH, None, Gio.DBusSignalFlags.NONE,
+                                   lambda *args: signals.append(args[5].unpack()))
+
+        self.start_daemon(['--rebalance-period', '3', '--imbalance-duration', '2'])
+        preferred = lambda: [gpu['Id'] for gpu in self.get_dbus_property('GPUs') if gpu.get('Preferred')]
+        self.assertEqual(preferred(), [])
+
+        self.assertEventually(lambda: signals == [('pci-0000_03_00_0', 'pci-0000_04_00_0')])
+        self.assertEqual(preferred(), ['pci-0000_04_00_0'])
+
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        out = subprocess.run([tool_path, 'launch', 'env'], capture_output=True)
+        self.assertIn(b'DRI_PRIME=pci-0000_04_00_0', out.stdout)
+
+        # Rescanning doesn't see the favoured GPU as a change
+        num_changes = self.count_text_in_log('GPUs changed')
+        self.testbed.uevent(self.drm_nodes[idle][0], 'change')
+        time.sleep(0.5)
+        self.assertEqual(self.count_text_in_log('GPUs changed'), num_changes)
+
+        # Only for a while once the imbalance is gone
+        for node in self.drm_nodes[busy]:
+            self.testbed.remove_device(node)
+        self.testbed.set_attribute_link(busy, 'driver', '../../vfio-pci')
+        self.testbed.uevent(busy, 'bind')
+        self.assertEventually(lambda: preferred() == [], timeout=60)
+        self.assertEqual(len(signals), 1)
+
+        self.stop_daemon()
+
+    def test_energy_attribution(self):
+        '''per-application GPU energy attribution'''
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '1000000\n')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        metrics = os.path.join(self.testbed.get_root_dir(), 'switcheroo.prom')
+
+        def get_usage():
+            return self.proxy.call_sync('GetEnergyUsage', None, Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+        def get_cgroup_usage():
+            return self.proxy.call_sync('GetCgroupUsage', None, Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+        self.start_daemon()
+        with self.assertRaisesRegex(GLib.GError, 'NotSupported'):
+            get_usage()
+        with self.assertRaisesRegex(GLib.GError, 'NotSupported'):
+            get_cgroup_usage()
+        self.stop_daemon()
+
+        self.start_daemon(['--energy-interval', '1', '--metrics-file', metrics, '--metrics-interval', '1'])
+        self.assertEqual(get_usage(), [])
+        # The first reading is the baseline
+        time.sleep(1.5)
+
+        # Nothing has a DRM client open on the GPU
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '3000000\n')
+        self.assertEventually(lambda: get_usage() == [('', 'pci-0000_03_00_0', 2000000, 0)])
+        # Energy without clients isn't spent by any cgroup
+        self.assertEqual(get_cgroup_usage(), [])
+        self.assertEventually(lambda: 'switcheroo_app_gpu_energy_joules_total{app="",id="pci-0000_03_00_0"} 2\n' in open(metrics).read())
+
+        # Not read while suspended, or across suspends
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'suspended')
+        time.sleep(1.5)
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '9000000\n')
+        time.sleep(1.5)
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        time.sleep(1.5)
+        self.assertEqual(get_usage(), [('', 'pci-0000_03_00_0', 2000000, 0)])
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '9500000\n')
+        self.assertEventually(lambda: get_usage() == [('', 'pci-0000_03_00_0', 2500000, 0)])
+
+        self.stop_daemon()
+
+    def test_energy_clients(self):
+        '''GPU energy split between DRM clients'''
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '1000000\n')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+
+        proc = os.path.join(self.testbed.get_root_dir(), 'proc')
+        os.environ['SWITCHEROO_CONTROL_PROC'] = proc
+        self.addCleanup(os.environ.pop, 'SWITCHEROO_CONTROL_PROC')
+
+        def set_client(pid, client_id, engine_ns, memory_kib=0):
+            with open(os.path.join(proc, str(pid), 'fdinfo', '5'), 'w') as f:
+                f.write('pos:\t0\nflags:\t02100002\ndrm-driver:\tamdgpu\n'
+                        'drm-pdev:\t0000:03:00.0\ndrm-client-id:\t%d\n'
+                        'drm-engine-gfx:\t%d ns\ndrm-resident-vram:\t%d KiB\n' % (client_id, engine_ns, memory_kib))
+
+        def add_client(pid, cgroup, comm, client_id):
+            os.makedirs(os.path.join(proc, str(pid), 'fd'))
+            os.makedirs(os.path.join(proc, str(pid), 'fdinfo'))
+            os.symlink('/dev/dri/renderD128', os.path.join(proc, str(pid), 'fd', '5'))
+            with open(os.path.join(proc, str(pid), 'cgroup'), 'w') as f:
+                f.write('0::%s\n' % cgroup)
+            with open(os.path.join(proc, str(pid), 'comm'), 'w') as f:
+                f.write(comm + '\n')
+            set_client(pid, client_id, 1000)
+
+        # Application IDs come from the scopes and services desktops
+        # launch applications in, or the process name otherwise
+        app_slice = '/user.slice/user-1000.slice/user@1000.service/app.slice/'
+        add_client(100, app_slice + 'app-gnome-org.gnome.Shotwell-1234.scope', 'shotwell', 1)
+        add_client(200, app_slice + 'app-flatpak-org.example.My\\x2dApp@12.service', 'my-app', 2)
+        add_client(300, '/user.slice/user-1000.slice/session-2.scope', 'glxgears', 3)
+
+        def get_usage():
+            return self.proxy.call_sync('GetEnergyUsage', None, Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+        def get_cgroup_usage():
+            return self.proxy.call_sync('GetCgroupUsage', None, Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+        self.start_daemon(['--energy-interval', '1'])
+        # The first reading is the baseline
+        time.sleep(1.5)
+
+        # Split in proportion to the clients' engine time
+        self.testbed.set_attribute(amd, 'hwmon/hwmon2/energy1_input', '6000000\n')
+        set_client(100, 1, 1300, 2048)
+        set_client(200, 2, 1100)
+        set_client(300, 3, 1100)
+        self.assertEventually(lambda: get_usage() == [('org.gnome.Shotwell', 'pci-0000_03_00_0', 3000000, 300),
+                                                      ('glxgears', 'pci-0000_03_00_0', 1000000, 100),
+                                                      ('org.example.My-App', 'pci-0000_03_00_0', 1000000, 100)])
+
+        # Summed up per cgroup, with the memory the clients hold
+        self.assertEqual(get_cgroup_usage(),
+                         [(app_slice + 'app-gnome-org.gnome.Shotwell-1234.scope', 'pci-0000_03_00_0', 300, 2097152, 3000000),
+                          ('/user.slice/user-1000.slice/session-2.scope', 'pci-0000_03_00_0', 100, 0, 1000000),
+                          (app_slice + 'app-flatpak-org.example.My\\x2dApp@12.service', 'pci-0000_03_00_0', 100, 0, 1000000)])
+
+        self.stop_daemon()
+
+    def test_history(self):
+        '''downsampled GPU usage history'''
+
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', True, 'AMD', 'Radeon RX 7600', 0)
+        self.testbed.set_attribute(amd, 'gpu_busy_percent', '42')
+        self.testbed.set_attribute(amd, 'mem_info_vram_used', '1048576')
+        self.testbed.set_attribute(amd, 'mem_info_vram_total', '8589934592')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        history_dir = os.path.join(self.testbed.get_root_dir(), 'history')
+
+        def get_history(since):
+            now = int(time.time())
+            return self.proxy.call_sync('GetHistory', GLib.Variant('(sxx)', ('pci-0000_03_00_0', now - since, now)),
+                                        Gio.DBusCallFlags.NONE, -1, None).unpack()
+
+        self.start_daemon()
+        with self.assertRaisesRegex(GLib.GError, 'NotSupported'):
+            get_history(60)
+        self.stop_daemon()
+
+        self.start_daemon(['--history-dir', history_dir])
+        self.assertEventually(lambda: len(get_history(60)[1]) >= 2)
+        resolution, samples = get_history(60)
+        self.assertEqual(resolution, 1)
+        timestamp, flags, busy, busy_max, vram, vram_max, power, power_max = samples[-1]
+        self.assertEqual(flags, 1 << 0 | 1 << 2)
+        self.assertEqual((busy, busy_max), (42.0, 42))
+        self.assertEqual((vram, vram_max), (1048576, 1048576))
+
+        # Suspended time counts as idle
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'suspended')
+        self.assertEventually(lambda: get_history(60)[1][-1][1:4] == (1 << 31, 0.0, 0))
+
+        # Coarser over longer ranges
+        resolution, samples = get_history(3 * 3600)
+        self.assertEqual(resolution, 60)
+        self.assertEqual(samples[-1][3], 42)
+        self.assertEqual(get_history(7 * 86400)[0], 900)
+        self.stop_daemon()
+
+        # Fixed size, and kept across restarts
+        path = os.path.join(history_dir, 'pci-0000_03_00_0.history')
+        self.assertEqual(os.path.getsize(path), 48 + (600 + 1440 + 2880) * 64)
+        self.start_daemon(['--history-dir', history_dir])
+        self.assertEqual(get_history(3600)[1][0][3], 42)
+
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        out = subprocess.run([tool_path, 'history', '--gpu=0', '--since=10m', '--json'], capture_output=True)
+        self.assertEqual(out.returncode, 0)
+        history = json.loads(out.stdout)
+        self.assertEqual(history['id'], 'pci-0000_03_00_0')
+        self.assertEqual(history['resolution'], 1)
+        self.assertEqual(max(s['busy-percent-max'] for s in history['samples']), 42)
+
+        out = subprocess.run([tool_path, 'history', '--since=soon'], capture_output=True)
+        self.assertEqual(out.returncode, 1)
+
+        self.stop_daemon()
+
+    def test_rate_limit(self):
+        '''per-client request accounting and rate limiting'''
+
+        self.add_intel_gpu()
+        metrics = os.path.join(self.testbed.get_root_dir(), 'switcheroo.prom')
+
+        self.start_daemon(['--rate-limit', '1', '--rate-burst', '5',
+                           '--metrics-file', metrics, '--metrics-interval', '1'])
+        self.get_dbus_property('GPUs')
+
+        # Only reading the device lists counts, and is rejected over budget
+        for i in range(20):
+            self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+        with self.assertRaisesRegex(GLib.GError, 'LimitsExceeded'):
+            for i in range(20):
+                self.get_dbus_property('GPUs')
+
+        # Over-budget calls are delayed, then rejected
+        with self.assertRaisesRegex(GLib.GError, 'LimitsExceeded'):
+            for i in range(20):
+                self.proxy.call('VgaSwitcherooPowerOff', None, Gio.DBusCallFlags.NONE, -1, None, None)
+            self.proxy.call_sync('VgaSwitcherooPowerOff', None, Gio.DBusCallFlags.NONE, -1, None)
+        self.assertTrue(self.have_text_in_log('Deferring VgaSwitcherooPowerOff call from'))
+
+        def get_throttled():
+            with open(metrics) as f:
+                for line in f:
+                    if line.startswith('switcheroo_client_throttled_total{'):
+                        return int(line.split()[-1])
+            return 0
+        self.assertEventually(lambda: get_throttled() >= 15)
+
+        self.stop_daemon()
+
+    def test_sd_notify(self):
+        '''systemd readiness and watchdog notifications'''
+
+        self.add_intel_gpu()
+        metrics = os.path.join(self.testbed.get_root_dir(), 'switcheroo.prom')
+
+        notify = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+        self.addCleanup(notify.close)
+        notify_path = os.path.join(self.testbed.get_root_dir(), 'notify')
+        notify.bind(notify_path)
+        notify.settimeout(5)
+        os.environ['NOTIFY_SOCKET'] = notify_path
+        self.addCleanup(os.environ.pop, 'NOTIFY_SOCKET')
+        os.environ['WATCHDOG_USEC'] = '200000'
+        self.addCleanup(os.environ.pop, 'WATCHDOG_USEC')
+
+        self.start_daemon(['--metrics-file', metrics])
+        messages = set()
+        while messages != {b'READY=1', b'WATCHDOG=1'}:
+            messages.add(notify.recv(64))
+        # Fed regularly while the main loop is healthy
+        for i in range(3):
+            self.assertEqual(notify.recv(64), b'WATCHDOG=1')
+
+        self.assertEqual(self.get_dbus_property('NumGPUs'), 1)
+        self.assertEventually(lambda: 'switcheroo_main_loop_stalls_total 0\n' in open(metrics).read())
+
+        self.stop_daemon()
+
     def test_cmdline_tool(self):
         '''test the command-line tool'''
 
@@ -526,6 +1732,76 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(out.returncode, 0, "'switcherooctl launch --gpu=1' failed")
         assert('DRI_PRIME=pci-0000_01_00_0' in str(out.stdout))
 
+    def test_cmdline_tool_report(self):
+        '''GPU usage report of launched commands'''
+
+        self.add_intel_gpu()
+        self.add_nouveau_gpu()
+        self.start_daemon()
+
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+
+        out = subprocess.run([tool_path, 'launch', '--gpu=1', '--report=json', '--', 'sh', '-c', 'echo $DRI_PRIME; exit 3'],
+                             capture_output=True)
+        self.assertEqual(out.returncode, 3)
+        self.assertEqual(out.stdout, b'pci-0000_01_00_0\n')
+        report = json.loads(out.stderr)
+        self.assertEqual(report['command'], ['sh', '-c', 'echo $DRI_PRIME; exit 3'])
+        self.assertEqual(report['exit-status'], 3)
+        self.assertEqual(report['requested']['id'], 'pci-0000_01_00_0')
+        self.assertEqual(report['gpus'], [])
+        self.assertEqual(report['misrouted'], False)
+
+        out = subprocess.run([tool_path, 'launch', '--report', 'true'], capture_output=True)
+        self.assertEqual(out.returncode, 0)
+        self.assertIn(b'No GPU was used', out.stderr)
+
+        out = subprocess.run([tool_path, 'launch', '--report=xml', 'true'], capture_output=True)
+        self.assertEqual(out.returncode, 1)
+
+    def test_cmdline_tool_doctor(self):
+        '''misconfiguration diagnostics'''
+
+        self.add_intel_gpu()
+        amd = self.add_pci_gpu('amdgpu', '0000:03:00.0', False, 'AMD', 'Radeon RX 7600', 1)
+        self.testbed.set_attribute(amd, 'power/control', 'on')
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'active')
+        self.testbed.set_attribute(amd, 'current_link_width', '4')
+        self.testbed.set_attribute(amd, 'max_link_width', '16')
+        self.start_daemon()
+
+        builddir = os.getenv('top_builddir', '.')
+        tool_path = os.path.join(builddir, 'src', 'switcherooctl')
+        env = os.environ.copy()
+        env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
+
+        def doctor():
+            out = subprocess.run([tool_path, 'doctor', '--json'], capture_output=True, env=env)
+            findings = json.loads(out.stdout)['findings']
+            return out.returncode, {(f['check'], f['severity']) for f in findings if f['gpu'] == 'pci-0000_03_00_0'}
+
+        returncode, findings = doctor()
+        self.assertEqual(returncode, 0)
+        self.assertIn(('runtime-pm', 'warning'), findings)
+        self.assertIn(('pcie-link', 'warning'), findings)
+
+        params = os.path.join(self.testbed.get_root_dir(), 'sys', 'module', 'amdgpu', 'parameters')
+        os.makedirs(params)
+        with open(os.path.join(params, 'runpm'), 'w') as f:
+            f.write('0\n')
+        returncode, findings = doctor()
+        self.assertEqual(returncode, 1)
+        self.assertIn(('runtime-pm', 'error'), findings)
+
+        # The link of suspended GPUs isn't looked at
+        self.testbed.set_attribute(amd, 'power/runtime_status', 'suspended')
+        returncode, findings = doctor()
+        self.assertNotIn(('pcie-link', 'warning'), findings)
+        self.assertIn(('pcie-link', 'info'), findings)
+
+        self.stop_daemon()
+
     #
     # Helper methods
     #